@@ -0,0 +1,966 @@
+// ReSharper disable CppTooWideScopeInitStatement
+#include "ble_uart_client.h"
+#include "ble_uart_fleet.h"
+#include "bluez_transport.h"
+#include "fake_bluez_service.h"
+#include "line_framer.h"
+#include "link_bridge.h"
+#include "memory_transport.h"
+#include "session_reader.h"
+#include "session_recorder.h"
+#include "telemetry_decoder.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <sdbus-c++/sdbus-c++.h>
+
+using namespace mimi;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+struct Options {
+    size_t iterations = 20000;
+    uint16_t mtu = 23;
+    std::chrono::microseconds latency { 0 };
+    double lossRate = 0.0;
+    // Of the congested link in bench_congestion
+    uint32_t throughput = 16 * 1024;
+    size_t txBufferSize = 0;
+    // Connect and disconnect cycles of the soak test; zero runs the benchmarks instead
+    size_t soakCycles = 0;
+};
+
+Options parse_options(const int argc, char* argv[]) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        const auto value = [&](const std::string& prefix) -> const char* {
+            return arg.rfind(prefix, 0) == 0 ? argv[i] + prefix.size() : nullptr;
+        };
+        if (const char* v = value("--iterations=")) options.iterations = std::stoul(v);
+        else if (const char* v = value("--mtu=")) options.mtu = static_cast<uint16_t>(std::stoul(v));
+        else if (const char* v = value("--latency-us=")) options.latency = std::chrono::microseconds(std::stol(v));
+        else if (const char* v = value("--loss=")) options.lossRate = std::stod(v);
+        else if (const char* v = value("--throughput=")) options.throughput = static_cast<uint32_t>(std::stoul(v));
+        else if (const char* v = value("--tx-buffer=")) options.txBufferSize = std::stoul(v);
+        else if (const char* v = value("--soak=")) options.soakCycles = std::stoul(v);
+        else if (arg == "--quick") options.iterations = 2000;
+        else {
+            std::cerr << "Unknown option " << arg << "\n"
+                      << "Options: --iterations=N --mtu=N --latency-us=N --loss=P --throughput=N --tx-buffer=N --quick --soak=N" << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+    }
+    return options;
+}
+
+LinkOptions link_options(const Options& options) {
+    LinkOptions link;
+    link.mtu = options.mtu;
+    link.latency = options.latency;
+    link.lossRate = options.lossRate;
+    return link;
+}
+
+double seconds_since(const Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+void report(const std::string& name, const double value, const std::string& unit) {
+    std::cout << name << " " << value << " " << unit << "\n";
+}
+
+void report_percentiles(const std::string& name, std::vector<double> samples, const std::string& unit) {
+    if (samples.empty()) return;
+    std::sort(samples.begin(), samples.end());
+    const auto at = [&](const double q) { return samples[static_cast<size_t>(q * static_cast<double>(samples.size() - 1))]; };
+    report(name + ".p50", at(0.5), unit);
+    report(name + ".p99", at(0.99), unit);
+    report(name + ".max", samples.back(), unit);
+}
+
+void report_histogram(const std::string& name, const LatencyHistogram& histogram) {
+    const auto us = [](const std::chrono::nanoseconds duration) { return static_cast<double>(duration.count()) / 1000.0; };
+    report(name + ".p50", us(histogram.percentile(50)), "us");
+    report(name + ".p99", us(histogram.percentile(99)), "us");
+    report(name + ".max", us(histogram.max()), "us");
+}
+
+void wait_for(BleUartClient& client, const std::function<bool()>& done) {
+    const int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    epoll_event event {};
+    event.events = EPOLLIN;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, client.getCallbackFd(), &event);
+    const auto deadline = Clock::now() + std::chrono::seconds(30);
+    while (!done() && Clock::now() < deadline) {
+        epoll_wait(epollFd, &event, 1, 100);
+        client.processCallbacks();
+    }
+    close(epollFd);
+}
+
+void bench_send(const Options& options, const BleUartClient::WriteMode writeMode, const std::string& name) {
+    auto transport = std::make_unique<MemoryTransport>(link_options(options));
+    MemoryTransport& link = *transport;
+    link.setPeer(nullptr);
+    BleUartClient client(std::move(transport));
+    client.setWriteMode(writeMode);
+    if (!client.connect("Mimi", false)) return;
+
+    const std::string command = "M 100 -100\n";
+    // Acknowledged writes pause between chunks, so keep that run short
+    const size_t count = writeMode == BleUartClient::WriteMode::WithResponse ? std::max<size_t>(options.iterations / 20, 1) : options.iterations;
+    const auto start = Clock::now();
+    for (size_t i = 0; i < count; ++i) {
+        if (!client.send(command)) break;
+    }
+    link.flush();
+    const double elapsed = seconds_since(start);
+    report(name + ".commands", static_cast<double>(count) / elapsed, "cmd/s");
+    report(name + ".throughput", static_cast<double>(link.getCounters().writtenBytes) / elapsed / 1024.0, "KiB/s");
+    client.disconnect();
+}
+
+void bench_send_async(const Options& options, const BleUartClient::WriteMode writeMode, const std::string& name) {
+    auto transport = std::make_unique<MemoryTransport>(link_options(options));
+    MemoryTransport& link = *transport;
+    link.setPeer(nullptr);
+    BleUartClient client(std::move(transport));
+    client.setWriteMode(writeMode);
+    if (!client.connect("Mimi", false)) return;
+
+    const std::string command = "M 100 -100\n";
+    const size_t count = options.iterations;
+    std::future<bool> last;
+    const auto start = Clock::now();
+    for (size_t i = 0; i < count; ++i) {
+        last = client.sendAsync(command);
+    }
+    last.wait();
+    link.flush();
+    const double elapsed = seconds_since(start);
+    const auto stats = client.getSendQueueStats();
+    report(name + ".commands", static_cast<double>(count) / elapsed, "cmd/s");
+    report(name + ".commands_per_write", static_cast<double>(count) / static_cast<double>(std::max<uint64_t>(stats.writes, 1)), "cmd");
+    report(name + ".queue_high_water_mark", static_cast<double>(stats.highWaterMark), "cmd");
+    report_histogram(name + ".send_to_write", client.getMetrics().sendToWrite);
+    report_histogram(name + ".write", client.getMetrics().write);
+    client.disconnect();
+}
+
+void bench_congestion(const Options& options) {
+    // A link that carries fewer bytes than the client can write and refuses writes once its buffer is full
+    LinkOptions link = link_options(options);
+    link.throughput = std::max<uint32_t>(options.throughput, 1);
+    const size_t chunkSize = link.mtu > 3 ? link.mtu - 3u : 1;
+    link.txBufferSize = options.txBufferSize > 0 ? options.txBufferSize : 8 * chunkSize;
+    auto transport = std::make_unique<MemoryTransport>(link);
+    MemoryTransport& memory = *transport;
+    memory.setPeer(nullptr);
+    BleUartClient client(std::move(transport));
+    client.setWriteMode(BleUartClient::WriteMode::WithoutResponse);
+    client.setCommandPacking(false);
+    if (!client.connect("Mimi", false)) return;
+
+    // About two seconds of traffic at the link's throughput
+    const std::string command = "M 100 -100\n";
+    const size_t count = std::max<size_t>(2 * link.throughput / command.size(), 1);
+    std::vector<std::future<bool>> written;
+    written.reserve(count);
+    const auto start = Clock::now();
+    for (size_t i = 0; i < count; ++i) {
+        written.push_back(client.sendAsync(command));
+    }
+    size_t failed = 0;
+    for (auto& done : written) {
+        if (!done.get()) ++failed;
+    }
+    memory.flush();
+    const double elapsed = seconds_since(start);
+    const auto pacer = client.getPacerStats();
+    report("congestion.throughput", static_cast<double>(memory.getCounters().writtenBytes) / elapsed / 1024.0, "KiB/s");
+    report("congestion.link_throughput", link.throughput / 1024.0, "KiB/s");
+    report("congestion.failed_commands", static_cast<double>(failed), "cmd");
+    report("congestion.busy_retries", static_cast<double>(client.getMetrics().busyRetries), "writes");
+    report("congestion.window_decreases", static_cast<double>(pacer.decreases), "times");
+    report("congestion.final_window", static_cast<double>(pacer.window), "bytes");
+    client.disconnect();
+}
+
+void bench_control_channel(const Options& options) {
+    LinkOptions link = link_options(options);
+    // A joystick producing setpoints far faster than acknowledged writes can carry them
+    link.latency = std::max(link.latency, std::chrono::microseconds(1000));
+    const auto inputPeriod = std::chrono::microseconds(100);
+    const size_t count = std::max<size_t>(options.iterations / 10, 100);
+
+    for (const bool latest : { false, true }) {
+        auto transport = std::make_unique<MemoryTransport>(link);
+        MemoryTransport& memory = *transport;
+        memory.setPeer(nullptr);
+        BleUartClient client(std::move(transport));
+        if (!client.connect("Mimi", false)) return;
+
+        auto due = Clock::now();
+        std::future<bool> last;
+        for (size_t i = 0; i < count; ++i) {
+            const std::string setpoint = str("M ", i % 200, " ", 200 - i % 200, "\n");
+            if (latest) {
+                client.sendLatest("M", setpoint);
+            } else {
+                last = client.sendAsync(setpoint);
+            }
+            due += inputPeriod;
+            std::this_thread::sleep_until(due);
+        }
+        if (last.valid()) last.wait();
+        // Lets the last update of the channel go out
+        std::this_thread::sleep_for(link.latency * 4);
+        memory.flush();
+
+        const std::string name = latest ? "control.send_latest" : "control.send_async";
+        // How old a setpoint was when it reached the link
+        report_histogram(name + ".age", client.getMetrics().sendToWrite);
+        if (latest) {
+            const auto stats = client.getChannelStats("M");
+            report(name + ".superseded", static_cast<double>(stats.superseded) / static_cast<double>(stats.updates), "ratio");
+        }
+        client.disconnect();
+    }
+}
+
+void bench_binary_framing(const Options& options) {
+    // Motor setpoints, as text and as a command byte followed by two signed bytes
+    const std::string text = "M 100 -100\n";
+    const uint8_t binary[] = { 'M', 100, static_cast<uint8_t>(-100) };
+    const size_t count = options.iterations;
+
+    for (const bool useBinary : { false, true }) {
+        auto transport = std::make_unique<MemoryTransport>(link_options(options));
+        MemoryTransport& link = *transport;
+        // A robot that understands the handshake and then swallows everything
+        link.setPeer([](MemoryTransport& robot, const std::string_view written) {
+            if (written == str(BleUartClient::BinaryFramingRequest, "\n")) robot.notify(str(BleUartClient::BinaryFramingAccepted, "\n"));
+        });
+        BleUartClient client(std::move(transport));
+        client.setWriteMode(BleUartClient::WriteMode::WithoutResponse);
+        if (!client.connect("Mimi", false)) return;
+        if (useBinary && !client.negotiateBinaryFraming()) {
+            report("binary_framing.negotiated", 0, "bool");
+            return;
+        }
+
+        const auto before = link.getCounters();
+        std::future<bool> last;
+        for (size_t i = 0; i < count; ++i) {
+            last = useBinary ? client.sendBinaryAsync(binary, sizeof(binary)) : client.sendAsync(text);
+        }
+        last.wait();
+        link.flush();
+        const auto after = link.getCounters();
+        const std::string name = useBinary ? "framing.binary" : "framing.text";
+        report(name + ".bytes_per_command", static_cast<double>(after.writtenBytes - before.writtenBytes) / static_cast<double>(count), "B");
+        report(name + ".commands_per_write", static_cast<double>(count) / static_cast<double>(after.writes - before.writes), "cmd");
+        client.disconnect();
+    }
+}
+
+void bench_requests(const Options& options) {
+    LinkOptions link = link_options(options);
+    // Replies are pointless to measure without a round trip
+    link.latency = std::max(link.latency, std::chrono::microseconds(1000));
+    BleUartClient client(std::make_unique<MemoryTransport>(link));
+    client.setWriteMode(BleUartClient::WriteMode::WithoutResponse);
+    if (!client.connect("Mimi", false)) return;
+
+    const size_t count = std::max<size_t>(options.iterations / 20, 10);
+    auto start = Clock::now();
+    for (size_t i = 0; i < count; ++i) {
+        client.request("Q " + std::to_string(i) + "\n").reply.wait();
+    }
+    report("requests.serial", static_cast<double>(count) / seconds_since(start), "req/s");
+
+    constexpr size_t window = 16;
+    std::deque<std::future<BleUartClient::Reply>> inFlight;
+    size_t replied = 0;
+    start = Clock::now();
+    for (size_t i = 0; i < count; ++i) {
+        if (inFlight.size() == window) {
+            replied += inFlight.front().get().status == BleUartClient::RequestStatus::Replied;
+            inFlight.pop_front();
+        }
+        inFlight.push_back(client.request("Q " + std::to_string(i) + "\n").reply);
+    }
+    for (auto& reply : inFlight) {
+        replied += reply.get().status == BleUartClient::RequestStatus::Replied;
+    }
+    report("requests.pipelined", static_cast<double>(count) / seconds_since(start), "req/s");
+    report("requests.pipelined.replied", static_cast<double>(replied) / static_cast<double>(count), "ratio");
+    const auto stats = client.getRequestStats();
+    report("requests.round_trip.mean", static_cast<double>(stats.meanRoundTripTime.count()) / 1000.0, "ms");
+    report("requests.round_trip.max", static_cast<double>(stats.maxRoundTripTime.count()) / 1000.0, "ms");
+    client.disconnect();
+}
+
+void bench_framing(const Options& options) {
+    std::string stream;
+    for (size_t i = 0; i < options.iterations * 50; ++i) {
+        stream += "T " + std::to_string(i) + " 23.5 1013\r\n";
+    }
+    const size_t fragmentSize = std::max<size_t>(options.mtu, 4) - 3;
+
+    size_t lines = 0;
+    LineFramer framer;
+    framer.setHandlers([&](std::string_view) { ++lines; }, nullptr);
+    std::string copy = stream;
+    auto start = Clock::now();
+    for (size_t offset = 0; offset < copy.size(); offset += fragmentSize) {
+        framer.feed(copy.data() + offset, std::min(fragmentSize, copy.size() - offset));
+    }
+    double elapsed = seconds_since(start);
+    report("rx_framing.line_framer", static_cast<double>(stream.size()) / elapsed / (1024.0 * 1024.0), "MiB/s");
+    report("rx_framing.line_framer.lines", static_cast<double>(lines) / elapsed, "lines/s");
+
+    // The reassembly BleUartClient used before LineFramer, as a reference point
+    lines = 0;
+    std::string buffer;
+    start = Clock::now();
+    for (size_t offset = 0; offset < stream.size(); offset += fragmentSize) {
+        buffer += stream.substr(offset, fragmentSize);
+        size_t pos;
+        while ((pos = buffer.find('\n')) != std::string::npos) {
+            std::string rawMessage = buffer.substr(0, pos);
+            buffer.erase(0, pos + 1);
+            std::string message;
+            std::copy_if(rawMessage.begin(), rawMessage.end(), std::back_inserter(message),
+                         [](const char c) { return c != '\r'; });
+            ++lines;
+        }
+    }
+    elapsed = seconds_since(start);
+    report("rx_framing.legacy", static_cast<double>(stream.size()) / elapsed / (1024.0 * 1024.0), "MiB/s");
+}
+
+struct Telemetry {
+    int left;
+    int right;
+    double distance;
+    bool onLine;
+};
+
+constexpr auto TelemetryFormats = std::make_tuple(
+    messageFormat("T", ' ', &Telemetry::left, &Telemetry::right, &Telemetry::distance, &Telemetry::onLine));
+
+void bench_telemetry(const Options& options) {
+    std::vector<std::string> lines;
+    for (size_t i = 0; i < 256; ++i) {
+        lines.push_back(str("T ", static_cast<int>(i) - 128, " ", 1000 - static_cast<int>(i), " ", i * 0.25, " ", i % 2));
+    }
+    const size_t count = options.iterations * 50;
+    int64_t checksum = 0;
+
+    // What a ReceiveCallback consumer does today: a string per line, parsed with a stream
+    BleUartClient::ReceiveCallback stringCallback = [&](const std::string&, const std::string& text) {
+        std::istringstream stream(text);
+        std::string prefix;
+        Telemetry telemetry {};
+        if (stream >> prefix >> telemetry.left >> telemetry.right >> telemetry.distance >> telemetry.onLine && prefix == "T") {
+            checksum += telemetry.left + telemetry.right;
+        }
+    };
+    const std::string alias = "Mimi";
+    auto start = Clock::now();
+    for (size_t i = 0; i < count; ++i) {
+        const std::string_view line = lines[i % lines.size()];
+        stringCallback(alias, std::string(line));
+    }
+    report("telemetry.istringstream", static_cast<double>(count) / seconds_since(start) / 1e6, "Mlines/s");
+
+    auto decoder = makeTelemetryDecoder(TelemetryFormats);
+    decoder.onMessage<Telemetry>([&](const std::string&, const Telemetry& telemetry) {
+        checksum -= telemetry.left + telemetry.right;
+    });
+    const auto viewCallback = decoder.receiveViewCallback();
+    start = Clock::now();
+    for (size_t i = 0; i < count; ++i) {
+        viewCallback(alias, lines[i % lines.size()]);
+    }
+    report("telemetry.typed_decoder", static_cast<double>(count) / seconds_since(start) / 1e6, "Mlines/s");
+    // Both paths must have seen the same values
+    report("telemetry.checksum_mismatch", static_cast<double>(checksum != 0), "bool");
+}
+
+void bench_dispatch(const Options& options, const BleUartClient::CallbackDelivery delivery, const std::string& name) {
+    auto transport = std::make_unique<MemoryTransport>(link_options(options));
+    MemoryTransport& link = *transport;
+    BleUartClient client(std::move(transport));
+    client.setCallbackDelivery(delivery);
+    if (!client.connect("Mimi", false)) return;
+
+    const size_t count = options.iterations;
+    std::vector<Clock::time_point> sent(count);
+    std::vector<double> latencies;
+    latencies.reserve(count);
+    // Inline callbacks run on the robot's thread, so the count is all the waiting side looks at
+    std::atomic<size_t> dispatched = 0;
+    client.setReceiveViewCallback([&](const std::string&, const std::string_view line) {
+        size_t index = 0;
+        for (const char c : line) index = index * 10 + static_cast<size_t>(c - '0');
+        if (index < count) {
+            latencies.push_back(std::chrono::duration<double, std::micro>(Clock::now() - sent[index]).count());
+            ++dispatched;
+        }
+    });
+
+    std::thread robot([&] {
+        for (size_t i = 0; i < count; ++i) {
+            sent[i] = Clock::now();
+            link.notify(std::to_string(i) + "\n");
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+    });
+    wait_for(client, [&] { return dispatched + link.getCounters().lostPackets >= count; });
+    robot.join();
+    report_percentiles(name, latencies, "us");
+    client.disconnect();
+}
+
+void bench_connect(const Options& options) {
+    auto transport = std::make_unique<MemoryTransport>(link_options(options));
+    BleUartClient client(std::move(transport));
+    std::vector<double> samples;
+    const size_t count = std::max<size_t>(options.iterations / 100, 10);
+    for (size_t i = 0; i < count; ++i) {
+        const auto start = Clock::now();
+        if (!client.connect("Mimi", false)) return;
+        samples.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+        client.disconnect();
+    }
+    report_percentiles("connect_time.memory", samples, "us");
+}
+
+void bench_recover(const Options& options) {
+    auto transport = std::make_unique<MemoryTransport>(link_options(options));
+    MemoryTransport& link = *transport;
+    BleUartClient client(std::move(transport));
+    if (!client.connect("Mimi", true)) return;
+
+    // The robot is out of range for a while, then comes back and BlueZ reports it
+    constexpr auto outage = std::chrono::milliseconds(50);
+    const size_t count = std::max<size_t>(options.iterations / 1000, 5);
+    for (size_t i = 0; i < count; ++i) {
+        link.dropLink();
+        std::this_thread::sleep_for(outage);
+        link.restoreLink();
+        wait_for(client, [&] { return client.getReconnectStats().recoveries > i; });
+    }
+    const auto stats = client.getReconnectStats();
+    std::cout << "# outage " << outage.count() << " ms\n";
+    report("time_to_recover.mean", static_cast<double>(stats.meanTimeToRecover.count()) / 1000.0, "ms");
+    report("time_to_recover.max", static_cast<double>(stats.maxTimeToRecover.count()) / 1000.0, "ms");
+    report("time_to_recover.attempts", static_cast<double>(stats.attempts) / static_cast<double>(count), "per_recovery");
+    client.disconnect();
+}
+
+// Connects a subscriber to the bridge's Unix domain socket
+int connect_subscriber(const std::string& path) {
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_un address {};
+    address.sun_family = AF_UNIX;
+    std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    if (connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Reads from every subscriber until each has received the given number of more lines; false after a timeout
+bool read_lines(const std::vector<int>& fds, const size_t lines) {
+    std::vector<pollfd> polls;
+    for (const int fd : fds) polls.push_back({ fd, POLLIN, 0 });
+    std::vector<size_t> received(fds.size());
+    size_t finished = 0;
+    char buffer[64 * 1024];
+    const auto deadline = Clock::now() + std::chrono::seconds(30);
+    while (finished < fds.size() && Clock::now() < deadline) {
+        if (poll(polls.data(), polls.size(), 100) <= 0) continue;
+        for (size_t i = 0; i < polls.size(); ++i) {
+            if (polls[i].revents == 0) continue;
+            const ssize_t count = read(polls[i].fd, buffer, sizeof(buffer));
+            if (count <= 0) {
+                polls[i].fd = -1;
+                continue;
+            }
+            const size_t before = received[i];
+            received[i] += static_cast<size_t>(std::count(buffer, buffer + count, '\n'));
+            if (before < lines && received[i] >= lines) ++finished;
+        }
+    }
+    return finished == fds.size();
+}
+
+// Runs a bridge in front of a robot on an in-memory link while body drives it, and returns the bridge's counters.
+// Body gets the link and the socket path; subscribers it connects get the "@bridge state" line first.
+LinkBridge::Stats with_bridge(LinkBridge::Options options, const std::function<void(MemoryTransport&, const std::string&)>& body) {
+    options.socketPath = (std::filesystem::temp_directory_path() / "ble_bench_bridge.sock").string();
+    LinkOptions link;
+    link.mtu = 247;
+    auto transport = std::make_unique<MemoryTransport>(link);
+    MemoryTransport& memory = *transport;
+    BleUartClient client(std::move(transport));
+    // Every line reaches the subscribers, however far the bridge falls behind the robot
+    client.setOverflowPolicy(BleUartClient::OverflowPolicy::Block);
+    LinkBridge bridge(client, options);
+    if (!bridge.listen() || !client.connect("Mimi", false)) return {};
+    std::thread loop([&] { bridge.run(); });
+    body(memory, options.socketPath);
+    bridge.stop();
+    loop.join();
+    client.disconnect();
+    return bridge.getStats();
+}
+
+void bench_bridge(const Options& options) {
+    // Every robot line goes to each of many subscribers
+    constexpr size_t Subscribers = 256;
+    const size_t lines = std::max<size_t>(options.iterations / 10, 1);
+    LinkBridge::Options fanOutOptions;
+    fanOutOptions.maxBacklog = 64 * 1024 * 1024;
+    double fanOutSeconds = 0;
+    size_t connected = 0;
+    with_bridge(fanOutOptions, [&](MemoryTransport& memory, const std::string& path) {
+        std::vector<int> fds;
+        for (size_t i = 0; i < Subscribers; ++i) {
+            const int fd = connect_subscriber(path);
+            if (fd >= 0) fds.push_back(fd);
+        }
+        connected = fds.size();
+        if (read_lines(fds, 1)) {
+            const auto start = Clock::now();
+            std::thread robot([&] {
+                for (size_t i = 0; i < lines; ++i) memory.notify("T " + std::to_string(i) + " 1234 -567 89\n");
+            });
+            if (read_lines(fds, lines)) fanOutSeconds = seconds_since(start);
+            robot.join();
+        }
+        for (const int fd : fds) close(fd);
+    });
+    if (fanOutSeconds == 0) {
+        std::cout << "# bridge fan-out failed\n";
+    } else {
+        report("bridge.fan_out.lines", static_cast<double>(lines) / fanOutSeconds, "lines/s");
+        report("bridge.fan_out.deliveries", static_cast<double>(lines * connected) / fanOutSeconds, "lines/s");
+        report("bridge.fan_out.subscribers", static_cast<double>(connected), "subscribers");
+    }
+
+    // One subscriber sends ten times as many commands as each of three others, and sends them first
+    constexpr size_t Polite = 3;
+    const size_t commands = std::max<size_t>(options.iterations / 200, 10);
+    const size_t total = commands * (10 + Polite);
+    std::mutex writtenMutex;
+    std::string pending;
+    std::vector<char> senders;
+    with_bridge({}, [&](MemoryTransport& memory, const std::string& path) {
+        memory.setPeer([&](MemoryTransport&, const std::string_view written) {
+            const std::lock_guard lock(writtenMutex);
+            pending.append(written);
+            size_t end;
+            while ((end = pending.find('\n')) != std::string::npos) {
+                senders.push_back(pending[0]);
+                pending.erase(0, end + 1);
+            }
+        });
+        std::vector<int> fds;
+        for (size_t i = 0; i <= Polite; ++i) fds.push_back(connect_subscriber(path));
+        if (std::count(fds.begin(), fds.end(), -1) == 0 && read_lines(fds, 1)) {
+            for (size_t i = 0; i < fds.size(); ++i) {
+                std::string script;
+                // Commands are told apart by their first letter: F for the flooder, P for the others
+                for (size_t j = 0; j < (i == 0 ? commands * 10 : commands); ++j) script += (i == 0 ? "F " : "P ") + std::to_string(j) + "\n";
+                [[maybe_unused]] const auto sent = write(fds[i], script.data(), script.size());
+            }
+            const auto deadline = Clock::now() + std::chrono::seconds(30);
+            while (Clock::now() < deadline) {
+                {
+                    const std::lock_guard lock(writtenMutex);
+                    if (senders.size() >= total) break;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+        for (const int fd : fds) close(fd);
+    });
+    if (senders.size() < total) {
+        std::cout << "# bridge fairness failed\n";
+    } else {
+        // While the others have commands waiting too, a fair bridge gives the flooder one turn in four
+        const auto first = std::find(senders.begin(), senders.end(), 'P');
+        const auto last = std::find(senders.rbegin(), senders.rend(), 'P').base();
+        const auto contended = std::max<ptrdiff_t>(last - first, 1);
+        report("bridge.fairness.flooder_share", static_cast<double>(std::count(first, last, 'F')) / static_cast<double>(contended), "ratio");
+    }
+
+    // A subscriber that never reads is disconnected, and one that does is not held up by it
+    LinkBridge::Options slowOptions;
+    slowOptions.maxBacklog = 64 * 1024;
+    bool keptUp = false;
+    const auto slow = with_bridge(slowOptions, [&](MemoryTransport& memory, const std::string& path) {
+        const int reader = connect_subscriber(path);
+        const int stalled = connect_subscriber(path);
+        if (reader < 0 || stalled < 0 || !read_lines({ reader }, 1)) return;
+        // Far more than the socket buffers and the backlog hold together
+        const std::string line(127, 'T');
+        std::thread robot([&] {
+            for (size_t i = 0; i < 32 * 1024; ++i) memory.notify(line + "\n");
+        });
+        keptUp = read_lines({ reader }, 32 * 1024);
+        robot.join();
+        close(reader);
+        close(stalled);
+    });
+    report("bridge.slow_consumer.reader_kept_up", keptUp ? 1 : 0, "bool");
+    report("bridge.slow_consumer.disconnected", static_cast<double>(slow.slowConsumersDisconnected), "subscribers");
+}
+
+void bench_session_log(const Options& options) {
+    const std::string path = (std::filesystem::temp_directory_path() / "ble_bench_session.mimirec").string();
+    // A telemetry-like notification, the size of a default MTU
+    const std::string fragment = "T 1234 -567 89 1\n0 ";
+    const size_t count = options.iterations * 50;
+    {
+        SessionRecorder recorder;
+        if (!recorder.open(path)) return;
+        const auto start = Clock::now();
+        for (size_t i = 0; i < count; ++i) {
+            recorder.record(SessionRecorder::RecordType::Rx, fragment);
+        }
+        const double elapsed = seconds_since(start);
+        report("session_log.record", elapsed * 1e9 / static_cast<double>(count), "ns/record");
+        const auto flushStart = Clock::now();
+        recorder.close();
+        report("session_log.close", seconds_since(flushStart) * 1e3, "ms");
+        report("session_log.dropped", static_cast<double>(recorder.getStats().droppedRecords), "records");
+    }
+
+    SessionReader reader;
+    auto start = Clock::now();
+    if (!reader.open(path)) return;
+    const double indexTime = seconds_since(start);
+    report("session_log.index", static_cast<double>(reader.getRecordCount()) / indexTime / 1e6, "Mrecords/s");
+
+    start = Clock::now();
+    reader.seek(reader.getDuration() / 2);
+    report("session_log.seek", seconds_since(start) * 1e6, "us");
+
+    reader.rewind();
+    start = Clock::now();
+    const size_t lines = reader.replay([](const std::string&, const std::string&) {}, "Mimi", 0.0);
+    report("session_log.replay", static_cast<double>(lines) / seconds_since(start) / 1e6, "Mlines/s");
+    reader.close();
+    std::filesystem::remove(path);
+}
+
+void bench_fake_bluez(const Options& options) {
+    std::unique_ptr<sdbus::IConnection> serviceConnection;
+    std::unique_ptr<sdbus::IConnection> clientConnection;
+    try {
+        serviceConnection = sdbus::createSessionBusConnection();
+        clientConnection = sdbus::createSessionBusConnection();
+    } catch (const sdbus::Error& e) {
+        std::cout << "# fake BlueZ benchmarks skipped, no session bus: " << e.getMessage() << "\n";
+        return;
+    }
+
+    FakeBluezService service(*serviceConnection, link_options(options));
+    service.addDevice("Mimi", "00:00:00:00:00:01");
+    serviceConnection->enterEventLoopAsync();
+    clientConnection->enterEventLoopAsync();
+
+    {
+        BleUartClient client(std::make_unique<BluezTransport>(*clientConnection));
+        std::vector<double> samples;
+        for (size_t i = 0; i < 20; ++i) {
+            const auto start = Clock::now();
+            if (!client.connect("Mimi", false)) break;
+            samples.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+            client.disconnect();
+        }
+        report_percentiles("connect_time.fake_bluez", samples, "us");
+
+        size_t received = 0;
+        client.setReceiveViewCallback([&](const std::string&, std::string_view) { ++received; });
+        client.setWriteMode(BleUartClient::WriteMode::WithoutResponse);
+        if (client.connect("Mimi", false)) {
+            const size_t count = std::max<size_t>(options.iterations / 10, 1);
+            const auto start = Clock::now();
+            for (size_t i = 0; i < count; ++i) {
+                if (!client.send("M 100 -100\n")) break;
+            }
+            wait_for(client, [&] { return received >= count; });
+            const double elapsed = seconds_since(start);
+            report("fake_bluez.echo", static_cast<double>(received) / elapsed, "cmd/s");
+            client.disconnect();
+        }
+    }
+
+    clientConnection->leaveEventLoop();
+    serviceConnection->leaveEventLoop();
+}
+
+void bench_fleet_startup(const Options& options) {
+    std::unique_ptr<sdbus::IConnection> serviceConnection;
+    std::unique_ptr<sdbus::IConnection> fleetConnection;
+    try {
+        serviceConnection = sdbus::createSessionBusConnection();
+        fleetConnection = sdbus::createSessionBusConnection();
+    } catch (const sdbus::Error& e) {
+        std::cout << "# fleet startup benchmarks skipped, no session bus: " << e.getMessage() << "\n";
+        return;
+    }
+
+    // Connecting is what takes a real robot longest
+    LinkOptions link = link_options(options);
+    link.connectLatency = std::max(link.connectLatency, std::chrono::microseconds(20000));
+    FakeBluezService service(*serviceConnection, link);
+    std::vector<std::string> paired;
+    for (size_t i = 1; i <= 8; ++i) {
+        paired.push_back("Mimi " + std::to_string(i));
+        service.addDevice(paired.back(), "00:00:00:00:01:0" + std::to_string(i));
+    }
+    // Only a discovery finds these
+    const std::vector<std::string> unpaired = { "Mimi new 1", "Mimi new 2" };
+    service.addDevice(unpaired[0], "00:00:00:00:02:01", false);
+    service.addDevice(unpaired[1], "00:00:00:00:02:02", false);
+    serviceConnection->enterEventLoopAsync();
+
+    {
+        BleUartFleet fleet(std::move(fleetConnection));
+        for (const auto& alias : paired) {
+            fleet.add(alias);
+        }
+
+        // One robot after the other, like a loop over connect()
+        auto start = Clock::now();
+        for (const auto& alias : paired) {
+            fleet.find(alias)->connect(alias, false);
+        }
+        report("fleet_startup.serial", seconds_since(start) * 1e3, "ms");
+        fleet.disconnectAll();
+        fleet.processCallbacks();
+
+        start = Clock::now();
+        const size_t connected = fleet.connectAll(false);
+        report("fleet_startup.concurrent", seconds_since(start) * 1e3, "ms");
+        report("fleet_startup.connected", static_cast<double>(connected), "robots");
+        std::vector<double> lookup, connect, discovery, notifications;
+        const auto ms = [](const std::chrono::microseconds duration) { return static_cast<double>(duration.count()) / 1e3; };
+        for (const auto& alias : paired) {
+            const auto timings = fleet.find(alias)->getConnectTimings();
+            lookup.push_back(ms(timings.lookup));
+            connect.push_back(ms(timings.connect));
+            discovery.push_back(ms(timings.discovery));
+            notifications.push_back(ms(timings.notifications));
+        }
+        report_percentiles("fleet_startup.stage.lookup", lookup, "ms");
+        report_percentiles("fleet_startup.stage.connect", connect, "ms");
+        report_percentiles("fleet_startup.stage.discovery", discovery, "ms");
+        report_percentiles("fleet_startup.stage.notifications", notifications, "ms");
+        fleet.disconnectAll();
+        fleet.processCallbacks();
+
+        // Not found at first, so they wait to be reconnected until the discovery sees them
+        for (const auto& alias : unpaired) {
+            fleet.add(alias).connect(alias, true);
+        }
+        start = Clock::now();
+        fleet.startDiscovery();
+        const auto deadline = Clock::now() + std::chrono::seconds(10);
+        const auto allConnected = [&] {
+            return std::all_of(unpaired.begin(), unpaired.end(), [&](const std::string& alias) {
+                return fleet.find(alias)->getState() == BleUartClient::State::Connected;
+            });
+        };
+        while (!allConnected() && Clock::now() < deadline) {
+            fleet.processCallbacks();
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        if (allConnected()) report("fleet_startup.discovered", seconds_since(start) * 1e3, "ms");
+        fleet.stopDiscovery();
+    }
+
+    serviceConnection->leaveEventLoop();
+}
+
+struct ResourceUsage {
+    size_t rssKiB = 0;
+    size_t fds = 0;
+    size_t threads = 0;
+};
+
+ResourceUsage resource_usage() {
+    ResourceUsage usage;
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.rfind("VmRSS:", 0) == 0) usage.rssKiB = std::stoul(line.substr(6));
+        else if (line.rfind("Threads:", 0) == 0) usage.threads = std::stoul(line.substr(8));
+    }
+    for ([[maybe_unused]] const auto& entry : std::filesystem::directory_iterator("/proc/self/fd")) {
+        ++usage.fds;
+    }
+    return usage;
+}
+
+// One cycle of what a gateway sees in a day: a connect, some traffic, a lost link and a disconnect
+template<typename DropLink, typename RestoreLink>
+bool soak_cycle(BleUartClient& client, const size_t cycle, DropLink dropLink, RestoreLink restoreLink) {
+    if (!client.connect("Mimi", true)) return false;
+    for (int i = 0; i < 10; ++i) {
+        (void)client.sendAsync("M 100 -100\n");
+    }
+    client.sendLatest("S", "S 50\n");
+    auto pending = client.request("P\n", nullptr, std::chrono::milliseconds(50));
+    if (cycle % 4 == 0) {
+        const auto recoveries = client.getReconnectStats().recoveries;
+        dropLink();
+        restoreLink();
+        const auto deadline = Clock::now() + std::chrono::seconds(30);
+        while (client.getReconnectStats().recoveries <= recoveries) {
+            if (Clock::now() > deadline) return false;
+            client.processCallbacks();
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+    }
+    pending.reply.wait();
+    client.processCallbacks();
+    return client.disconnect();
+}
+
+// Sizes are compared after a warm-up, so that buffers reaching their working size are not taken for a leak
+constexpr size_t SoakRssToleranceKiB = 2048;
+
+bool soak(const std::string& name, const size_t cycles, const std::function<bool(size_t cycle)>& cycleOnce) {
+    const size_t warmUp = std::max<size_t>(cycles / 10, 10);
+    for (size_t i = 0; i < warmUp; ++i) {
+        if (!cycleOnce(i)) {
+            std::cout << "# " << name << " soak failed to connect\n";
+            return false;
+        }
+    }
+    const ResourceUsage before = resource_usage();
+    const auto start = Clock::now();
+    for (size_t i = 0; i < cycles; ++i) {
+        if (!cycleOnce(warmUp + i)) {
+            std::cout << "# " << name << " soak failed to connect in cycle " << i << "\n";
+            return false;
+        }
+    }
+    const double elapsed = seconds_since(start);
+    const ResourceUsage after = resource_usage();
+
+    const auto growth = [](const size_t from, const size_t to) { return static_cast<double>(to) - static_cast<double>(from); };
+    report("soak." + name + ".cycles", static_cast<double>(cycles) / elapsed, "cycles/s");
+    report("soak." + name + ".rss_growth", growth(before.rssKiB, after.rssKiB), "KiB");
+    report("soak." + name + ".fd_growth", growth(before.fds, after.fds), "fds");
+    report("soak." + name + ".thread_growth", growth(before.threads, after.threads), "threads");
+    const bool flat = after.fds <= before.fds && after.threads <= before.threads &&
+                      after.rssKiB <= before.rssKiB + SoakRssToleranceKiB;
+    if (!flat) std::cout << "# " << name << " soak: resource usage grew\n";
+    return flat;
+}
+
+bool soak_memory(const Options& options) {
+    auto transport = std::make_unique<MemoryTransport>(link_options(options));
+    MemoryTransport& link = *transport;
+    link.setPeer([](MemoryTransport& peer, const std::string_view written) {
+        if (written.find('P') != std::string_view::npos) peer.notify("P ok\n");
+    });
+    BleUartClient client(std::move(transport));
+    return soak("memory", options.soakCycles, [&](const size_t cycle) {
+        return soak_cycle(client, cycle, [&] { link.dropLink(); }, [&] { link.restoreLink(); });
+    });
+}
+
+bool soak_fake_bluez(const Options& options) {
+    std::unique_ptr<sdbus::IConnection> serviceConnection;
+    std::unique_ptr<sdbus::IConnection> clientConnection;
+    try {
+        serviceConnection = sdbus::createSessionBusConnection();
+        clientConnection = sdbus::createSessionBusConnection();
+    } catch (const sdbus::Error& e) {
+        std::cout << "# fake BlueZ soak skipped, no session bus: " << e.getMessage() << "\n";
+        return true;
+    }
+
+    FakeBluezService service(*serviceConnection, link_options(options));
+    service.addDevice("Mimi", "00:00:00:00:00:01");
+    service.setPeer([](FakeBluezService& peer, const std::string& alias, const std::string_view written) {
+        if (written.find('P') != std::string_view::npos) peer.notify(alias, "P ok\n");
+    });
+    serviceConnection->enterEventLoopAsync();
+    clientConnection->enterEventLoopAsync();
+
+    bool flat;
+    {
+        BleUartClient client(std::make_unique<BluezTransport>(*clientConnection));
+        flat = soak("fake_bluez", options.soakCycles, [&](const size_t cycle) {
+            return soak_cycle(client, cycle, [&] { service.dropLink("Mimi"); }, [&] { service.restoreLink("Mimi"); });
+        });
+    }
+    clientConnection->leaveEventLoop();
+    serviceConnection->leaveEventLoop();
+    return flat;
+}
+
+} // namespace
+
+int main(const int argc, char* argv[]) {
+    const Options options = parse_options(argc, argv);
+    std::cout << "# iterations=" << options.iterations << " mtu=" << options.mtu
+              << " latency_us=" << options.latency.count() << " loss=" << options.lossRate << "\n";
+
+    if (options.soakCycles > 0) {
+        const bool memoryFlat = soak_memory(options);
+        const bool fakeBluezFlat = soak_fake_bluez(options);
+        return memoryFlat && fakeBluezFlat ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    bench_send(options, BleUartClient::WriteMode::WithoutResponse, "send.without_response");
+    bench_send(options, BleUartClient::WriteMode::WithResponse, "send.with_response");
+    bench_send_async(options, BleUartClient::WriteMode::WithoutResponse, "send_async.without_response");
+    bench_send_async(options, BleUartClient::WriteMode::WithResponse, "send_async.with_response");
+    bench_congestion(options);
+    bench_control_channel(options);
+    bench_binary_framing(options);
+    bench_requests(options);
+    bench_framing(options);
+    bench_telemetry(options);
+    bench_dispatch(options, BleUartClient::CallbackDelivery::Queued, "dispatch_latency");
+    bench_dispatch(options, BleUartClient::CallbackDelivery::Inline, "dispatch_latency.inline");
+    bench_connect(options);
+    bench_recover(options);
+    bench_bridge(options);
+    bench_session_log(options);
+    bench_fake_bluez(options);
+    bench_fleet_startup(options);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,125 @@
+// Built as C++20, so that it also keeps the coroutine facade compiling
+#include "client_coroutines.h"
+#include "memory_transport.h"
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+
+using namespace mimi;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+constexpr std::chrono::milliseconds StalledTimeout { 500 };
+
+struct Run {
+    std::vector<std::vector<double>> roundTrips;
+    std::vector<Clock::time_point> finishedAt;
+    size_t failed = 0;
+    size_t workersLeft = 0;
+    Clock::time_point stalledAt;
+    std::promise<void> done;
+};
+
+void report(const std::string& name, const double value, const std::string& unit) {
+    std::cout << name << " " << value << " " << unit << "\n";
+}
+
+// Exchanges requests one after another, each matched by its own text
+CoroutineClient::Task worker(CoroutineClient& robot, const size_t index, const size_t count, Run* run) {
+    for (size_t i = 0; i < count; ++i) {
+        const std::string command = "Q " + std::to_string(index) + " " + std::to_string(i);
+        // Not a lambda written into the co_await expression: GCC 12 destroys such a temporary twice
+        BleUartClient::ReplyMatcher matcher = [command](const std::string_view line) { return line == command; };
+        const auto reply = co_await robot.request(command + "\n", std::move(matcher));
+        if (reply.status == BleUartClient::RequestStatus::Replied) {
+            run->roundTrips[index].push_back(static_cast<double>(reply.roundTripTime.count()));
+        } else {
+            ++run->failed;
+        }
+    }
+    run->finishedAt[index] = Clock::now();
+    if (--run->workersLeft == 0) run->done.set_value();
+}
+
+// Waits for a reply that never comes; the workers must not wait with it
+CoroutineClient::Task stalled(CoroutineClient& robot, Run* run) {
+    BleUartClient::ReplyMatcher matcher = [](const std::string_view line) { return line == "never"; };
+    co_await robot.request("W\n", std::move(matcher), StalledTimeout);
+    run->stalledAt = Clock::now();
+}
+
+CoroutineClient::Task drive(CoroutineClient& robot, const size_t workers, const size_t count, Run* run) {
+    if (!co_await robot.connect("Mimi", false)) {
+        run->done.set_value();
+        co_return;
+    }
+    robot.spawn(stalled(robot, run));
+    for (size_t i = 0; i < workers; ++i) robot.spawn(worker(robot, i, count, run));
+}
+
+} // namespace
+
+int main(const int argc, char* argv[]) {
+    size_t iterations = 20000;
+    size_t workers = 8;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg.rfind("--iterations=", 0) == 0) iterations = std::stoul(arg.substr(13));
+        else if (arg.rfind("--workers=", 0) == 0) workers = std::max<size_t>(std::stoul(arg.substr(10)), 1);
+        else if (arg == "--quick") iterations = 2000;
+    }
+    std::cout << "# iterations=" << iterations << " workers=" << workers << "\n";
+
+    LinkOptions link;
+    link.mtu = 247;
+    BleUartClient client(std::make_unique<MemoryTransport>(link));
+    client.setMaxRequestsInFlight(workers + 1);
+    Run run;
+    run.roundTrips.resize(workers);
+    run.finishedAt.resize(workers);
+    run.workersLeft = workers;
+    auto done = run.done.get_future();
+    const auto start = Clock::now();
+    {
+        CoroutineClient robot(client);
+        robot.spawn(drive(robot, workers, iterations / workers, &run));
+        done.wait();
+        client.disconnect();
+    }
+
+    std::vector<double> roundTrips;
+    for (const auto& samples : run.roundTrips) roundTrips.insert(roundTrips.end(), samples.begin(), samples.end());
+    if (roundTrips.empty()) {
+        std::cout << "# coroutine benchmarks failed to connect\n";
+        return EXIT_FAILURE;
+    }
+    const auto lastFinished = *std::max_element(run.finishedAt.begin(), run.finishedAt.end());
+    report("coroutines.requests", static_cast<double>(roundTrips.size()) / std::chrono::duration<double>(lastFinished - start).count(), "req/s");
+    std::sort(roundTrips.begin(), roundTrips.end());
+    const auto at = [&](const double q) { return roundTrips[static_cast<size_t>(q * static_cast<double>(roundTrips.size() - 1))]; };
+    report("coroutines.round_trip.p50", at(0.5), "us");
+    report("coroutines.round_trip.p99", at(0.99), "us");
+    report("coroutines.round_trip.max", roundTrips.back(), "us");
+    report("coroutines.failed", static_cast<double>(run.failed), "req");
+    // Workers that finished while a request of another coroutine was still waiting for its reply
+    const auto unblocked = std::count_if(run.finishedAt.begin(), run.finishedAt.end(), [&](const Clock::time_point at) {
+        return run.stalledAt == Clock::time_point() || at < run.stalledAt;
+    });
+    report("coroutines.finished_before_stalled_request", static_cast<double>(unblocked), "workers");
+    return EXIT_SUCCESS;
+}
+
+#else
+
+int main() {
+    std::cout << "# coroutine benchmarks skipped, the compiler has no C++20 coroutines\n";
+    return EXIT_SUCCESS;
+}
+
+#endif
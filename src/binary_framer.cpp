@@ -0,0 +1,163 @@
+#include "binary_framer.h"
+#include <array>
+#include <cstring>
+
+using namespace mimi;
+
+namespace {
+    constexpr std::array<uint16_t, 256> makeCrcTable() {
+        std::array<uint16_t, 256> table {};
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint16_t crc = static_cast<uint16_t>(i << 8);
+            for (int bit = 0; bit < 8; ++bit) {
+                crc = static_cast<uint16_t>((crc & 0x8000) != 0 ? (crc << 1) ^ 0x1021 : crc << 1);
+            }
+            table[i] = crc;
+        }
+        return table;
+    }
+
+    constexpr auto CrcTable = makeCrcTable();
+
+    // Writes one COBS block code in front of the bytes that follow it
+    class CobsEncoder {
+    public:
+        explicit CobsEncoder(std::string& out) : out_(out), codeIndex_(out.size()) { out_.push_back(0); }
+
+        void put(const uint8_t byte) {
+            if (byte == 0) {
+                closeBlock();
+                return;
+            }
+            out_.push_back(static_cast<char>(byte));
+            if (++code_ == 0xFF) closeBlock();
+        }
+
+        void finish() {
+            out_[codeIndex_] = static_cast<char>(code_);
+        }
+
+    private:
+        std::string& out_;
+        size_t codeIndex_;
+        uint8_t code_ = 1;
+
+        void closeBlock() {
+            out_[codeIndex_] = static_cast<char>(code_);
+            codeIndex_ = out_.size();
+            out_.push_back(0);
+            code_ = 1;
+        }
+    };
+}
+
+void BinaryFramer::encode(const uint8_t* data, const size_t size, std::string& out) {
+    out.reserve(out.size() + maxFrameSize(size));
+    const uint16_t crc = crc16(data, size);
+    CobsEncoder encoder(out);
+    for (size_t i = 0; i < size; ++i) {
+        encoder.put(data[i]);
+    }
+    encoder.put(static_cast<uint8_t>(crc >> 8));
+    encoder.put(static_cast<uint8_t>(crc & 0xFF));
+    encoder.finish();
+    out.push_back(Delimiter);
+}
+
+size_t BinaryFramer::maxFrameSize(const size_t payloadSize) {
+    const size_t encoded = payloadSize + 2;
+    return encoded + encoded / 254 + 2;
+}
+
+uint16_t BinaryFramer::crc16(const uint8_t* data, const size_t size) {
+    uint16_t crc = 0xFFFF;
+    for (size_t i = 0; i < size; ++i) {
+        crc = static_cast<uint16_t>((crc << 8) ^ CrcTable[((crc >> 8) ^ data[i]) & 0xFF]);
+    }
+    return crc;
+}
+
+const char* BinaryFramer::frameErrorToString(const FrameError& error) {
+    switch (error) {
+        case FrameError::Malformed:   return "malformed";
+        case FrameError::BadChecksum: return "bad checksum";
+        case FrameError::Overlong:    return "overlong";
+    }
+    return "unknown";
+}
+
+BinaryFramer::BinaryFramer(const size_t capacity) :
+    capacity_(capacity) {
+    encoded_.reserve(maxFrameSize(capacity_));
+    decoded_.reserve(capacity_ + 2);
+}
+
+void BinaryFramer::setHandlers(FrameHandler frameHandler, ErrorHandler errorHandler) {
+    frameHandler_ = std::move(frameHandler);
+    errorHandler_ = std::move(errorHandler);
+}
+
+void BinaryFramer::feed(const char* data, const size_t size) {
+    const char* position = data;
+    const char* const end = data + size;
+    while (position < end) {
+        const auto delimiter = static_cast<const char*>(std::memchr(position, Delimiter, end - position));
+        const char* const chunkEnd = delimiter != nullptr ? delimiter : end;
+        const auto length = static_cast<size_t>(chunkEnd - position);
+        if (!overlong_ && encoded_.size() + length <= maxFrameSize(capacity_)) {
+            encoded_.append(position, length);
+        } else {
+            overlong_ = true;
+        }
+        if (delimiter == nullptr) return;
+
+        emitFrame();
+        position = delimiter + 1;
+    }
+}
+
+void BinaryFramer::reset() {
+    encoded_.clear();
+    overlong_ = false;
+}
+
+void BinaryFramer::emitFrame() {
+    const bool overlong = overlong_;
+    overlong_ = false;
+    if (overlong) {
+        encoded_.clear();
+        if (errorHandler_) errorHandler_(FrameError::Overlong);
+        return;
+    }
+    // Back-to-back delimiters are allowed as padding
+    if (encoded_.empty()) return;
+
+    decoded_.clear();
+    const auto* in = reinterpret_cast<const uint8_t*>(encoded_.data());
+    const size_t size = encoded_.size();
+    bool valid = true;
+    for (size_t i = 0; valid && i < size;) {
+        const uint8_t code = in[i++];
+        if (code == 0 || i + code - 1 > size) {
+            valid = false;
+            break;
+        }
+        decoded_.append(reinterpret_cast<const char*>(in + i), code - 1);
+        i += code - 1;
+        if (code < 0xFF && i < size) decoded_.push_back(0);
+    }
+    encoded_.clear();
+
+    if (!valid || decoded_.size() < 2) {
+        if (errorHandler_) errorHandler_(FrameError::Malformed);
+        return;
+    }
+    const size_t payloadSize = decoded_.size() - 2;
+    const auto* payload = reinterpret_cast<const uint8_t*>(decoded_.data());
+    const auto crc = static_cast<uint16_t>(payload[payloadSize] << 8 | payload[payloadSize + 1]);
+    if (crc16(payload, payloadSize) != crc) {
+        if (errorHandler_) errorHandler_(FrameError::BadChecksum);
+        return;
+    }
+    if (frameHandler_) frameHandler_(std::string_view(decoded_.data(), payloadSize));
+}
@@ -0,0 +1,59 @@
+#ifndef BINARY_FRAMER_H
+#define BINARY_FRAMER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+
+namespace mimi {
+
+// Binary frames for the UART link: the payload followed by its CRC-16/CCITT-FALSE (big-endian),
+// COBS-encoded so that the frame contains no zero bytes, and terminated by a zero byte.
+// A frame costs the payload plus 4 bytes for payloads of up to 254 bytes.
+class BinaryFramer {
+public:
+    enum class FrameError {
+        Malformed,
+        BadChecksum,
+        Overlong,
+    };
+
+    // The payload is only valid during the call
+    using FrameHandler = std::function<void(std::string_view payload)>;
+    using ErrorHandler = std::function<void(FrameError error)>;
+
+    static constexpr size_t DefaultCapacity = 1024;
+    static constexpr char Delimiter = '\0';
+
+    // Appends the complete frame of the payload to out
+    static void encode(const uint8_t* data, size_t size, std::string& out);
+    [[nodiscard]] static size_t maxFrameSize(size_t payloadSize);
+    [[nodiscard]] static uint16_t crc16(const uint8_t* data, size_t size);
+    static const char* frameErrorToString(const FrameError& error);
+
+    explicit BinaryFramer(size_t capacity = DefaultCapacity);
+
+    void setHandlers(FrameHandler frameHandler, ErrorHandler errorHandler);
+    [[nodiscard]] size_t capacity() const { return capacity_; }
+
+    // Frames may be split across notifications and several frames may share one
+    void feed(const char* data, size_t size);
+    void reset();
+
+private:
+    const size_t capacity_;
+    FrameHandler frameHandler_ = nullptr;
+    ErrorHandler errorHandler_ = nullptr;
+    // Encoded bytes of the frame being received
+    std::string encoded_;
+    std::string decoded_;
+    bool overlong_ = false;
+
+    void emitFrame();
+};
+
+} // namespace mimi
+
+#endif //BINARY_FRAMER_H
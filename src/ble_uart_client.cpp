@@ -1,16 +1,125 @@
 // ReSharper disable CppTooWideScopeInitStatement
 #include "ble_uart_client.h"
+#include "bluez_transport.h"
 #include <iomanip>
+#include <optional>
+#include <random>
 #include <thread>
+#include <type_traits>
 #include <utility>
+#include <unistd.h>
+#include <sys/eventfd.h>
 #include <sdbus-c++/sdbus-c++.h>
 
 using namespace sdbus;
 using namespace mimi;
 
+BleUartClient::BleUartClient(const size_t eventQueueCapacity) :
+    BleUartClient(std::make_unique<BluezTransport>(), eventQueueCapacity) {
+}
+
+BleUartClient::BleUartClient(std::unique_ptr<GattTransport> transport, const size_t eventQueueCapacity) :
+    transport_(std::move(transport)),
+    events_(std::make_shared<EventChannel>(eventQueueCapacity)) {
+    setupTransport();
+}
+
+BleUartClient::BleUartClient(std::unique_ptr<GattTransport> transport, std::shared_ptr<EventChannel> events) :
+    transport_(std::move(transport)),
+    events_(std::move(events)),
+    ownsEvents_(false) {
+    setupTransport();
+}
+
+void BleUartClient::setupTransport() {
+    rxFramer_.setHandlers(
+        [this](const std::string_view line) {
+            if (binaryFramingRequested_ && line == BinaryFramingAccepted) {
+                // The robot sends frames right after its reply, possibly in the same notification, and expects them
+                // from the commands sent from now on
+                rxFramingMode_ = FramingMode::Binary;
+                txFramingMode_ = FramingMode::Binary;
+                rxFramer_.stopAfterLine();
+            }
+            handleReceived(line, false);
+        },
+        [this](const size_t lineLength) {
+            const bool truncated = rxFramer_.getOverlongPolicy() == LineFramer::OverlongPolicy::Truncate;
+            postError(str("Received line of ", lineLength, " bytes exceeds ", rxFramer_.capacity(), " bytes and was ",
+                          truncated ? "truncated" : "dropped"), "", state_); //❌
+        });
+    rxBinaryFramer_.setHandlers(
+        [this](const std::string_view payload) { handleReceived(payload, true); },
+        [this](const BinaryFramer::FrameError error) {
+            postError(str("Received frame was dropped: ", BinaryFramer::frameErrorToString(error)), "", state_); //❌
+        });
+
+    transport_->setHandlers({
+        [this](char* data, const size_t size) {
+            rxArrivedAt_ = std::chrono::steady_clock::now();
+            ++metrics_.notifications;
+            metrics_.bytesReceived += size;
+            if (recorder_ && rxFramingMode_ == FramingMode::Text && binaryFramingRequested_) {
+                recordHandshakeReceived(data, size);
+                return;
+            }
+            // Before framing, which strips '\r' in place
+            if (recorder_) recorder_->record(SessionRecorder::RecordType::Rx, data, size, recorderSource_);
+            if (rxFramingMode_ == FramingMode::Binary) {
+                rxBinaryFramer_.feed(data, size);
+            } else {
+                // What follows the accepted binary framing handshake is frames
+                const size_t taken = rxFramer_.feed(data, size);
+                if (taken < size) rxBinaryFramer_.feed(data + taken, size - taken);
+            }
+        },
+        [this] {
+            // Соединение незапланированно потеряно
+            {
+                std::lock_guard lock(reconnectMutex_);
+                if (state_ == State::Reconnecting) attemptInvalidated_ = true;
+                if (state_ != State::Connected) return;
+            }
+            postDisconnect(str("Disconnected from \'", deviceAlias_, "\'"), true);
+            if (keepConnection_) {
+                startReconnectLoop(true);
+            } else {
+                updateState(State::Disconnected);
+            }
+        },
+        [this] { signalLinkAvailable(); },
+        [this](const std::string& message, const std::string& errorName) {
+            // Too late to retry the chunk, but the writes after it slow down
+            if (WritePacer::isBusyError(errorName)) {
+                pacer_.onBusy(0, std::chrono::steady_clock::now());
+                metrics_.paceWindow = pacer_.getWindow();
+            }
+            postError(str("Send failed: ", message), errorName, state_); //❌
+        },
+    });
+}
+
+void BleUartClient::recordHandshakeReceived(char* data, const size_t size) {
+    // Framed from a copy, so that the log gets the bytes as received, split where the framing switched
+    recordedNotification_.assign(data, size);
+    const size_t taken = rxFramer_.feed(data, size);
+    recorder_->record(SessionRecorder::RecordType::Rx, recordedNotification_.data(), taken, recorderSource_);
+    if (rxFramingMode_ == FramingMode::Binary) {
+        recorder_->record(SessionRecorder::RecordType::Framing, std::string_view("binary"), recorderSource_);
+    }
+    if (taken < size) {
+        recorder_->record(SessionRecorder::RecordType::Rx, recordedNotification_.data() + taken, size - taken, recorderSource_);
+        rxBinaryFramer_.feed(data + taken, size - taken);
+    }
+}
+
 BleUartClient::~BleUartClient() {
+    stopReconnectThread();
     disconnect();
-    delete connection_;
+    stopWriter();
+    stopRequestTimer();
+    // No transport handler may run once the members below start going away
+    transport_.reset();
 }
 
 void BleUartClient::setCallbacks(
@@ -26,324 +135,1064 @@ void BleUartClient::setCallbacks(
     receiveCallback_ = std::move(receiveCallback);
 }
 
+void BleUartClient::setReceiveViewCallback(ReceiveViewCallback receiveViewCallback) {
+    receiveViewCallback_ = std::move(receiveViewCallback);
+}
+
+void BleUartClient::setReceiveBinaryCallback(ReceiveBinaryCallback receiveBinaryCallback) {
+    receiveBinaryCallback_ = std::move(receiveBinaryCallback);
+}
+
+void BleUartClient::setOverlongLinePolicy(const LineFramer::OverlongPolicy& overlongPolicy) {
+    rxFramer_.setOverlongPolicy(overlongPolicy);
+}
+
 BleUartClient::State BleUartClient::getState() const {
     return state_;
 }
 
-void BleUartClient::setState(const State& state) {
-    if (state == state_) return;
-    state_ = state;
+void BleUartClient::updateState(const State& state) {
+    {
+        std::lock_guard lock(reconnectMutex_);
+        if (state_.exchange(state) == state) return;
+    }
     postStateChanged(state);
-    processCallbacks();
+    reconnectWakeup_.notify_all();
+    // Replies to commands sent over the old link will never come, and stale control values must not go out on the new one
+    if (state != State::Connected) {
+        failAllRequests(RequestStatus::LinkLost);
+        dropChannelUpdates();
+    }
 }
 
 std::vector<PairedDevice> BleUartClient::listPairedDevices() {
-    std::vector<PairedDevice> devices;
-
+    // A connection of its own, closed on return: one kept for later calls would not survive a restart of the bus
     const auto connection = createSystemBusConnection();
-    const auto proxy = createProxy(*connection, "org.bluez", "/");
-    proxy->finishRegistration();
-
-    using VariantMap = std::map<std::string, Variant>;
-    using InterfaceMap = std::map<std::string, VariantMap>;
-    using ObjectMap = std::map<ObjectPath, InterfaceMap>;
-
-    ObjectMap managedObjects;
-    const auto method = proxy->createMethodCall("org.freedesktop.DBus.ObjectManager", "GetManagedObjects");
-    auto reply = proxy->callMethod(method);
-    reply >> managedObjects;
-
-    for (const auto& [objectPath, interfaces] : managedObjects) {
-        auto devIt = interfaces.find("org.bluez.Device1");
-        if (devIt != interfaces.end()) {
-            const auto& props = devIt->second;
-
-            const auto pairedIt = props.find("Paired");
-            const auto aliasIt  = props.find("Alias");
-            const auto addrIt   = props.find("Address");
-
-            if (pairedIt != props.end() && pairedIt->second.get<bool>()) {
-                const std::string alias   = aliasIt != props.end() ? aliasIt->second.get<std::string>() : "(unknown)";
-                const std::string address = addrIt != props.end() ? addrIt->second.get<std::string>() : "(no address)";
-                devices.push_back({ alias, address, objectPath });
-            }
-        }
-    }
+    return listPairedDevices(*connection);
+}
 
-    return devices;
+std::vector<PairedDevice> BleUartClient::listPairedDevices(IConnection& connection) {
+    return BluezTransport::listPairedDevices(connection);
 }
 
 bool BleUartClient::connect(const std::string& alias, const bool keepConnection) {
+    std::unique_lock lock(connectMutex_);
     if (state_ != State::Disconnected) return true;
     deviceAlias_ = alias;
     keepConnection_ = keepConnection;
+    // Names the source of this client's records, for the replay of a log shared by several robots
+    if (recorder_) recorder_->record(SessionRecorder::RecordType::Source, deviceAlias_, recorderSource_);
     const bool successfullyConnected = doConnect();
-    if (!successfullyConnected && keepConnection_) {
-        setState(State::Connected);
-        processCallbacks();
-        startReconnectLoop();
-        return true;
-    }
     if (successfullyConnected) {
-        setState(State::Connected);
+        updateState(State::Connected);
         postConnect(str("Connected to \'", deviceAlias_, "\'"), false);
-        processCallbacks();
-        return true;
+    } else if (keepConnection_) {
+        startReconnectLoop(false);
     }
-    setState(State::Disconnected);
+    lock.unlock();
     processCallbacks();
-    return false;
+    return successfullyConnected || keepConnection_;
 }
 
-bool BleUartClient::findDevice(std::vector<PairedDevice> pairedDevices, PairedDevice& pairedDevice) {
-    const auto device = std::find_if(pairedDevices.begin(), pairedDevices.end(), [&](const PairedDevice& d) {
-        return d.alias == deviceAlias_;
-    });
-    if (device == pairedDevices.end()) {
+bool BleUartClient::findDevice(PairedDevice& pairedDevice) {
+    try {
+        if (transport_->findPairedDevice(deviceAlias_, pairedDevice)) return true;
         postError(str("Device with alias '", deviceAlias_, "' not found"), "", state_); //❌
-        return false;
+    } catch (const Error& e) {
+        postError(str("Failed to list paired devices: ", e.getMessage()), e.getName(), state_); //❌
     }
-    pairedDevice = *device;
-    return true;
+    return false;
 }
 
 bool BleUartClient::connectGatt(const PairedDevice &pairedDevice) {
-    connection_ = createSystemBusConnection().release();
-    deviceProxy_ = createProxy(*connection_, "org.bluez", pairedDevice.path);
-    deviceProxy_->finishRegistration();
     try {
-        deviceProxy_->callMethod("Connect").onInterface("org.bluez.Device1");
+        transport_->connectDevice(pairedDevice);
     } catch (const Error& e) {
         postError(str("Failed to connect: ", e.getMessage()), e.getName(), state_); //❌
         return false;
     }
-    connection_->enterEventLoopAsync();
     return true;
 }
 
 bool BleUartClient::discoverCharacteristics() {
-    using ObjectMap = std::map<ObjectPath, std::map<std::string, std::map<std::string, Variant>>>;
-    ObjectMap objects;
-
-    const auto objMgr = createProxy(*connection_, "org.bluez", "/");
-    objMgr->finishRegistration();
-
-    const auto method = objMgr->createMethodCall("org.freedesktop.DBus.ObjectManager", "GetManagedObjects");
-    auto reply = objMgr->callMethod(method);
-    reply >> objects;
-
-    const std::string TX_UUID = "6e400002-b5a3-f393-e0a9-e50e24dcca9e";
-    const std::string RX_UUID = "6e400003-b5a3-f393-e0a9-e50e24dcca9e";
-
-    for (const auto& [path, ifaces] : objects) {
-        auto itGatt = ifaces.find("org.bluez.GattCharacteristic1");
-        if (itGatt != ifaces.end()) {
-            const auto& props = itGatt->second;
-            auto uuidIt = props.find("UUID");
-            if (uuidIt != props.end()) {
-                auto uuid = uuidIt->second.get<std::string>();
-                std::transform(uuid.begin(), uuid.end(), uuid.begin(), tolower);
-
-                if (uuid == TX_UUID && txCharPath_.empty())
-                    txCharPath_ = path;
-
-                if (uuid == RX_UUID && rxCharPath_.empty())
-                    rxCharPath_ = path;
-            }
-        }
-    }
-
-    if (txCharPath_.empty() || rxCharPath_.empty()) {
+    try {
+        if (transport_->discoverCharacteristics()) return true;
         postError(str("TX or RX characteristic not found"), "", state_); //❌
-        return false;
+    } catch (const Error& e) {
+        postError(str("Failed to discover characteristics: ", e.getMessage()), e.getName(), state_); //❌
     }
-
-    return true;
+    return false;
 }
 
 bool BleUartClient::setupReceiveNotifications() {
-    rxProxy_ = createProxy(*connection_, "org.bluez", rxCharPath_);
-    rxProxy_->uponSignal("PropertiesChanged")
-        .onInterface("org.freedesktop.DBus.Properties")
-        .call([this](const std::string& interface,
-                     const std::map<std::string, Variant>& changed,
-                     const std::vector<std::string>&) {
-            if (interface == "org.bluez.GattCharacteristic1") {
-                const auto value = changed.find("Value");
-                if (value != changed.end()) {
-                    const auto& vec = value->second.get<std::vector<uint8_t>>();
-                    const std::string fragment(vec.begin(), vec.end());
-                    rxAssembleBuffer_ += fragment;
-
-                    size_t pos;
-                    while ((pos = rxAssembleBuffer_.find('\n')) != std::string::npos) {
-                        std::string rawMessage = rxAssembleBuffer_.substr(0, pos);
-                        rxAssembleBuffer_.erase(0, pos + 1);
-
-                        std::string message;
-                        std::copy_if(rawMessage.begin(), rawMessage.end(), std::back_inserter(message),
-                                     [](const char c) { return c != '\r'; });
-
-                        postReceive(message);
-                    }
-                }
-            }
-        });
-    rxProxy_->finishRegistration();
-
     try {
-        rxProxy_->callMethod("StartNotify").onInterface("org.bluez.GattCharacteristic1");
+        transport_->startNotifications();
     } catch (const Error& e) {
         postError(str("Failed to start notifications: ", e.getMessage()), e.getName(), state_); //❌
         return false;
     }
-
     return true;
 }
 
 void BleUartClient::setupConnectionMonitor() {
-    deviceProxy_->uponSignal("PropertiesChanged")
-    .onInterface("org.freedesktop.DBus.Properties")
-    .call([this](const std::string& interface,
-                 const std::map<std::string, Variant>& changed,
-                 const std::vector<std::string>&) {
-        if (interface == "org.bluez.Device1") {
-            const auto it = changed.find("Connected");
-            if (it != changed.end() && !it->second.get<bool>()) {
-                // Соединение незапланированно потеряно
-                postDisconnect(str("Disconnected from \'", deviceAlias_, "\'"), true);
-                if (keepConnection_) {
-                    startReconnectLoop();
-                }
-            }
-        }
-    });
-    deviceProxy_->finishRegistration();
+    transport_->watchConnection();
 }
 
 bool BleUartClient::doConnect() {
-    const std::vector<PairedDevice> devices = listPairedDevices();
+    rxFramer_.reset();
+    rxBinaryFramer_.reset();
+    // The robot starts every connection in text mode
+    rxFramingMode_ = FramingMode::Text;
+    txFramingMode_ = FramingMode::Text;
+
+    using std::chrono::duration_cast;
+    using std::chrono::microseconds;
+    const auto startedAt = std::chrono::steady_clock::now();
+    ConnectTimings timings {};
 
     PairedDevice device;
-    if (!findDevice(devices, device)) return false;
+    if (!findDevice(device)) return false;
+    auto stageEnd = std::chrono::steady_clock::now();
+    timings.lookup = duration_cast<microseconds>(stageEnd - startedAt);
 
     if (!connectGatt(device)) return false;
+    auto stageStart = std::exchange(stageEnd, std::chrono::steady_clock::now());
+    timings.connect = duration_cast<microseconds>(stageEnd - stageStart);
 
     if (!discoverCharacteristics()) return false;
+    // The chunk size follows from the MTU of this connection, which may differ from the last one
+    pacer_.reset(transport_->getMaxWriteSize());
+    metrics_.paceWindow = pacer_.getWindow();
+    stageStart = std::exchange(stageEnd, std::chrono::steady_clock::now());
+    timings.discovery = duration_cast<microseconds>(stageEnd - stageStart);
 
     setupReceiveNotifications();
     setupConnectionMonitor();
+    stageStart = std::exchange(stageEnd, std::chrono::steady_clock::now());
+    timings.notifications = duration_cast<microseconds>(stageEnd - stageStart);
+    timings.total = duration_cast<microseconds>(stageEnd - startedAt);
 
+    std::lock_guard lock(reconnectMutex_);
+    connectTimings_ = timings;
     return true;
 }
 
-void BleUartClient::startReconnectLoop() {
-    if (state_ != State::Connected) return;
-    setState(State::Reconnecting);
+void BleUartClient::startReconnectLoop(const bool linkLost) {
+    {
+        std::lock_guard lock(reconnectMutex_);
+        if (reconnectStopping_) return;
+        linkAvailable_ = false;
+        recovering_ = linkLost;
+        if (linkLost) {
+            linkLostAt_ = std::chrono::steady_clock::now();
+            ++reconnectStats_.linkLosses;
+        }
+        if (!reconnectThread_.joinable()) {
+            reconnectThread_ = std::thread([this] { reconnectLoop(); });
+        }
+    }
+    updateState(State::Reconnecting);
+}
+
+void BleUartClient::signalLinkAvailable() {
+    {
+        std::lock_guard lock(reconnectMutex_);
+        if (state_ != State::Reconnecting) return;
+        linkAvailable_ = true;
+    }
+    reconnectWakeup_.notify_all();
+}
 
-    reconnectThread_ = std::thread([this] {
-        while (keepConnection_ && state_ == State::Reconnecting) {
-            std::this_thread::sleep_for(std::chrono::seconds(ReconnectIntervalInSeconds));
+void BleUartClient::reconnectLoop() {
+    std::mt19937 random(std::random_device{}());
+    std::unique_lock lock(reconnectMutex_);
+    while (true) {
+        reconnectWakeup_.wait(lock, [this] { return reconnectStopping_ || state_ == State::Reconnecting; });
+        if (reconnectStopping_) return;
 
-            if (state_ == State::Reconnecting && doConnect()) {
-                postConnect(str("Reconnected to \'", deviceAlias_, "\'"), true);
-                setState(State::Connected);
-                return;
-            }
-        }
-    });
+        auto delay = std::chrono::duration<double, std::milli>(reconnectPolicy_.initialDelay);
+        while (true) {
+            std::uniform_real_distribution<double> jitter(-reconnectPolicy_.jitter, reconnectPolicy_.jitter);
+            const auto wait = std::chrono::duration_cast<std::chrono::microseconds>(delay * (1.0 + jitter(random)));
+            reconnectWakeup_.wait_for(lock, wait, [this] {
+                return reconnectStopping_ || linkAvailable_ || state_ != State::Reconnecting;
+            });
+            if (reconnectStopping_ || state_ != State::Reconnecting) break;
+            linkAvailable_ = false;
+            attemptInvalidated_ = false;
+            ++reconnectStats_.attempts;
 
-    reconnectThread_.detach();
+            lock.unlock();
+            const bool reconnected = tryReconnect();
+            lock.lock();
+            if (reconnected) break;
+
+            delay = std::min<std::chrono::duration<double, std::milli>>(delay * reconnectPolicy_.multiplier, reconnectPolicy_.maxDelay);
+        }
+    }
 }
 
-bool BleUartClient::disconnect() {
-    if (state_ == State::Disconnected) return false;
+bool BleUartClient::tryReconnect() {
+    std::unique_lock lock(connectMutex_);
+    // disconnect() may have won the race for connectMutex_
+    if (state_ != State::Reconnecting || !doConnect()) return false;
 
-    if (rxProxy_) {
-        try {
-            rxProxy_->callMethod("StopNotify").onInterface("org.bluez.GattCharacteristic1");
-        } catch (...) { /* ignore */ }
-        rxProxy_.reset();
+    {
+        std::lock_guard reconnectLock(reconnectMutex_);
+        // The link dropped again before the attempt was complete
+        if (attemptInvalidated_) return false;
+        if (recovering_) {
+            const auto timeToRecover = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - linkLostAt_);
+            ++reconnectStats_.recoveries;
+            totalTimeToRecover_ += timeToRecover;
+            reconnectStats_.lastTimeToRecover = timeToRecover;
+            reconnectStats_.meanTimeToRecover = totalTimeToRecover_ / reconnectStats_.recoveries;
+            reconnectStats_.maxTimeToRecover = std::max(reconnectStats_.maxTimeToRecover, timeToRecover);
+            recovering_ = false;
+        }
+        ++metrics_.reconnects;
+        // Changed together with the check above, so that a lost link is either seen here or reported as lost
+        postConnect(str("Reconnected to \'", deviceAlias_, "\'"), true);
+        state_ = State::Connected;
+        postStateChanged(State::Connected);
     }
+    // The events are dispatched by the thread that owns the callbacks, woken by the fd
+    return true;
+}
 
-    if (deviceProxy_) {
-        try {
-            deviceProxy_->callMethod("Disconnect").onInterface("org.bluez.Device1");
-        } catch (...) { }
-        deviceProxy_.reset();
+void BleUartClient::stopReconnectThread() {
+    {
+        std::lock_guard lock(reconnectMutex_);
+        reconnectStopping_ = true;
     }
+    reconnectWakeup_.notify_all();
+    // An attempt in progress is finished first: D-Bus calls cannot be interrupted
+    if (reconnectThread_.joinable()) reconnectThread_.join();
+}
+
+void BleUartClient::setReconnectPolicy(const ReconnectPolicy& reconnectPolicy) {
+    std::lock_guard lock(reconnectMutex_);
+    reconnectPolicy_ = reconnectPolicy;
+}
 
-    setState(State::Disconnected);
-    postDisconnect(str("Disconnected from \'", deviceAlias_, "\'"), false);
+BleUartClient::ReconnectStats BleUartClient::getReconnectStats() const {
+    std::lock_guard lock(reconnectMutex_);
+    return reconnectStats_;
+}
+
+BleUartClient::ConnectTimings BleUartClient::getConnectTimings() const {
+    std::lock_guard lock(reconnectMutex_);
+    return connectTimings_;
+}
+
+const ClientMetrics& BleUartClient::getMetrics() const {
+    return metrics_;
+}
+
+WritePacer::Stats BleUartClient::getPacerStats() const {
+    return pacer_.getStats();
+}
+
+void BleUartClient::setRecorder(std::shared_ptr<SessionRecorder> recorder) {
+    recorder_ = std::move(recorder);
+    recorderSource_ = recorder_ ? recorder_->addSource() : 0;
+}
+
+bool BleUartClient::disconnect() {
+    {
+        std::lock_guard lock(connectMutex_);
+        if (state_ == State::Disconnected) return false;
+
+        transport_->disconnectDevice();
+
+        updateState(State::Disconnected);
+        postDisconnect(str("Disconnected from \'", deviceAlias_, "\'"), false);
+    }
     processCallbacks();
     return true;
 }
 
 bool BleUartClient::send(const std::string& text) {
-    if (state_ != State::Connected || txCharPath_.empty()) {
+    return sendAsync(text).get();
+}
+
+std::future<bool> BleUartClient::sendAsync(std::string text) {
+    return enqueue(frameText(std::move(text)), 0);
+}
+
+void BleUartClient::sendAsync(std::string text, SendCompletion onWritten) {
+    enqueue(frameText(std::move(text)), 0, std::move(onWritten));
+}
+
+bool BleUartClient::sendBinary(const uint8_t* data, const size_t size) {
+    return sendBinaryAsync(data, size).get();
+}
+
+std::future<bool> BleUartClient::sendBinaryAsync(const uint8_t* data, const size_t size) {
+    if (txFramingMode_ != FramingMode::Binary) {
+        postError("Binary framing has not been negotiated", "", state_); //❌
+        std::promise<bool> refused;
+        refused.set_value(false);
+        return refused.get_future();
+    }
+    std::string frame;
+    BinaryFramer::encode(data, size, frame);
+    return enqueue(std::move(frame), 0);
+}
+
+std::string BleUartClient::frameText(std::string text) const {
+    if (txFramingMode_ != FramingMode::Binary) return text;
+    if (!text.empty() && text.back() == '\n') text.pop_back();
+    std::string frame;
+    BinaryFramer::encode(reinterpret_cast<const uint8_t*>(text.data()), text.size(), frame);
+    return frame;
+}
+
+bool BleUartClient::negotiateBinaryFraming(const std::chrono::milliseconds timeout) {
+    if (txFramingMode_ == FramingMode::Binary) return true;
+    binaryFramingRequested_ = true;
+    auto pending = request(str(BinaryFramingRequest, "\n"), [](const std::string_view line) {
+        return line.substr(0, BinaryFramingRequest.size()) == BinaryFramingRequest;
+    }, timeout);
+    pending.reply.wait();
+    binaryFramingRequested_ = false;
+    // Switched by the receive path as the reply came in; a robot that does not know the handshake leaves
+    // the connection in text mode
+    return txFramingMode_ == FramingMode::Binary;
+}
+
+BleUartClient::FramingMode BleUartClient::getFramingMode() const {
+    return txFramingMode_;
+}
+
+std::future<bool> BleUartClient::enqueue(std::string text, const RequestId requestId, SendCompletion onDone) {
+    std::promise<bool> refused;
+    auto refuse = [&] {
+        refused.set_value(false);
+        if (onDone) onDone(false);
+        if (requestId != 0) completeRequest(requestId, RequestStatus::SendFailed);
+        return refused.get_future();
+    };
+    if (state_ != State::Connected || !transport_->isReady()) {
+        postError("Not connected", "", state_); //❌
+        return refuse();
+    }
+
+    std::future<bool> future;
+    const auto fill = [&](OutboundCommand& command) {
+        command.text = std::move(text);
+        command.requestId = requestId;
+        command.queuedAt = std::chrono::steady_clock::now();
+        command.done = std::promise<bool>();
+        command.onDone = std::move(onDone);
+        future = command.done.get_future();
+    };
+    while (!sendQueue_.tryPush(fill, std::min(sendQueueLimit_.load(), sendQueue_.capacity()))) {
+        switch (backpressurePolicy_.load()) {
+            case BackpressurePolicy::Fail:
+                ++droppedCommands_;
+                return refuse();
+            case BackpressurePolicy::DropOldest:
+                sendQueue_.tryPop([this](OutboundCommand& oldest) {
+                    finishCommand(oldest, false);
+                    ++droppedCommands_;
+                });
+                break;
+            case BackpressurePolicy::Block: {
+                std::unique_lock lock(sendMutex_);
+                ++blockedSenders_;
+                // The timeout covers a limit lowered while waiting
+                sendSpace_.wait_for(lock, std::chrono::milliseconds(100), [this] {
+                    return writerStopping_ || sendQueue_.size() < std::min(sendQueueLimit_.load(), sendQueue_.capacity());
+                });
+                --blockedSenders_;
+                if (writerStopping_) return refuse();
+                break;
+            }
+        }
+    }
+    wakeWriter();
+    return future;
+}
+
+void BleUartClient::setBackpressurePolicy(const BackpressurePolicy& backpressurePolicy) {
+    backpressurePolicy_ = backpressurePolicy;
+}
+
+void BleUartClient::setSendQueueLimit(const size_t limit) {
+    sendQueueLimit_ = std::max<size_t>(limit, 1);
+}
+
+void BleUartClient::setCommandPacking(const bool enabled) {
+    commandPacking_ = enabled;
+}
+
+BleUartClient::SendQueueStats BleUartClient::getSendQueueStats() const {
+    return { sendQueue_.capacity(), sendQueue_.highWaterMark(), metrics_.writes, packedCommands_, droppedCommands_, failedCommands_ };
+}
+
+bool BleUartClient::sendLatest(const std::string& channel, std::string text) {
+    if (state_ != State::Connected || !transport_->isReady()) {
         postError("Not connected", "", state_); //❌
         return false;
     }
+    {
+        std::lock_guard lock(channelMutex_);
+        Channel& entry = channels_[channel];
+        ++entry.stats.updates;
+        if (entry.hasPending) {
+            ++entry.stats.superseded;
+        } else {
+            entry.hasPending = true;
+            ++pendingChannels_;
+        }
+        entry.pending = std::move(text);
+        entry.updatedAt = std::chrono::steady_clock::now();
+    }
+    wakeWriter();
+    return true;
+}
 
-    const auto charProxy = createProxy(*connection_, "org.bluez", txCharPath_);
-    charProxy->finishRegistration();
+void BleUartClient::setChannelInterval(const std::string& channel, const std::chrono::milliseconds minInterval) {
+    {
+        std::lock_guard lock(channelMutex_);
+        channels_[channel].minInterval = minInterval;
+    }
+    // A shorter interval may make a waiting update due now
+    wakeWriter();
+}
 
-    try {
-        constexpr long maxChunkSize = 19;
-        for (long offset = 0; offset < static_cast<long>(text.size()); offset += maxChunkSize) {
-            if (offset > 0) {
-                // Make a pause between chunks:
-                std::this_thread::sleep_for(std::chrono::milliseconds(2));
+BleUartClient::ChannelStats BleUartClient::getChannelStats(const std::string& channel) const {
+    std::lock_guard lock(channelMutex_);
+    const auto it = channels_.find(channel);
+    return it != channels_.end() ? it->second.stats : ChannelStats {};
+}
+
+bool BleUartClient::takeChannelUpdate(OutboundCommand& command) {
+    if (pendingChannels_ == 0) return false;
+    std::lock_guard lock(channelMutex_);
+    const auto now = std::chrono::steady_clock::now();
+    auto it = channels_.upper_bound(lastChannel_);
+    for (size_t visited = 0; visited < channels_.size(); ++visited, ++it) {
+        if (it == channels_.end()) it = channels_.begin();
+        Channel& channel = it->second;
+        if (!channel.hasPending || now < channel.sentAt + channel.minInterval) continue;
+
+        command.text = frameText(std::move(channel.pending));
+        command.done = std::promise<bool>();
+        command.onDone = nullptr;
+        command.requestId = 0;
+        command.queuedAt = channel.updatedAt;
+        channel.hasPending = false;
+        channel.sentAt = now;
+        ++channel.stats.sent;
+        --pendingChannels_;
+        lastChannel_ = it->first;
+        return true;
+    }
+    return false;
+}
+
+std::chrono::steady_clock::time_point BleUartClient::nextChannelDue() const {
+    auto due = std::chrono::steady_clock::time_point::max();
+    if (pendingChannels_ == 0) return due;
+    std::lock_guard lock(channelMutex_);
+    for (const auto& [name, channel] : channels_) {
+        if (channel.hasPending) due = std::min(due, channel.sentAt + channel.minInterval);
+    }
+    return due;
+}
+
+void BleUartClient::dropChannelUpdates() {
+    if (pendingChannels_ == 0) return;
+    std::lock_guard lock(channelMutex_);
+    for (auto& [name, channel] : channels_) {
+        if (!channel.hasPending) continue;
+        channel.hasPending = false;
+        channel.pending.clear();
+        ++channel.stats.dropped;
+    }
+    pendingChannels_ = 0;
+}
+
+bool BleUartClient::popCommand(OutboundCommand& command) {
+    const bool popped = sendQueue_.tryPop([&](OutboundCommand& queued) {
+        command.text = std::move(queued.text);
+        command.done = std::move(queued.done);
+        command.onDone = std::move(queued.onDone);
+        command.requestId = queued.requestId;
+        command.queuedAt = queued.queuedAt;
+    });
+    if (popped && blockedSenders_ > 0) {
+        std::lock_guard lock(sendMutex_);
+        sendSpace_.notify_all();
+    }
+    return popped;
+}
+
+void BleUartClient::wakeWriter() {
+    {
+        std::lock_guard lock(sendMutex_);
+        if (writerStopping_) return;
+        if (!writerThread_.joinable()) {
+            writerThread_ = std::thread([this] { writerLoop(); });
+            return;
+        }
+    }
+    if (writerSleeping_.exchange(false)) {
+        std::lock_guard lock(sendMutex_);
+        writerWakeup_.notify_one();
+    }
+}
+
+void BleUartClient::writerLoop() {
+    OutboundCommand command;
+    OutboundCommand next;
+    bool hasNext = false;
+    std::string batch;
+    std::vector<OutboundCommand> batched;
+    bool queueFirst = false;
+
+    while (true) {
+        if (hasNext) {
+            command = std::move(next);
+            hasNext = false;
+        } else if (queueFirst && popCommand(command)) {
+            queueFirst = false;
+        } else if (takeChannelUpdate(command)) {
+            // Queued commands get the next turn, so that a busy channel cannot starve them
+            queueFirst = true;
+        } else if (!popCommand(command)) {
+            std::unique_lock lock(sendMutex_);
+            if (writerStopping_) return;
+            writerSleeping_ = true;
+            // A command pushed before writerSleeping_ was set would otherwise wait for the next one
+            const auto channelDue = nextChannelDue();
+            if (sendQueue_.size() > 0 || channelDue <= std::chrono::steady_clock::now()) {
+                writerSleeping_ = false;
+                continue;
             }
+            if (channelDue == std::chrono::steady_clock::time_point::max()) {
+                writerWakeup_.wait(lock, [this] { return writerStopping_ || !writerSleeping_; });
+            } else {
+                // An update is held back by its channel's interval
+                writerWakeup_.wait_until(lock, channelDue, [this] { return writerStopping_ || !writerSleeping_; });
+                writerSleeping_ = false;
+            }
+            continue;
+        }
 
-            const long chunkLen = std::min(maxChunkSize, static_cast<long>(text.size()) - offset);
-            std::vector<uint8_t> chunk(text.begin() + offset, text.begin() + offset + chunkLen);
+        const size_t maxWriteSize = transport_->getMaxWriteSize();
+        if (!commandPacking_ || command.text.size() >= maxWriteSize) {
+            // Too long to share a write: sent on its own in MTU-sized chunks
+            bool written = true;
+            for (size_t offset = 0; written && offset < command.text.size(); offset += maxWriteSize) {
+                written = writeOut(command.text.data() + offset, std::min(maxWriteSize, command.text.size() - offset));
+            }
+            if (written) metrics_.sendToWrite.record(std::chrono::steady_clock::now() - command.queuedAt);
+            else ++failedCommands_;
+            finishCommand(command, written);
+            continue;
+        }
 
-            charProxy->callMethod("WriteValue")
-                .onInterface("org.bluez.GattCharacteristic1")
-                .withArguments(chunk, std::map<std::string, Variant>{});
+        // Short commands that are already waiting share one write
+        batch.assign(command.text);
+        batched.clear();
+        batched.push_back(std::move(command));
+        while (popCommand(next)) {
+            if (batch.size() + next.text.size() > maxWriteSize) {
+                hasNext = true;
+                break;
+            }
+            batch.append(next.text);
+            batched.push_back(std::move(next));
         }
 
-        return true;
-    } catch (const Error& e) {
-        postError(str("Send failed: ", e.getMessage()), e.getName(), state_); //❌
-        return false;
+        const bool written = batch.empty() || writeOut(batch.data(), batch.size());
+        const auto writtenAt = std::chrono::steady_clock::now();
+        if (batched.size() > 1) packedCommands_ += batched.size();
+        if (!written) failedCommands_ += batched.size();
+        for (auto& packed : batched) {
+            if (written) metrics_.sendToWrite.record(writtenAt - packed.queuedAt);
+            finishCommand(packed, written);
+        }
     }
 }
 
-void BleUartClient::processCallbacks() {
-    std::queue<std::function<void()>> pending;
+bool BleUartClient::writeOut(const char* data, const size_t size) {
+    const auto firstAttemptAt = std::chrono::steady_clock::now();
+    for (unsigned attempt = 0;; ++attempt) {
+        // Waits without connectMutex_, so that a disconnect is never held up by the pacing
+        std::this_thread::sleep_until(pacer_.schedule(size, std::chrono::steady_clock::now()));
+        {
+            std::lock_guard lock(connectMutex_);
+            if (state_ != State::Connected || !transport_->isReady()) return false;
+
+            try {
+                const bool withResponse = writeMode_ == WriteMode::WithResponse && transport_->supportsWriteWithResponse();
+                // Recorded first, so that the log never shows a reply before the command; a failed write is followed by its error
+                if (recorder_ && attempt == 0) recorder_->record(SessionRecorder::RecordType::Tx, data, size, recorderSource_);
+                const auto startedAt = std::chrono::steady_clock::now();
+                transport_->write(data, size, withResponse);
+                const auto writtenAt = std::chrono::steady_clock::now();
+                metrics_.write.record(writtenAt - startedAt);
+                pacer_.onWritten(size, writtenAt - startedAt, writtenAt);
+                ++metrics_.writes;
+                metrics_.bytesSent += size;
+                metrics_.paceWindow = pacer_.getWindow();
+                return true;
+            } catch (const Error& e) {
+                const auto failedAt = std::chrono::steady_clock::now();
+                if (!WritePacer::isBusyError(e.getName()) || failedAt - firstAttemptAt >= WritePacer::MaxBusyTime) {
+                    postError(str("Send failed: ", e.getMessage()), e.getName(), state_); //❌
+                    return false;
+                }
+                // The link is congested: the pacer slows down and the same chunk goes out again after the backoff
+                pacer_.onBusy(attempt, failedAt);
+                ++metrics_.busyRetries;
+                metrics_.paceWindow = pacer_.getWindow();
+            }
+        }
+    }
+}
+
+void BleUartClient::stopWriter() {
+    {
+        std::lock_guard lock(sendMutex_);
+        writerStopping_ = true;
+        writerSleeping_ = false;
+        writerWakeup_.notify_one();
+        sendSpace_.notify_all();
+    }
+    if (writerThread_.joinable()) writerThread_.join();
+    // Whatever is still queued will never be written
+    OutboundCommand command;
+    while (popCommand(command)) {
+        ++failedCommands_;
+        finishCommand(command, false);
+    }
+}
+
+void BleUartClient::finishCommand(OutboundCommand& command, const bool written) {
+    command.done.set_value(written);
+    if (command.onDone) {
+        command.onDone(written);
+        command.onDone = nullptr;
+    }
+    if (!written && command.requestId != 0) completeRequest(command.requestId, RequestStatus::SendFailed);
+}
+
+BleUartClient::PendingRequest BleUartClient::request(std::string command, ReplyMatcher matcher,
+                                                     const std::chrono::milliseconds timeout) {
+    return submitRequest(std::move(command), std::move(matcher), timeout, nullptr);
+}
+
+BleUartClient::RequestId BleUartClient::requestAsync(std::string command, ReplyCompletion onReply, ReplyMatcher matcher,
+                                                     const std::chrono::milliseconds timeout) {
+    return submitRequest(std::move(command), std::move(matcher), timeout, std::move(onReply)).id;
+}
+
+BleUartClient::PendingRequest BleUartClient::submitRequest(std::string command, ReplyMatcher matcher,
+                                                           const std::chrono::milliseconds timeout,
+                                                           ReplyCompletion onReply) {
+    const auto now = std::chrono::steady_clock::now();
+    std::future<Reply> reply;
+    RequestId id;
+    {
+        std::lock_guard lock(requestMutex_);
+        id = nextRequestId_++;
+        if (requests_.size() >= maxRequestsInFlight_) {
+            const Reply reply { RequestStatus::Rejected, {}, std::chrono::microseconds(0) };
+            std::promise<Reply> rejected;
+            rejected.set_value(reply);
+            if (onReply) onReply(reply);
+            ++requestStats_.failed;
+            return { id, rejected.get_future() };
+        }
+        // Registered before the command goes out, so that even an immediate reply finds it
+        requests_.push_back({ id, std::move(matcher), now, now + timeout, std::promise<Reply>(), std::move(onReply) });
+        reply = requests_.back().reply.get_future();
+        ++requestsInFlight_;
+        if (!requestTimerThread_.joinable()) {
+            requestTimerThread_ = std::thread([this] { requestTimerLoop(); });
+        }
+    }
+    requestWakeup_.notify_one();
+
+    enqueue(frameText(std::move(command)), id);
+    return { id, std::move(reply) };
+}
+
+bool BleUartClient::cancelRequest(const RequestId id) {
+    std::lock_guard lock(requestMutex_);
+    for (size_t i = 0; i < requests_.size(); ++i) {
+        if (requests_[i].id == id) {
+            completeRequestLocked(i, RequestStatus::Cancelled, {});
+            return true;
+        }
+    }
+    return false;
+}
+
+void BleUartClient::setMaxRequestsInFlight(const size_t maxRequestsInFlight) {
+    std::lock_guard lock(requestMutex_);
+    maxRequestsInFlight_ = std::max<size_t>(maxRequestsInFlight, 1);
+}
+
+BleUartClient::RequestStats BleUartClient::getRequestStats() const {
+    std::lock_guard lock(requestMutex_);
+    RequestStats stats = requestStats_;
+    stats.inFlight = requests_.size();
+    return stats;
+}
+
+void BleUartClient::handleReceived(const std::string_view message, const bool binary) {
+    ++metrics_.linesReceived;
+    if (requestsInFlight_ == 0 || !completeRequestWithLine(message)) postReceive(message, binary);
+    metrics_.receiveToLine.record(std::chrono::steady_clock::now() - rxArrivedAt_);
+}
+
+bool BleUartClient::completeRequestWithLine(const std::string_view line) {
+    std::lock_guard lock(requestMutex_);
+    size_t fifoIndex = requests_.size();
+    for (size_t i = 0; i < requests_.size(); ++i) {
+        const auto& matcher = requests_[i].matcher;
+        if (!matcher) {
+            if (fifoIndex == requests_.size()) fifoIndex = i;
+        } else if (matcher(line)) {
+            completeRequestLocked(i, RequestStatus::Replied, line);
+            return true;
+        }
+    }
+    if (fifoIndex == requests_.size()) return false;
+    completeRequestLocked(fifoIndex, RequestStatus::Replied, line);
+    return true;
+}
+
+void BleUartClient::completeRequest(const RequestId id, const RequestStatus status, const std::string_view line) {
+    std::lock_guard lock(requestMutex_);
+    for (size_t i = 0; i < requests_.size(); ++i) {
+        if (requests_[i].id == id) {
+            completeRequestLocked(i, status, line);
+            return;
+        }
+    }
+}
+
+void BleUartClient::completeRequestLocked(const size_t index, const RequestStatus status, const std::string_view line) {
+    auto& request = requests_[index];
+    const auto roundTripTime = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - request.submittedAt);
+    Reply reply { status, std::string(line), roundTripTime };
+    if (request.onReply) request.onReply(reply);
+    request.reply.set_value(std::move(reply));
+    requests_.erase(requests_.begin() + static_cast<std::ptrdiff_t>(index));
+    --requestsInFlight_;
+
+    switch (status) {
+        case RequestStatus::Replied:
+            ++requestStats_.replied;
+            totalRoundTripTime_ += roundTripTime;
+            requestStats_.lastRoundTripTime = roundTripTime;
+            requestStats_.meanRoundTripTime = totalRoundTripTime_ / requestStats_.replied;
+            requestStats_.maxRoundTripTime = std::max(requestStats_.maxRoundTripTime, roundTripTime);
+            metrics_.roundTrip.record(roundTripTime);
+            break;
+        case RequestStatus::TimedOut:
+            ++requestStats_.timedOut;
+            break;
+        case RequestStatus::Cancelled:
+            ++requestStats_.cancelled;
+            break;
+        default:
+            ++requestStats_.failed;
+            break;
+    }
+}
+
+void BleUartClient::failAllRequests(const RequestStatus status) {
+    if (requestsInFlight_ == 0) return;
+    std::lock_guard lock(requestMutex_);
+    while (!requests_.empty()) {
+        completeRequestLocked(0, status, {});
+    }
+}
+
+void BleUartClient::requestTimerLoop() {
+    std::unique_lock lock(requestMutex_);
+    while (!requestTimerStopping_) {
+        if (requests_.empty()) {
+            requestWakeup_.wait(lock);
+            continue;
+        }
+        auto deadline = requests_.front().deadline;
+        for (const auto& request : requests_) {
+            deadline = std::min(deadline, request.deadline);
+        }
+        requestWakeup_.wait_until(lock, deadline);
+
+        const auto now = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < requests_.size();) {
+            if (requests_[i].deadline <= now) {
+                completeRequestLocked(i, RequestStatus::TimedOut, {});
+            } else {
+                ++i;
+            }
+        }
+    }
+}
+
+void BleUartClient::stopRequestTimer() {
     {
-        std::lock_guard lock(callbackQueueMutex_);
-        std::swap(pending, callbackQueue_);
+        std::lock_guard lock(requestMutex_);
+        requestTimerStopping_ = true;
+    }
+    requestWakeup_.notify_one();
+    if (requestTimerThread_.joinable()) requestTimerThread_.join();
+    failAllRequests(RequestStatus::Cancelled);
+}
+
+void BleUartClient::setWriteMode(const WriteMode& writeMode) {
+    writeMode_ = writeMode;
+}
+
+BleUartClient::WriteMode BleUartClient::getWriteMode() const {
+    return writeMode_;
+}
+
+void BleUartClient::processCallbacks() {
+    // Clients of a fleet are dispatched by BleUartFleet::processCallbacks() only
+    if (ownsEvents_) events_->process();
+}
+
+size_t BleUartClient::processCallbacks(const size_t maxEvents) {
+    return ownsEvents_ ? events_->process(maxEvents) : 0;
+}
+
+int BleUartClient::getCallbackFd() const {
+    return events_->fd;
+}
+
+void BleUartClient::setOverflowPolicy(const OverflowPolicy& overflowPolicy) {
+    events_->overflowPolicy = overflowPolicy;
+}
+
+BleUartClient::EventQueueStats BleUartClient::getEventQueueStats() const {
+    return {
+        events_->queue.capacity(), events_->queue.highWaterMark(), events_->droppedLines, events_->droppedControlEvents
+    };
+}
+
+bool BleUartClient::setCallbackDelivery(const CallbackDelivery& delivery, std::shared_ptr<CallbackExecutor> executor) {
+    if (delivery == CallbackDelivery::Executor && !executor) return false;
+    callbackExecutor_ = std::move(executor);
+    callbackDelivery_ = delivery;
+    return true;
+}
+
+BleUartClient::CallbackDelivery BleUartClient::getCallbackDelivery() const {
+    return callbackDelivery_;
+}
+
+template<typename Fill>
+void BleUartClient::post(const Event::Type& type, Fill&& fill) {
+    const CallbackDelivery delivery = callbackDelivery_;
+    if (delivery == CallbackDelivery::Queued) {
+        events_->post(type, std::forward<Fill>(fill));
+        return;
     }
-    while (!pending.empty()) {
-        pending.front()();
-        pending.pop();
+    // Holds only what the event carries, unlike the queue's slots
+    Event event;
+    fill(event);
+    if (delivery == CallbackDelivery::Inline) {
+        dispatchEvent(event);
+    } else {
+        callbackExecutor_->execute([this, event = std::move(event)] { dispatchEvent(event); });
     }
 }
 
+void BleUartClient::dispatchEvent(const Event& event) const {
+    switch (event.type) {
+        case Event::Type::Connect:
+            if (connectCallback_) connectCallback_(deviceAlias_, event.text, event.flag);
+            break;
+        case Event::Type::Disconnect:
+            if (disconnectCallback_) disconnectCallback_(deviceAlias_, event.text, event.flag);
+            break;
+        case Event::Type::StateChanged:
+            if (stateChangedCallback_) stateChangedCallback_(deviceAlias_, event.state);
+            break;
+        case Event::Type::Error:
+            if (errorCallback_) errorCallback_(deviceAlias_, event.text, event.errorName, event.state);
+            break;
+        case Event::Type::Receive:
+            dispatchReceive(event.text, event.flag, event.postedAt);
+            break;
+    }
+}
+
+template<typename Text>
+void BleUartClient::dispatchReceive(const Text& text, const bool binary,
+                                    const std::chrono::steady_clock::time_point postedAt) const {
+    metrics_.lineToDispatch.record(std::chrono::steady_clock::now() - postedAt);
+    if (binary && receiveBinaryCallback_) {
+        receiveBinaryCallback_(deviceAlias_, reinterpret_cast<const uint8_t*>(text.data()), text.size());
+    } else if (receiveViewCallback_) {
+        receiveViewCallback_(deviceAlias_, text);
+    } else if (receiveCallback_) {
+        // Only a line delivered inline is copied, for the callback that wants a std::string
+        if constexpr (std::is_same_v<Text, std::string>) {
+            receiveCallback_(deviceAlias_, text);
+        } else {
+            receiveCallback_(deviceAlias_, std::string(text));
+        }
+    }
+}
+
+BleUartClient::EventChannel::EventChannel(const size_t capacity) :
+    queue(std::max(capacity, 2 * ReservedControlEvents)) {
+    fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+BleUartClient::EventChannel::~EventChannel() {
+    close(fd);
+}
+
+size_t BleUartClient::EventChannel::process(const size_t maxEvents) {
+    // The fd is drained before the flag is cleared: a post() in between would otherwise have its signal read here
+    // and leave the flag set, so that no later post() signals the fd again
+    uint64_t signalCount;
+    [[maybe_unused]] const auto n = read(fd, &signalCount, sizeof(signalCount));
+    signalPending = false;
+    const std::thread::id previousConsumer = consumer.exchange(std::this_thread::get_id());
+    size_t processed = 0;
+    while (processed < maxEvents && queue.tryPop([](const Event& event) { event.source->dispatchEvent(event); })) {
+        ++processed;
+    }
+    // Events left over wake the caller's loop again
+    if (processed == maxEvents && !signalPending.exchange(true)) {
+        constexpr uint64_t signal = 1;
+        [[maybe_unused]] const auto written = write(fd, &signal, sizeof(signal));
+    }
+    consumer = previousConsumer;
+    return processed;
+}
+
+template<typename Fill>
+void BleUartClient::EventChannel::post(const Event::Type& type, Fill&& fill) {
+    if (type != Event::Type::Receive) {
+        if (!pushControl(fill)) return;
+    } else {
+        const size_t lineLimit = queue.capacity() - ReservedControlEvents;
+        size_t evictions = 0;
+        while (!queue.tryPush(fill, lineLimit)) {
+            const OverflowPolicy policy = overflowPolicy;
+            if (policy == OverflowPolicy::Block) {
+                std::this_thread::yield();
+                continue;
+            }
+            if (policy == OverflowPolicy::DropNewest || evictions++ == queue.capacity() || !evictOldestLine()) {
+                ++droppedLines;
+                return;
+            }
+        }
+    }
+
+    if (!signalPending.exchange(true)) {
+        constexpr uint64_t signal = 1;
+        [[maybe_unused]] const auto n = write(fd, &signal, sizeof(signal));
+    }
+}
+
+template<typename Fill>
+bool BleUartClient::EventChannel::pushControl(Fill&& fill) {
+    if (queue.tryPush(fill, queue.capacity())) return true;
+    // Only the consumer makes room, so it must not wait for it itself, and nobody waits for a stalled one forever
+    if (consumer.load() != std::this_thread::get_id()) {
+        const auto deadline = std::chrono::steady_clock::now() + MaxControlEventWait;
+        while (std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::yield();
+            if (queue.tryPush(fill, queue.capacity())) return true;
+        }
+    }
+    ++droppedControlEvents;
+    return false;
+}
+
+bool BleUartClient::EventChannel::evictOldestLine() {
+    std::optional<Event> control;
+    const bool evicted = queue.tryPop([&](Event& oldest) {
+        if (oldest.type == Event::Type::Receive) {
+            ++droppedLines;
+        } else {
+            control.emplace(std::move(oldest));
+        }
+    });
+    // Connection events are not dropped but moved behind the newer lines, once their slot is free again
+    if (control) {
+        pushControl([&](Event& event) {
+            event.type = control->type;
+            event.source = control->source;
+            event.state = control->state;
+            event.flag = control->flag;
+            event.text.assign(control->text);
+            event.errorName.assign(control->errorName);
+        });
+    }
+    return evicted;
+}
+
 void BleUartClient::postConnect(const std::string& message, const bool afterFailure) {
-    std::lock_guard lock(callbackQueueMutex_);
-    callbackQueue_.emplace([=] { if (connectCallback_) connectCallback_(deviceAlias_, message, afterFailure); });
+    post(Event::Type::Connect, [&](Event& event) {
+        event.type = Event::Type::Connect;
+        event.source = this;
+        event.text.assign(message);
+        event.flag = afterFailure;
+    });
 }
 
 void BleUartClient::postDisconnect(const std::string& message, const bool isFailure) {
-    std::lock_guard lock(callbackQueueMutex_);
-    callbackQueue_.emplace([=] { if (disconnectCallback_) disconnectCallback_(deviceAlias_, message, isFailure); });
+    post(Event::Type::Disconnect, [&](Event& event) {
+        event.type = Event::Type::Disconnect;
+        event.source = this;
+        event.text.assign(message);
+        event.flag = isFailure;
+    });
 }
 
 void BleUartClient::postStateChanged(const State& state) {
-    std::lock_guard lock(callbackQueueMutex_);
-    callbackQueue_.emplace([=] { if (stateChangedCallback_) stateChangedCallback_(deviceAlias_, state); });
+    if (recorder_) recorder_->record(SessionRecorder::RecordType::State, std::string_view(stateToString(state)), recorderSource_);
+    post(Event::Type::StateChanged, [&](Event& event) {
+        event.type = Event::Type::StateChanged;
+        event.source = this;
+        event.state = state;
+    });
 }
 
-void BleUartClient::postReceive(const std::string& message) {
-    std::lock_guard lock(callbackQueueMutex_);
-    callbackQueue_.emplace([=] { if (receiveCallback_) receiveCallback_(deviceAlias_, message); });
+void BleUartClient::postReceive(const std::string_view message, const bool binary) {
+    if (callbackDelivery_ == CallbackDelivery::Inline) {
+        // Straight from the framer's buffer, without copying the line
+        dispatchReceive(message, binary, std::chrono::steady_clock::now());
+        return;
+    }
+    post(Event::Type::Receive, [&](Event& event) {
+        event.type = Event::Type::Receive;
+        event.source = this;
+        event.text.assign(message);
+        event.flag = binary;
+        event.postedAt = std::chrono::steady_clock::now();
+    });
 }
 
 void BleUartClient::postError(const std::string& message, const std::string& sdbusErrorName, const State& state) {
-    std::lock_guard lock(callbackQueueMutex_);
-    callbackQueue_.emplace([=] { if (errorCallback_) errorCallback_(deviceAlias_, message, sdbusErrorName, state); });
+    ++metrics_.errors;
+    if (recorder_) recorder_->record(SessionRecorder::RecordType::Error, message, recorderSource_);
+    post(Event::Type::Error, [&](Event& event) {
+        event.type = Event::Type::Error;
+        event.source = this;
+        event.text.assign(message);
+        event.errorName.assign(sdbusErrorName);
+        event.state = state;
+    });
 }
@@ -1,12 +1,27 @@
 #ifndef BLE_UART_CLIENT_H
 #define BLE_UART_CLIENT_H
 
+#include "client_metrics.h"
+#include "binary_framer.h"
+#include "event_queue.h"
+#include "gatt_transport.h"
+#include "line_framer.h"
+#include "session_recorder.h"
+#include "write_pacer.h"
+#include <string_view>
 #include <vector>
 #include <functional>
-#include <queue>
+#include <map>
+#include <future>
+#include <memory>
 #include <sstream>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <limits>
+#include <mutex>
+#include <thread>
 #include <sdbus-c++/IConnection.h>
-#include <sdbus-c++/IProxy.h>
 
 namespace mimi {
 
@@ -18,10 +33,12 @@ std::string str(Args&&... args)
     return oss.str();
 }
 
-struct PairedDevice {
-    std::string alias;
-    std::string address;
-    std::string path;
+// Runs the client's callbacks as tasks, e.g. on an application's thread pool or event loop.
+// A client's tasks are handed over in event order; an executor running them concurrently gives that order up.
+class CallbackExecutor {
+public:
+    virtual ~CallbackExecutor() = default;
+    virtual void execute(std::function<void()> task) = 0;
 };
 
 class BleUartClient {
@@ -32,13 +49,175 @@ public:
         Reconnecting,
     };
 
+    enum class WriteMode {
+        WithResponse,
+        WithoutResponse,
+    };
+
+    enum class FramingMode {
+        // Newline-terminated lines in both directions
+        Text,
+        // BinaryFramer frames in both directions
+        Binary,
+    };
+
+    // Where the callbacks run
+    enum class CallbackDelivery {
+        // On the thread calling processCallbacks()
+        Queued,
+        // Right away on the thread that produced the event: the D-Bus thread, the writer, or the caller of connect().
+        // Callbacks must be quick and must not call connect(), disconnect(), send() or request().get() then.
+        Inline,
+        // As tasks of a CallbackExecutor
+        Executor,
+    };
+
+    // What happens to a received line when the event queue is full
+    enum class OverflowPolicy {
+        DropNewest,
+        DropOldest,
+        Block,
+    };
+
+    struct EventQueueStats {
+        size_t capacity;
+        size_t highWaterMark;
+        uint64_t droppedLines;
+        // Connection events that found the queue full for longer than MaxControlEventWait
+        uint64_t droppedControlEvents;
+    };
+
+    // What sendAsync() does when the outbound queue is full
+    enum class BackpressurePolicy {
+        Block,
+        Fail,
+        DropOldest,
+    };
+
+    struct SendQueueStats {
+        size_t capacity;
+        size_t highWaterMark;
+        uint64_t writes;
+        // Commands that went out in one write together with at least one other command
+        uint64_t packedCommands;
+        // Refused by BackpressurePolicy::Fail or pushed out by BackpressurePolicy::DropOldest
+        uint64_t droppedCommands;
+        // Accepted, but the link was lost or the write failed
+        uint64_t failedCommands;
+    };
+
+    struct ChannelStats {
+        uint64_t updates;
+        uint64_t sent;
+        // Replaced by a newer value before they could be written
+        uint64_t superseded;
+        // Still waiting when the link went down
+        uint64_t dropped;
+    };
+
+    enum class RequestStatus {
+        Replied,
+        TimedOut,
+        Cancelled,
+        // The command could not be written
+        SendFailed,
+        // The link went down before the reply arrived
+        LinkLost,
+        // Too many requests were already waiting for replies
+        Rejected,
+    };
+
+    using RequestId = uint64_t;
+    // Tells whether a received line is the reply to a request.
+    // Runs on the thread that receives the line and must not call back into the client.
+    using ReplyMatcher = std::function<bool(std::string_view line)>;
+
+    struct Reply {
+        RequestStatus status;
+        std::string line;
+        // From request() to the reply, time spent in the send queue included
+        std::chrono::microseconds roundTripTime;
+    };
+
+    struct PendingRequest {
+        RequestId id;
+        std::future<Reply> reply;
+    };
+
+    // Called once a queued text has been written, or has failed, on the writer thread or, if the text
+    // is refused right away, on the caller's. Must be quick and must not call back into the client.
+    using SendCompletion = std::function<void(bool written)>;
+    // Called once a request completes, on the thread completing it, with the client's request lock held.
+    // Must be quick and must not call back into the client.
+    using ReplyCompletion = std::function<void(const Reply& reply)>;
+
+    struct RequestStats {
+        size_t inFlight;
+        uint64_t replied;
+        uint64_t timedOut;
+        uint64_t cancelled;
+        uint64_t failed;
+        std::chrono::microseconds lastRoundTripTime;
+        std::chrono::microseconds meanRoundTripTime;
+        std::chrono::microseconds maxRoundTripTime;
+    };
+
+    // Retry delays while reconnecting. A sign from BlueZ that the robot is back cuts any delay short.
+    struct ReconnectPolicy {
+        std::chrono::milliseconds initialDelay { 250 };
+        std::chrono::milliseconds maxDelay { 30000 };
+        double multiplier = 2.0;
+        // Every delay is randomly lengthened or shortened by up to this fraction
+        double jitter = 0.2;
+    };
+
+    struct ReconnectStats {
+        uint64_t linkLosses;
+        uint64_t recoveries;
+        uint64_t attempts;
+        // From the lost link to the first event after reconnecting
+        std::chrono::microseconds lastTimeToRecover;
+        std::chrono::microseconds meanTimeToRecover;
+        std::chrono::microseconds maxTimeToRecover;
+    };
+
+    // Stages of the latest successful connect or reconnect
+    struct ConnectTimings {
+        // Finding the device object of the alias
+        std::chrono::microseconds lookup;
+        // Device1.Connect
+        std::chrono::microseconds connect;
+        // Finding the UART characteristics
+        std::chrono::microseconds discovery;
+        // Starting notifications and watching the connection
+        std::chrono::microseconds notifications;
+        std::chrono::microseconds total;
+    };
+
     using ConnectCallback = std::function<void(const std::string& deviceAlias, const std::string& message, bool afterFailure)>;
     using DisconnectCallback = std::function<void(const std::string& deviceAlias, const std::string& message, bool isFailure)>;
     using StateChangedCallback = std::function<void(const std::string& deviceAlias, const State& state)>;
     using ErrorCallback = std::function<void(const std::string& deviceAlias, const std::string& message, const std::string& sdbusErrorName, const State& state)>;
     using ReceiveCallback = std::function<void(const std::string& deviceAlias, const std::string& receivedText)>;
+    // The view is only valid during the call
+    using ReceiveViewCallback = std::function<void(const std::string& deviceAlias, std::string_view receivedText)>;
+    // The payload of a received frame, only valid during the call
+    using ReceiveBinaryCallback = std::function<void(const std::string& deviceAlias, const uint8_t* data, size_t size)>;
+
+    static constexpr size_t DefaultEventQueueCapacity = 1024;
+    static constexpr size_t SendQueueCapacity = 256;
+    static constexpr size_t DefaultMaxRequestsInFlight = 32;
+    static constexpr std::chrono::milliseconds DefaultRequestTimeout { 2000 };
+    // The text handshake of negotiateBinaryFraming(): the request, and the robot's reply if it agrees
+    static constexpr std::string_view BinaryFramingRequest = "@framing binary";
+    static constexpr std::string_view BinaryFramingAccepted = "@framing binary ok";
 
+    // Talks to BlueZ over its own system bus connection
+    explicit BleUartClient(size_t eventQueueCapacity = DefaultEventQueueCapacity);
+    explicit BleUartClient(std::unique_ptr<GattTransport> transport, size_t eventQueueCapacity = DefaultEventQueueCapacity);
     ~BleUartClient();
+    BleUartClient(const BleUartClient&) = delete;
+    BleUartClient& operator=(const BleUartClient&) = delete;
 
     void setCallbacks(
         ConnectCallback connectCallback,
@@ -46,13 +225,83 @@ public:
         StateChangedCallback stateChangedCallback,
         ErrorCallback errorCallback,
         ReceiveCallback receiveCallback);
+    // Takes precedence over ReceiveCallback when set
+    void setReceiveViewCallback(ReceiveViewCallback receiveViewCallback);
+    // Takes received frames in binary framing mode; without it they go to the text callbacks like lines
+    void setReceiveBinaryCallback(ReceiveBinaryCallback receiveBinaryCallback);
+    void setOverlongLinePolicy(const LineFramer::OverlongPolicy& overlongPolicy);
 
+    // Opens a system bus connection for the call; pass one to reuse it
     static std::vector<PairedDevice> listPairedDevices();
+    static std::vector<PairedDevice> listPairedDevices(sdbus::IConnection& connection);
+    // Both dispatch the queued callbacks on the calling thread before returning, so call them from the thread
+    // that calls processCallbacks(). Events of the client's own threads, reconnects included, only wake getCallbackFd().
     bool connect(const std::string& alias, bool keepConnection);
     bool disconnect();
     [[nodiscard]] State getState() const;
+    // Blocks until the text has been written
     [[nodiscard]] bool send(const std::string& text);
+    // Queues the text for the client's writer thread. Commands queued together are packed into as few
+    // writes as the MTU allows. The future becomes true once the text has been written.
+    std::future<bool> sendAsync(std::string text);
+    // Same, with the outcome handed to a callback instead of a future, so that nobody has to wait for it
+    void sendAsync(std::string text, SendCompletion onWritten);
+    void setBackpressurePolicy(const BackpressurePolicy& backpressurePolicy);
+    // Commands queued at most, up to SendQueueCapacity
+    void setSendQueueLimit(size_t limit);
+    // Packing is on by default; off, every command gets writes of its own
+    void setCommandPacking(bool enabled);
+    [[nodiscard]] SendQueueStats getSendQueueStats() const;
+    // Latest value wins: of the updates sent on a channel only the newest waits to be written, so the robot never
+    // acts on stale values however fast they come. Meant for continuous control such as motor setpoints, with the
+    // command prefix as the channel. Updates and queued commands take turns. Returns false if not connected.
+    bool sendLatest(const std::string& channel, std::string text);
+    // At most one update of the channel is written per interval, the newest one once the interval is over
+    void setChannelInterval(const std::string& channel, std::chrono::milliseconds minInterval);
+    [[nodiscard]] ChannelStats getChannelStats(const std::string& channel) const;
+    // Sends the command and waits for its reply without blocking, so several requests can be in flight.
+    // A line goes to the oldest request whose matcher accepts it; failing that, to the oldest request
+    // without a matcher. Lines that complete a request are not passed to the receive callbacks.
+    PendingRequest request(std::string command, ReplyMatcher matcher = nullptr,
+                           std::chrono::milliseconds timeout = DefaultRequestTimeout);
+    // Same, with the reply handed to a callback instead of a future
+    RequestId requestAsync(std::string command, ReplyCompletion onReply, ReplyMatcher matcher = nullptr,
+                           std::chrono::milliseconds timeout = DefaultRequestTimeout);
+    // Returns false if the request has already completed
+    bool cancelRequest(RequestId id);
+    void setMaxRequestsInFlight(size_t maxRequestsInFlight);
+    [[nodiscard]] RequestStats getRequestStats() const;
+    // Asks the robot to switch both directions to binary frames. If it does not agree in time, the
+    // connection stays in text mode and false is returned. Every new connection starts in text mode.
+    // In binary mode sendAsync() sends the text as a frame of its own, without a trailing newline.
+    bool negotiateBinaryFraming(std::chrono::milliseconds timeout = DefaultRequestTimeout);
+    [[nodiscard]] FramingMode getFramingMode() const;
+    // Only in binary framing mode
+    [[nodiscard]] bool sendBinary(const uint8_t* data, size_t size);
+    std::future<bool> sendBinaryAsync(const uint8_t* data, size_t size);
+    void setWriteMode(const WriteMode& writeMode);
+    [[nodiscard]] WriteMode getWriteMode() const;
     void processCallbacks();
+    // Dispatches at most maxEvents queued events and returns how many it did; the fd stays readable while any are left
+    size_t processCallbacks(size_t maxEvents);
+    // Becomes readable whenever there are callbacks waiting for processCallbacks()
+    [[nodiscard]] int getCallbackFd() const;
+    void setOverflowPolicy(const OverflowPolicy& overflowPolicy);
+    [[nodiscard]] EventQueueStats getEventQueueStats() const;
+    // Call before connect(). Queued is the default; Executor needs an executor, which the client must outlive.
+    // Returns false, leaving the delivery unchanged, if the executor is missing.
+    bool setCallbackDelivery(const CallbackDelivery& delivery, std::shared_ptr<CallbackExecutor> executor = nullptr);
+    [[nodiscard]] CallbackDelivery getCallbackDelivery() const;
+    void setReconnectPolicy(const ReconnectPolicy& reconnectPolicy);
+    [[nodiscard]] ReconnectStats getReconnectStats() const;
+    [[nodiscard]] ConnectTimings getConnectTimings() const;
+    // Safe to read from any thread while the client is in use
+    [[nodiscard]] const ClientMetrics& getMetrics() const;
+    // How fast the writer currently lets chunks onto the link
+    [[nodiscard]] WritePacer::Stats getPacerStats() const;
+    // Every written chunk, received notification, state change and error goes to the recorder.
+    // Has to be set before connect(); several clients may share one recorder, each recorded as a source of its own.
+    void setRecorder(std::shared_ptr<SessionRecorder> recorder);
 
     static const char* stateToString(const State& state) {
         switch (state) {
@@ -62,39 +311,234 @@ public:
         }
         return "Unknown";
     }
+
+    static const char* requestStatusToString(const RequestStatus& status) {
+        switch (status) {
+            case RequestStatus::Replied:    return "Replied";
+            case RequestStatus::TimedOut:   return "TimedOut";
+            case RequestStatus::Cancelled:  return "Cancelled";
+            case RequestStatus::SendFailed: return "SendFailed";
+            case RequestStatus::LinkLost:   return "LinkLost";
+            case RequestStatus::Rejected:   return "Rejected";
+        }
+        return "Unknown";
+    }
 private:
+    friend class BleUartFleet;
+
     ConnectCallback connectCallback_ = nullptr;
     DisconnectCallback disconnectCallback_ = nullptr;
     StateChangedCallback stateChangedCallback_ = nullptr;
     ErrorCallback errorCallback_ = nullptr;
     ReceiveCallback receiveCallback_ = nullptr;
+    ReceiveViewCallback receiveViewCallback_ = nullptr;
+    ReceiveBinaryCallback receiveBinaryCallback_ = nullptr;
 
     std::string deviceAlias_;
-    bool keepConnection_ = false;
+    std::atomic<bool> keepConnection_ = false;
     std::atomic<State> state_ = State::Disconnected;
-    void setState(const State& state);
+    void updateState(const State& state);
 
+    // Held while the transport connects or disconnects, so that disconnect() and a reconnect attempt never overlap
+    std::mutex connectMutex_;
     std::thread reconnectThread_;
-    void startReconnectLoop();
-    static constexpr int ReconnectIntervalInSeconds = 30;
-
-    sdbus::IConnection* connection_ = nullptr;
-    std::unique_ptr<sdbus::IProxy> deviceProxy_;
-    std::unique_ptr<sdbus::IProxy> rxProxy_;
-    std::string txCharPath_;
-    std::string rxCharPath_;
-    std::string rxAssembleBuffer_;
-
-    std::queue<std::function<void()>> callbackQueue_;
-    std::mutex callbackQueueMutex_;
+    // Guards the reconnect fields below and every change of state_
+    mutable std::mutex reconnectMutex_;
+    std::condition_variable reconnectWakeup_;
+    bool reconnectStopping_ = false;
+    bool linkAvailable_ = false;
+    bool attemptInvalidated_ = false;
+    bool recovering_ = false;
+    std::chrono::steady_clock::time_point linkLostAt_;
+    std::chrono::microseconds totalTimeToRecover_ { 0 };
+    ReconnectPolicy reconnectPolicy_;
+    ReconnectStats reconnectStats_ {};
+    ConnectTimings connectTimings_ {};
+    void startReconnectLoop(bool linkLost);
+    // Cuts the wait before the next reconnect attempt short
+    void signalLinkAvailable();
+    void reconnectLoop();
+    bool tryReconnect();
+    void stopReconnectThread();
+
+    std::unique_ptr<GattTransport> transport_;
+    std::atomic<WriteMode> writeMode_ = WriteMode::WithResponse;
+
+    struct OutboundCommand {
+        std::string text;
+        std::promise<bool> done;
+        SendCompletion onDone;
+        // Non-zero for the command of a request
+        RequestId requestId = 0;
+        std::chrono::steady_clock::time_point queuedAt;
+    };
+
+    EventQueue<OutboundCommand> sendQueue_ { SendQueueCapacity };
+    std::atomic<size_t> sendQueueLimit_ = SendQueueCapacity;
+    std::atomic<BackpressurePolicy> backpressurePolicy_ = BackpressurePolicy::Block;
+    std::atomic<bool> commandPacking_ = true;
+    std::thread writerThread_;
+    // Only for sleeping: the writer while the queue is empty, senders while it is full
+    std::mutex sendMutex_;
+    std::condition_variable writerWakeup_;
+    std::condition_variable sendSpace_;
+    std::atomic<bool> writerSleeping_ = false;
+    std::atomic<size_t> blockedSenders_ = 0;
+    bool writerStopping_ = false;
+    std::atomic<uint64_t> packedCommands_ = 0;
+    std::atomic<uint64_t> droppedCommands_ = 0;
+    std::atomic<uint64_t> failedCommands_ = 0;
+    struct Channel {
+        std::string pending;
+        bool hasPending = false;
+        std::chrono::steady_clock::time_point updatedAt;
+        std::chrono::steady_clock::time_point sentAt;
+        std::chrono::milliseconds minInterval { 0 };
+        ChannelStats stats {};
+    };
+
+    mutable std::mutex channelMutex_;
+    std::map<std::string, Channel> channels_;
+    // Channels are served round-robin, starting after the one served last
+    std::string lastChannel_;
+    // Lets the writer skip channelMutex_ while no update is waiting
+    std::atomic<size_t> pendingChannels_ = 0;
+    bool takeChannelUpdate(OutboundCommand& command);
+    // time_point::max() if no update is waiting
+    std::chrono::steady_clock::time_point nextChannelDue() const;
+    void dropChannelUpdates();
+
+    std::future<bool> enqueue(std::string text, RequestId requestId, SendCompletion onDone = nullptr);
+    // Turns a text command into a frame in binary framing mode
+    [[nodiscard]] std::string frameText(std::string text) const;
+    void finishCommand(OutboundCommand& command, bool written);
+    bool popCommand(OutboundCommand& command);
+    void wakeWriter();
+    void writerLoop();
+    bool writeOut(const char* data, size_t size);
+    void stopWriter();
+
+    struct InFlightRequest {
+        RequestId id;
+        ReplyMatcher matcher;
+        std::chrono::steady_clock::time_point submittedAt;
+        std::chrono::steady_clock::time_point deadline;
+        std::promise<Reply> reply;
+        ReplyCompletion onReply;
+    };
+
+    // In submission order
+    std::vector<InFlightRequest> requests_;
+    mutable std::mutex requestMutex_;
+    std::condition_variable requestWakeup_;
+    std::thread requestTimerThread_;
+    bool requestTimerStopping_ = false;
+    // Lets received lines skip requestMutex_ while no request is waiting
+    std::atomic<size_t> requestsInFlight_ = 0;
+    size_t maxRequestsInFlight_ = DefaultMaxRequestsInFlight;
+    RequestId nextRequestId_ = 1;
+    RequestStats requestStats_ {};
+    std::chrono::microseconds totalRoundTripTime_ { 0 };
+    bool completeRequestWithLine(std::string_view line);
+    void completeRequest(RequestId id, RequestStatus status, std::string_view line = {});
+    void completeRequestLocked(size_t index, RequestStatus status, std::string_view line);
+    void failAllRequests(RequestStatus status);
+    PendingRequest submitRequest(std::string command, ReplyMatcher matcher, std::chrono::milliseconds timeout,
+                                 ReplyCompletion onReply);
+    void requestTimerLoop();
+    void stopRequestTimer();
+    LineFramer rxFramer_;
+    BinaryFramer rxBinaryFramer_;
+    // Switched by the thread that receives the robot's acceptance, before the next notification is framed
+    std::atomic<FramingMode> rxFramingMode_ = FramingMode::Text;
+    std::atomic<FramingMode> txFramingMode_ = FramingMode::Text;
+    std::atomic<bool> binaryFramingRequested_ = false;
+    void handleReceived(std::string_view message, bool binary);
+    // Arrival of the latest notification; only touched by the thread that feeds rxFramer_
+    std::chrono::steady_clock::time_point rxArrivedAt_;
+    // Mutable so that dispatchEvent() can record into it
+    mutable ClientMetrics metrics_;
+    WritePacer pacer_;
+    std::shared_ptr<SessionRecorder> recorder_;
+    // Tells this client's records apart in a log shared with other clients
+    uint16_t recorderSource_ = 0;
+    // Only used on the receive path while binary framing is being negotiated
+    std::string recordedNotification_;
+    void recordHandshakeReceived(char* data, size_t size);
+    void setupTransport();
+
+    struct Event {
+        enum class Type {
+            Connect,
+            Disconnect,
+            StateChanged,
+            Error,
+            Receive,
+        };
+
+        Type type = Type::Receive;
+        const BleUartClient* source = nullptr;
+        State state = State::Disconnected;
+        // afterFailure, isFailure, or a received frame rather than a line
+        bool flag = false;
+        std::string text;
+        std::string errorName;
+        // When a received line was queued
+        std::chrono::steady_clock::time_point postedAt;
+    };
+
+    // Slots of the event queue are filled in place, so they keep room for a whole line from the start
+    struct QueuedEvent : Event {
+        QueuedEvent() { text.reserve(LineFramer::DefaultCapacity); }
+    };
+
+    // Queue plus wakeup fd; shared by all clients of a BleUartFleet
+    struct EventChannel {
+        explicit EventChannel(size_t capacity);
+        ~EventChannel();
+        EventChannel(const EventChannel&) = delete;
+        EventChannel& operator=(const EventChannel&) = delete;
+
+        // Slots kept free for connection events, which are only dropped if the queue stays full
+        static constexpr size_t ReservedControlEvents = 16;
+        static constexpr std::chrono::milliseconds MaxControlEventWait { 1000 };
+        EventQueue<QueuedEvent> queue;
+        std::atomic<OverflowPolicy> overflowPolicy = OverflowPolicy::DropNewest;
+        std::atomic<uint64_t> droppedLines = 0;
+        std::atomic<uint64_t> droppedControlEvents = 0;
+        std::atomic<bool> signalPending = false;
+        // The thread inside process(), which would wait for itself if it waited for room in the queue
+        std::atomic<std::thread::id> consumer;
+        int fd = -1;
+
+        template<typename Fill>
+        void post(const Event::Type& type, Fill&& fill);
+        template<typename Fill>
+        bool pushControl(Fill&& fill);
+        bool evictOldestLine();
+        size_t process(size_t maxEvents = std::numeric_limits<size_t>::max());
+    };
+
+    std::shared_ptr<EventChannel> events_;
+    bool ownsEvents_ = true;
+    std::atomic<CallbackDelivery> callbackDelivery_ = CallbackDelivery::Queued;
+    std::shared_ptr<CallbackExecutor> callbackExecutor_;
+    BleUartClient(std::unique_ptr<GattTransport> transport, std::shared_ptr<EventChannel> events);
+    // Queues the event or, with another delivery, dispatches it right away
+    template<typename Fill>
+    void post(const Event::Type& type, Fill&& fill);
+    void dispatchEvent(const Event& event) const;
+    // Text is the queued std::string or, delivered inline, a std::string_view into the framer's buffer
+    template<typename Text>
+    void dispatchReceive(const Text& text, bool binary, std::chrono::steady_clock::time_point postedAt) const;
     void postConnect(const std::string& message, bool afterFailure);
     void postDisconnect(const std::string& message, bool isFailure);
     void postStateChanged(const State& state);
-    void postReceive(const std::string& message);
+    void postReceive(std::string_view message, bool binary);
     void postError(const std::string& message, const std::string& sdbusErrorName, const State& state);
 
     bool doConnect();
-    bool findDevice(std::vector<PairedDevice> pairedDevices, PairedDevice& pairedDevice);
+    bool findDevice(PairedDevice& pairedDevice);
     bool connectGatt(const PairedDevice &pairedDevice);
     bool discoverCharacteristics();
     bool setupReceiveNotifications();
@@ -0,0 +1,214 @@
+#include "ble_uart_fleet.h"
+#include "bluez_transport.h"
+#include <thread>
+#include <sdbus-c++/sdbus-c++.h>
+
+using namespace sdbus;
+using namespace mimi;
+
+namespace {
+    constexpr const char* AdapterInterface = "org.bluez.Adapter1";
+}
+
+BleUartFleet::BleUartFleet(const size_t eventQueueCapacity) :
+    BleUartFleet(createSystemBusConnection(), eventQueueCapacity) {
+}
+
+BleUartFleet::BleUartFleet(std::unique_ptr<IConnection> connection, const size_t eventQueueCapacity) :
+    connection_(std::move(connection)),
+    cache_(std::make_shared<GattCache>(*connection_)),
+    events_(std::make_shared<BleUartClient::EventChannel>(eventQueueCapacity)) {
+    connection_->enterEventLoopAsync();
+}
+
+BleUartFleet::~BleUartFleet() {
+    stopDiscovery();
+    disconnectAll();
+    clients_.clear();
+    connection_->leaveEventLoop();
+}
+
+void BleUartFleet::setCallbacks(
+        BleUartClient::ConnectCallback connectCallback,
+        BleUartClient::DisconnectCallback disconnectCallback,
+        BleUartClient::StateChangedCallback stateChangedCallback,
+        BleUartClient::ErrorCallback errorCallback,
+        BleUartClient::ReceiveCallback receiveCallback) {
+    connectCallback_ = std::move(connectCallback);
+    disconnectCallback_ = std::move(disconnectCallback);
+    stateChangedCallback_ = std::move(stateChangedCallback);
+    errorCallback_ = std::move(errorCallback);
+    receiveCallback_ = std::move(receiveCallback);
+    for (const auto& [alias, client] : clients_) {
+        applyCallbacks(*client);
+    }
+}
+
+void BleUartFleet::setReceiveViewCallback(BleUartClient::ReceiveViewCallback receiveViewCallback) {
+    receiveViewCallback_ = std::move(receiveViewCallback);
+    for (const auto& [alias, client] : clients_) {
+        client->setReceiveViewCallback(receiveViewCallback_);
+    }
+}
+
+void BleUartFleet::setReceiveBinaryCallback(BleUartClient::ReceiveBinaryCallback receiveBinaryCallback) {
+    receiveBinaryCallback_ = std::move(receiveBinaryCallback);
+    for (const auto& [alias, client] : clients_) {
+        client->setReceiveBinaryCallback(receiveBinaryCallback_);
+    }
+}
+
+void BleUartFleet::applyCallbacks(BleUartClient& client) const {
+    client.setCallbacks(connectCallback_, disconnectCallback_, stateChangedCallback_, errorCallback_, receiveCallback_);
+    client.setReceiveViewCallback(receiveViewCallback_);
+    client.setReceiveBinaryCallback(receiveBinaryCallback_);
+}
+
+std::vector<PairedDevice> BleUartFleet::listPairedDevices() {
+    return cache_->getPairedDevices();
+}
+
+void BleUartFleet::setCacheFile(const std::string& filePath) {
+    cache_->setFile(filePath);
+}
+
+BleUartClient& BleUartFleet::add(const std::string& alias) {
+    std::lock_guard lock(clientsMutex_);
+    auto& client = clients_[alias];
+    if (!client) {
+        client.reset(new BleUartClient(std::make_unique<BluezTransport>(*connection_, cache_), events_));
+        client->deviceAlias_ = alias;
+        applyCallbacks(*client);
+    }
+    return *client;
+}
+
+BleUartClient* BleUartFleet::find(const std::string& alias) const {
+    const auto it = clients_.find(alias);
+    return it != clients_.end() ? it->second.get() : nullptr;
+}
+
+std::vector<std::string> BleUartFleet::getAliases() const {
+    std::vector<std::string> aliases;
+    aliases.reserve(clients_.size());
+    for (const auto& [alias, client] : clients_) {
+        aliases.push_back(alias);
+    }
+    return aliases;
+}
+
+size_t BleUartFleet::connectAll(const bool keepConnection) {
+    std::atomic<size_t> connected = 0;
+    std::vector<std::thread> threads;
+    threads.reserve(clients_.size());
+    for (const auto& [alias, client] : clients_) {
+        threads.emplace_back([&, alias = alias, client = client.get()] {
+            if (client->connect(alias, keepConnection)) ++connected;
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    return connected;
+}
+
+void BleUartFleet::disconnectAll() {
+    for (const auto& [alias, client] : clients_) {
+        client->disconnect();
+    }
+}
+
+void BleUartFleet::startDiscovery() {
+    if (adapterProxy_) return;
+    const std::string adapterPath = cache_->getAdapterPath();
+    if (adapterPath.empty()) throw Error("org.bluez.Error.NotReady", "No Bluetooth adapter");
+
+    auto adapter = createProxy(*connection_, BluezTransport::ServiceName, adapterPath);
+    adapter->finishRegistration();
+    // Only robots turn up, and only over LE, which is all they speak
+    adapter->callMethod("SetDiscoveryFilter").onInterface(AdapterInterface).withArguments(std::map<std::string, Variant>{
+        { "UUIDs", Variant(std::vector<std::string>{ BluezTransport::UartServiceUuid }) },
+        { "Transport", Variant(std::string("le")) },
+    });
+    adapter->callMethod("StartDiscovery").onInterface(AdapterInterface);
+    adapterProxy_ = std::move(adapter);
+
+    discoveryListener_ = cache_->addDeviceListener("", [this](const PairedDevice& device,
+                                                              const std::map<std::string, Variant>& properties,
+                                                              const bool appeared) {
+        // Adverts of a device BlueZ already knew only show up as RSSI changes
+        if (!appeared && properties.count("RSSI") == 0) return;
+        std::lock_guard lock(clientsMutex_);
+        const auto it = clients_.find(device.alias);
+        if (it != clients_.end()) it->second->signalLinkAvailable();
+    });
+}
+
+void BleUartFleet::stopDiscovery() {
+    if (!adapterProxy_) return;
+    cache_->removeDeviceListener(discoveryListener_);
+    discoveryListener_ = 0;
+    try {
+        adapterProxy_->callMethod("StopDiscovery").onInterface(AdapterInterface);
+    } catch (const Error&) { /* ignore */ }
+    adapterProxy_.reset();
+}
+
+bool BleUartFleet::isDiscovering() const {
+    return adapterProxy_ != nullptr;
+}
+
+bool BleUartFleet::send(const std::string& alias, const std::string& text) {
+    BleUartClient* client = find(alias);
+    return client != nullptr && client->send(text);
+}
+
+size_t BleUartFleet::broadcast(const std::string& text) {
+    // Queued on every robot first, so that the writes to different robots overlap
+    std::vector<std::future<bool>> pending;
+    pending.reserve(clients_.size());
+    for (const auto& [alias, client] : clients_) {
+        if (client->getState() == BleUartClient::State::Connected) pending.push_back(client->sendAsync(text));
+    }
+    return countSent(pending);
+}
+
+size_t BleUartFleet::multicast(const std::vector<std::string>& aliases, const std::string& text) {
+    std::vector<std::future<bool>> pending;
+    pending.reserve(aliases.size());
+    for (const auto& alias : aliases) {
+        if (BleUartClient* client = find(alias)) pending.push_back(client->sendAsync(text));
+    }
+    return countSent(pending);
+}
+
+size_t BleUartFleet::countSent(std::vector<std::future<bool>>& pending) {
+    size_t sent = 0;
+    for (auto& result : pending) {
+        if (result.get()) ++sent;
+    }
+    return sent;
+}
+
+void BleUartFleet::setGroup(const std::string& group, std::vector<std::string> aliases) {
+    groups_[group] = std::move(aliases);
+}
+
+size_t BleUartFleet::sendToGroup(const std::string& group, const std::string& text) {
+    const auto it = groups_.find(group);
+    return it != groups_.end() ? multicast(it->second, text) : 0;
+}
+
+void BleUartFleet::processCallbacks() {
+    events_->process();
+}
+
+int BleUartFleet::getCallbackFd() const {
+    return events_->fd;
+}
+
+BleUartClient::EventQueueStats BleUartFleet::getEventQueueStats() const {
+    return {
+        events_->queue.capacity(), events_->queue.highWaterMark(), events_->droppedLines, events_->droppedControlEvents
+    };
+}
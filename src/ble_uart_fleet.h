@@ -0,0 +1,95 @@
+#ifndef BLE_UART_FLEET_H
+#define BLE_UART_FLEET_H
+
+#include "ble_uart_client.h"
+#include "gatt_cache.h"
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace mimi {
+
+// Many robots over one system bus connection, one D-Bus dispatch thread and one event queue.
+// Callbacks receive the alias of the robot the event belongs to.
+class BleUartFleet {
+public:
+    static constexpr size_t DefaultEventQueueCapacity = 4 * BleUartClient::DefaultEventQueueCapacity;
+
+    explicit BleUartFleet(size_t eventQueueCapacity = DefaultEventQueueCapacity);
+    // Talks to org.bluez on another bus, e.g. a FakeBluezService on the session bus. Runs the connection's event loop.
+    explicit BleUartFleet(std::unique_ptr<sdbus::IConnection> connection,
+                          size_t eventQueueCapacity = DefaultEventQueueCapacity);
+    ~BleUartFleet();
+    BleUartFleet(const BleUartFleet&) = delete;
+    BleUartFleet& operator=(const BleUartFleet&) = delete;
+
+    void setCallbacks(
+        BleUartClient::ConnectCallback connectCallback,
+        BleUartClient::DisconnectCallback disconnectCallback,
+        BleUartClient::StateChangedCallback stateChangedCallback,
+        BleUartClient::ErrorCallback errorCallback,
+        BleUartClient::ReceiveCallback receiveCallback);
+    void setReceiveViewCallback(BleUartClient::ReceiveViewCallback receiveViewCallback);
+    void setReceiveBinaryCallback(BleUartClient::ReceiveBinaryCallback receiveBinaryCallback);
+
+    std::vector<PairedDevice> listPairedDevices();
+    // Persists the alias and characteristic cache shared by all robots between runs
+    void setCacheFile(const std::string& filePath);
+
+    BleUartClient& add(const std::string& alias);
+    [[nodiscard]] BleUartClient* find(const std::string& alias) const;
+    [[nodiscard]] std::vector<std::string> getAliases() const;
+
+    // Connects all added robots concurrently, each going through lookup, connect and discovery on its own,
+    // and returns the number of successful connections. Every robot's stages are in its getConnectTimings().
+    size_t connectAll(bool keepConnection);
+    void disconnectAll();
+
+    // Makes the adapter look for robots advertising the UART service, so that robots BlueZ does not know yet
+    // or has not seen since they went out of range are found. A robot waiting to be reconnected is tried
+    // as soon as it is seen, instead of after its reconnect delay. Discovery slows connections down and costs
+    // power, so stop it once every robot is connected. Throws sdbus::Error if BlueZ refuses.
+    void startDiscovery();
+    // Never throws
+    void stopDiscovery();
+    [[nodiscard]] bool isDiscovering() const;
+
+    [[nodiscard]] bool send(const std::string& alias, const std::string& text);
+    // Return the number of robots the text was sent to
+    size_t broadcast(const std::string& text);
+    size_t multicast(const std::vector<std::string>& aliases, const std::string& text);
+    void setGroup(const std::string& group, std::vector<std::string> aliases);
+    size_t sendToGroup(const std::string& group, const std::string& text);
+
+    void processCallbacks();
+    // Becomes readable whenever there are callbacks waiting for processCallbacks()
+    [[nodiscard]] int getCallbackFd() const;
+    [[nodiscard]] BleUartClient::EventQueueStats getEventQueueStats() const;
+
+private:
+    std::unique_ptr<sdbus::IConnection> connection_;
+    std::shared_ptr<GattCache> cache_;
+    std::shared_ptr<BleUartClient::EventChannel> events_;
+    // Only taken by add() and the discovery listener, the one reader on another thread
+    mutable std::mutex clientsMutex_;
+    std::map<std::string, std::unique_ptr<BleUartClient>> clients_;
+    std::map<std::string, std::vector<std::string>> groups_;
+    std::unique_ptr<sdbus::IProxy> adapterProxy_;
+    size_t discoveryListener_ = 0;
+
+    BleUartClient::ConnectCallback connectCallback_ = nullptr;
+    BleUartClient::DisconnectCallback disconnectCallback_ = nullptr;
+    BleUartClient::StateChangedCallback stateChangedCallback_ = nullptr;
+    BleUartClient::ErrorCallback errorCallback_ = nullptr;
+    BleUartClient::ReceiveCallback receiveCallback_ = nullptr;
+    BleUartClient::ReceiveViewCallback receiveViewCallback_ = nullptr;
+    BleUartClient::ReceiveBinaryCallback receiveBinaryCallback_ = nullptr;
+    static size_t countSent(std::vector<std::future<bool>>& pending);
+    void applyCallbacks(BleUartClient& client) const;
+};
+
+} // namespace mimi
+
+#endif //BLE_UART_FLEET_H
@@ -0,0 +1,361 @@
+// ReSharper disable CppTooWideScopeInitStatement
+#include "bluez_transport.h"
+#include <algorithm>
+#include <cerrno>
+#include <map>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sdbus-c++/sdbus-c++.h>
+
+using namespace sdbus;
+using namespace mimi;
+
+BluezTransport::BluezTransport() = default;
+
+BluezTransport::BluezTransport(IConnection& connection, std::shared_ptr<GattCache> cache) :
+    connection_(&connection),
+    cache_(std::move(cache)) {
+}
+
+BluezTransport::~BluezTransport() {
+    stopWatching();
+    releaseAcquiredFds();
+    // Stop signal delivery before the proxies and the cache it calls into go away
+    if (ownedConnection_) ownedConnection_->leaveEventLoop();
+    rxProxy_.reset();
+    txProxy_.reset();
+    deviceProxy_.reset();
+    cache_.reset();
+}
+
+IConnection& BluezTransport::connection() {
+    if (connection_ == nullptr) {
+        ownedConnection_ = createSystemBusConnection();
+        ownedConnection_->enterEventLoopAsync();
+        connection_ = ownedConnection_.get();
+    }
+    return *connection_;
+}
+
+void BluezTransport::setIoMode(const IoMode& ioMode) {
+    ioMode_ = ioMode;
+}
+
+BluezTransport::IoMode BluezTransport::getIoMode() const {
+    return ioMode_;
+}
+
+void BluezTransport::setCacheFile(const std::string& filePath) {
+    cacheFile_ = filePath;
+    if (cache_) cache_->setFile(filePath);
+}
+
+GattCache& BluezTransport::getCache() {
+    if (!cache_) {
+        cache_ = std::make_shared<GattCache>(connection());
+        if (!cacheFile_.empty()) cache_->setFile(cacheFile_);
+    }
+    return *cache_;
+}
+
+std::vector<PairedDevice> BluezTransport::listPairedDevices() {
+    return getCache().getPairedDevices();
+}
+
+bool BluezTransport::findPairedDevice(const std::string& alias, PairedDevice& device) {
+    return getCache().findDevice(alias, device);
+}
+
+std::vector<PairedDevice> BluezTransport::listPairedDevices(IConnection& connection) {
+    std::vector<PairedDevice> devices;
+
+    const auto proxy = createProxy(connection, ServiceName, "/");
+    proxy->finishRegistration();
+
+    using VariantMap = std::map<std::string, Variant>;
+    using InterfaceMap = std::map<std::string, VariantMap>;
+    using ObjectMap = std::map<ObjectPath, InterfaceMap>;
+
+    ObjectMap managedObjects;
+    const auto method = proxy->createMethodCall("org.freedesktop.DBus.ObjectManager", "GetManagedObjects");
+    auto reply = proxy->callMethod(method);
+    reply >> managedObjects;
+
+    for (const auto& [objectPath, interfaces] : managedObjects) {
+        auto devIt = interfaces.find("org.bluez.Device1");
+        if (devIt != interfaces.end()) {
+            const auto& props = devIt->second;
+
+            const auto pairedIt = props.find("Paired");
+            const auto aliasIt  = props.find("Alias");
+            const auto addrIt   = props.find("Address");
+
+            if (pairedIt != props.end() && pairedIt->second.get<bool>()) {
+                const std::string alias   = aliasIt != props.end() ? aliasIt->second.get<std::string>() : "(unknown)";
+                const std::string address = addrIt != props.end() ? addrIt->second.get<std::string>() : "(no address)";
+                devices.push_back({ alias, address, objectPath });
+            }
+        }
+    }
+
+    return devices;
+}
+
+void BluezTransport::connectDevice(const PairedDevice& device) {
+    releaseAcquiredFds();
+    devicePath_ = device.path;
+    txCharPath_.clear();
+    rxCharPath_.clear();
+
+    deviceProxy_ = createProxy(connection(), ServiceName, device.path);
+    deviceProxy_->finishRegistration();
+    try {
+        deviceProxy_->callMethod("Connect").onInterface("org.bluez.Device1");
+    } catch (const Error& e) {
+        // The cached path is stale (the device was removed and paired again), so look it up next time
+        if (e.getName() == UnknownObjectError) getCache().forgetDevice(device.path);
+        throw;
+    }
+}
+
+bool BluezTransport::discoverCharacteristics() {
+    if (!getCache().findCharacteristics(devicePath_, txCharPath_, rxCharPath_)) return false;
+
+    txProxy_ = createProxy(connection(), ServiceName, txCharPath_);
+    txProxy_->finishRegistration();
+
+    if (ioMode_ != IoMode::Socket || !acquireWriteFd()) {
+        txChunkSize_ = chunkSizeForMtu(readMtu());
+    }
+    return true;
+}
+
+void BluezTransport::startNotifications() {
+    rxProxy_ = createProxy(connection(), ServiceName, rxCharPath_);
+    if (ioMode_ == IoMode::Socket && acquireNotifyFd()) {
+        rxProxy_->finishRegistration();
+        return;
+    }
+
+    rxProxy_->uponSignal("PropertiesChanged")
+        .onInterface("org.freedesktop.DBus.Properties")
+        .call([this](const std::string& interface,
+                     const std::map<std::string, Variant>& changed,
+                     const std::vector<std::string>&) {
+            if (interface == "org.bluez.GattCharacteristic1") {
+                const auto value = changed.find("Value");
+                if (value != changed.end() && handlers_.received) {
+                    auto vec = value->second.get<std::vector<uint8_t>>();
+                    handlers_.received(reinterpret_cast<char*>(vec.data()), vec.size());
+                }
+            }
+        });
+    rxProxy_->finishRegistration();
+
+    try {
+        rxProxy_->callMethod("StartNotify").onInterface("org.bluez.GattCharacteristic1");
+    } catch (const Error& e) {
+        // The device's GATT database changed since the paths were cached
+        if (e.getName() == UnknownObjectError) getCache().forgetCharacteristics(devicePath_);
+        throw;
+    }
+}
+
+void BluezTransport::watchConnection() {
+    // The listener outlives a lost link, because it also tells when the robot is back
+    if (deviceListener_ != 0 && watchedPath_ == devicePath_) return;
+    stopWatching();
+    watchedPath_ = devicePath_;
+    deviceListener_ = getCache().addDeviceListener(devicePath_, [this](const PairedDevice&,
+                                                                       const std::map<std::string, Variant>& properties,
+                                                                       const bool appeared) {
+        if (appeared) {
+            // Removed and exported again, e.g. after the robot was re-discovered
+            if (handlers_.linkAvailable) handlers_.linkAvailable();
+            return;
+        }
+        const auto connected = properties.find("Connected");
+        if (connected != properties.end()) {
+            const auto& handler = connected->second.get<bool>() ? handlers_.linkAvailable : handlers_.linkLost;
+            if (handler) handler();
+            return;
+        }
+        // ServicesResolved follows a reconnect made by BlueZ itself; RSSI changes while discovery sees adverts
+        const auto resolved = properties.find("ServicesResolved");
+        const bool available = (resolved != properties.end() && resolved->second.get<bool>()) || properties.count("RSSI") != 0;
+        if (available && handlers_.linkAvailable) handlers_.linkAvailable();
+    });
+}
+
+void BluezTransport::stopWatching() {
+    if (deviceListener_ == 0) return;
+    cache_->removeDeviceListener(deviceListener_);
+    deviceListener_ = 0;
+    watchedPath_.clear();
+}
+
+void BluezTransport::write(const char* data, const size_t size, const bool withResponse) {
+    if (txFd_.isValid()) {
+        // Every datagram written to the acquired socket becomes one write-without-response
+        sendToFd(data, size);
+        return;
+    }
+
+    std::vector<uint8_t> chunk(data, data + size);
+    if (withResponse) {
+        txProxy_->callMethod("WriteValue")
+            .onInterface("org.bluez.GattCharacteristic1")
+            .withArguments(chunk, std::map<std::string, Variant>{});
+    } else {
+        // Write without response: the reply only tells us that BlueZ has queued the chunk
+        txProxy_->callMethodAsync("WriteValue")
+            .onInterface("org.bluez.GattCharacteristic1")
+            .withArguments(chunk, std::map<std::string, Variant>{{"type", Variant(std::string("command"))}})
+            .uponReplyInvoke([this](const Error* error) {
+                if (error != nullptr && handlers_.writeFailed) {
+                    handlers_.writeFailed(error->getMessage(), error->getName());
+                }
+            });
+    }
+}
+
+void BluezTransport::disconnectDevice() {
+    stopWatching();
+    if (rxProxy_) {
+        if (!rxFd_.isValid()) {
+            try {
+                rxProxy_->callMethod("StopNotify").onInterface("org.bluez.GattCharacteristic1");
+            } catch (...) { /* ignore */ }
+        }
+        rxProxy_.reset();
+    }
+
+    releaseAcquiredFds();
+    txProxy_.reset();
+
+    if (deviceProxy_) {
+        try {
+            deviceProxy_->callMethod("Disconnect").onInterface("org.bluez.Device1");
+        } catch (...) { }
+        deviceProxy_.reset();
+    }
+}
+
+bool BluezTransport::isReady() const {
+    return txProxy_ != nullptr;
+}
+
+size_t BluezTransport::getMaxWriteSize() const {
+    return txChunkSize_;
+}
+
+bool BluezTransport::supportsWriteWithResponse() const {
+    return !txFd_.isValid();
+}
+
+bool BluezTransport::acquireWriteFd() {
+    try {
+        UnixFd fd;
+        uint16_t mtu = 0;
+        txProxy_->callMethod("AcquireWrite")
+            .onInterface("org.bluez.GattCharacteristic1")
+            .withArguments(std::map<std::string, Variant>{})
+            .storeResultsTo(fd, mtu);
+        txFd_ = std::move(fd);
+        txChunkSize_ = chunkSizeForMtu(mtu);
+        return true;
+    } catch (const Error&) {
+        // BlueZ is too old or the characteristic does not support it: stay on WriteValue
+        return false;
+    }
+}
+
+uint16_t BluezTransport::readMtu() const {
+    try {
+        return txProxy_->getProperty("MTU").onInterface("org.bluez.GattCharacteristic1").get<uint16_t>();
+    } catch (const Error&) {
+        // The property appeared in BlueZ 5.62
+        return 0;
+    }
+}
+
+size_t BluezTransport::chunkSizeForMtu(const uint16_t mtu) {
+    return mtu > AttHeaderSize ? std::max<size_t>(mtu - AttHeaderSize, DefaultChunkSize) : DefaultChunkSize;
+}
+
+bool BluezTransport::acquireNotifyFd() {
+    try {
+        UnixFd fd;
+        uint16_t mtu = 0;
+        rxProxy_->callMethod("AcquireNotify")
+            .onInterface("org.bluez.GattCharacteristic1")
+            .withArguments(std::map<std::string, Variant>{})
+            .storeResultsTo(fd, mtu);
+        rxFd_ = std::move(fd);
+        rxMtu_ = mtu;
+    } catch (const Error&) {
+        // Fall back to StartNotify and PropertiesChanged signals
+        return false;
+    }
+
+    rxStopFd_ = eventfd(0, EFD_CLOEXEC);
+    rxFdThread_ = std::thread([this] {
+        std::vector<char> buffer(std::max<size_t>(rxMtu_, 512));
+        pollfd fds[2] = {
+            { rxFd_.get(), POLLIN, 0 },
+            { rxStopFd_, POLLIN, 0 },
+        };
+        while (true) {
+            if (poll(fds, 2, -1) < 0) {
+                if (errno == EINTR) continue;
+                return;
+            }
+            if (fds[1].revents != 0) return;
+            if (fds[0].revents & POLLIN) {
+                const ssize_t n = read(rxFd_.get(), buffer.data(), buffer.size());
+                if (n > 0) {
+                    if (handlers_.received) handlers_.received(buffer.data(), static_cast<size_t>(n));
+                    continue;
+                }
+                if (n < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+            }
+            // Socket closed by BlueZ: the link is gone, the connection monitor reports it
+            if (fds[0].revents & (POLLHUP | POLLERR | POLLIN)) return;
+        }
+    });
+    return true;
+}
+
+void BluezTransport::releaseAcquiredFds() {
+    if (rxFdThread_.joinable()) {
+        constexpr uint64_t stop = 1;
+        [[maybe_unused]] const auto written = ::write(rxStopFd_, &stop, sizeof(stop));
+        rxFdThread_.join();
+    }
+    if (rxStopFd_ >= 0) {
+        close(rxStopFd_);
+        rxStopFd_ = -1;
+    }
+    rxFd_.reset();
+    txFd_.reset();
+    txChunkSize_ = DefaultChunkSize;
+}
+
+void BluezTransport::sendToFd(const char* data, const size_t size) const {
+    while (true) {
+        const ssize_t n = ::send(txFd_.get(), data, size, MSG_NOSIGNAL);
+        if (n == static_cast<ssize_t>(size)) return;
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // The caller holds the connection lock, so a stalled socket must not hold it for long.
+            // A busy error lets the writer back off and retry without it, as for D-Bus writes.
+            pollfd pfd = { txFd_.get(), POLLOUT, 0 };
+            const int ready = poll(&pfd, 1, static_cast<int>(TxSocketWait.count()));
+            if (ready == 0) throw sdbus::Error("org.bluez.Error.InProgress", "The acquired socket has no room for the write");
+            continue;
+        }
+        throw createError(n < 0 ? errno : EIO, "Write to the acquired socket failed");
+    }
+}
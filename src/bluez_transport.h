@@ -0,0 +1,96 @@
+#ifndef BLUEZ_TRANSPORT_H
+#define BLUEZ_TRANSPORT_H
+
+#include "gatt_cache.h"
+#include "gatt_transport.h"
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <sdbus-c++/IConnection.h>
+#include <sdbus-c++/IProxy.h>
+#include <sdbus-c++/Types.h>
+
+namespace mimi {
+
+class BluezTransport : public GattTransport {
+public:
+    enum class IoMode {
+        DBus,
+        Socket,
+    };
+
+    static constexpr const char* ServiceName = "org.bluez";
+    static constexpr const char* UartServiceUuid = "6e400001-b5a3-f393-e0a9-e50e24dcca9e";
+    static constexpr const char* TxCharacteristicUuid = "6e400002-b5a3-f393-e0a9-e50e24dcca9e";
+    static constexpr const char* RxCharacteristicUuid = "6e400003-b5a3-f393-e0a9-e50e24dcca9e";
+
+    // Opens its own system bus connection on first use
+    BluezTransport();
+    // Uses a connection whose event loop is run by the caller. Transports on the same connection
+    // can share one cache; without one the transport creates its own.
+    explicit BluezTransport(sdbus::IConnection& connection, std::shared_ptr<GattCache> cache = nullptr);
+    ~BluezTransport() override;
+
+    // Always scans BlueZ's whole object tree
+    static std::vector<PairedDevice> listPairedDevices(sdbus::IConnection& connection);
+
+    void setIoMode(const IoMode& ioMode);
+    [[nodiscard]] IoMode getIoMode() const;
+    // Persists the alias and characteristic cache between runs; call before the first connect
+    void setCacheFile(const std::string& filePath);
+    GattCache& getCache();
+
+    std::vector<PairedDevice> listPairedDevices() override;
+    bool findPairedDevice(const std::string& alias, PairedDevice& device) override;
+    void connectDevice(const PairedDevice& device) override;
+    bool discoverCharacteristics() override;
+    void startNotifications() override;
+    void watchConnection() override;
+    void write(const char* data, size_t size, bool withResponse) override;
+    void disconnectDevice() override;
+
+    [[nodiscard]] bool isReady() const override;
+    [[nodiscard]] size_t getMaxWriteSize() const override;
+    [[nodiscard]] bool supportsWriteWithResponse() const override;
+
+private:
+    std::unique_ptr<sdbus::IConnection> ownedConnection_;
+    sdbus::IConnection* connection_ = nullptr;
+    std::shared_ptr<GattCache> cache_;
+    std::string cacheFile_;
+    std::unique_ptr<sdbus::IProxy> deviceProxy_;
+    std::unique_ptr<sdbus::IProxy> rxProxy_;
+    std::unique_ptr<sdbus::IProxy> txProxy_;
+    std::string devicePath_;
+    size_t deviceListener_ = 0;
+    std::string watchedPath_;
+    std::string txCharPath_;
+    std::string rxCharPath_;
+
+    static constexpr const char* UnknownObjectError = "org.freedesktop.DBus.Error.UnknownObject";
+    static constexpr size_t DefaultChunkSize = 19;
+    static constexpr size_t AttHeaderSize = 3;
+    // How long a write waits for room in the acquired socket before it is reported as busy
+    static constexpr std::chrono::milliseconds TxSocketWait { 100 };
+    std::atomic<IoMode> ioMode_ = IoMode::DBus;
+    std::atomic<size_t> txChunkSize_ = DefaultChunkSize;
+    sdbus::UnixFd txFd_;
+    sdbus::UnixFd rxFd_;
+    uint16_t rxMtu_ = 0;
+    int rxStopFd_ = -1;
+    std::thread rxFdThread_;
+    sdbus::IConnection& connection();
+    void stopWatching();
+    bool acquireWriteFd();
+    // Zero if BlueZ does not tell
+    [[nodiscard]] uint16_t readMtu() const;
+    static size_t chunkSizeForMtu(uint16_t mtu);
+    bool acquireNotifyFd();
+    void releaseAcquiredFds();
+    void sendToFd(const char* data, size_t size) const;
+};
+
+} // namespace mimi
+
+#endif //BLUEZ_TRANSPORT_H
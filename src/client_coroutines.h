@@ -0,0 +1,277 @@
+#ifndef CLIENT_COROUTINES_H
+#define CLIENT_COROUTINES_H
+
+// Only available to code built as C++20; the library itself stays C++17
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+
+#include "ble_uart_client.h"
+#include <coroutine>
+#include <deque>
+#include <optional>
+#include <type_traits>
+
+namespace mimi {
+
+// Lets control logic be written as sequential coroutines instead of callbacks:
+//
+//   CoroutineClient::Task drive(CoroutineClient& robot) {
+//       if (!co_await robot.connect("Mimi")) co_return;
+//       co_await robot.send("M 100 100\n");
+//       while (auto line = co_await robot.nextLine()) { ... }
+//   }
+//   CoroutineClient robot(client);
+//   robot.spawn(drive(robot));
+//
+// Coroutines run on the facade's own thread. Sends and requests complete through the client's completion
+// callbacks, which only post the coroutine's resumption, so a coroutine waiting for a reply never holds up
+// the others. connect() and disconnect() block by nature and run on a second thread of the facade.
+// With BackpressurePolicy::Block a send to a full queue waits for room; choose Fail to never wait.
+// The facade takes over the client's callbacks and switches it to inline delivery.
+// Pass coroutine arguments by value: a lambda's captures do not live as long as its coroutine. GCC 12 destroys
+// a capturing lambda written into a co_await expression twice, so pass matchers as named variables.
+class CoroutineClient {
+public:
+    // A coroutine started with spawn(); nobody waits for it to finish
+    struct Task {
+        struct promise_type {
+            Task get_return_object() { return Task { std::coroutine_handle<promise_type>::from_promise(*this) }; }
+            std::suspend_always initial_suspend() noexcept { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void return_void() {}
+            void unhandled_exception() { std::terminate(); }
+        };
+        std::coroutine_handle<promise_type> handle;
+    };
+
+    // Lines received while no coroutine waits in nextLine() are kept up to this many, the oldest dropped first
+    static constexpr size_t DefaultMaxBufferedLines = 1024;
+
+    explicit CoroutineClient(BleUartClient& client, const size_t maxBufferedLines = DefaultMaxBufferedLines) :
+        client_(client),
+        core_(std::make_shared<Core>(maxBufferedLines)) {
+        const std::shared_ptr<Core> core = core_;
+        client_.setCallbackDelivery(BleUartClient::CallbackDelivery::Inline);
+        client_.setCallbacks(
+            [core](const std::string&, const std::string&, bool) { core->openLines(); },
+            [core](const std::string&, const std::string&, const bool isFailure) {
+                // A lost link is reconnected and lines go on; only disconnect() ends them
+                if (!isFailure) core->closeLines();
+            },
+            nullptr,
+            nullptr,
+            nullptr);
+        client_.setReceiveViewCallback([core](const std::string&, const std::string_view line) { core->receive(line); });
+        core_->coroutines.start();
+        core_->calls.start();
+    }
+
+    // Lets the coroutines waiting for lines finish, runs everything already started and stops the threads
+    ~CoroutineClient() {
+        core_->closeLines();
+        // Connects still running resume their coroutines first
+        core_->calls.stop();
+        core_->coroutines.stop();
+    }
+
+    CoroutineClient(const CoroutineClient&) = delete;
+    CoroutineClient& operator=(const CoroutineClient&) = delete;
+
+    void spawn(Task task) {
+        core_->post([handle = task.handle] { handle.resume(); });
+    }
+
+    auto connect(std::string alias, const bool keepConnection = true) {
+        return complete<bool>([this, alias = std::move(alias), keepConnection](auto done) mutable {
+            core_->calls.post([this, alias = std::move(alias), keepConnection, done = std::move(done)] {
+                done(client_.connect(alias, keepConnection));
+            });
+        });
+    }
+
+    auto disconnect() {
+        return complete<bool>([this](auto done) {
+            core_->calls.post([this, done = std::move(done)] { done(client_.disconnect()); });
+        });
+    }
+
+    // Completes once the text has been written
+    auto send(std::string text) {
+        return complete<bool>([this, text = std::move(text)](auto done) mutable {
+            client_.sendAsync(std::move(text), std::move(done));
+        });
+    }
+
+    auto request(std::string command, BleUartClient::ReplyMatcher matcher = nullptr,
+                 const std::chrono::milliseconds timeout = BleUartClient::DefaultRequestTimeout) {
+        return complete<BleUartClient::Reply>(
+            [this, command = std::move(command), matcher = std::move(matcher), timeout](auto done) mutable {
+                client_.requestAsync(std::move(command), std::move(done), std::move(matcher), timeout);
+            });
+    }
+
+    // The next received line; nothing once the client has been disconnected and the buffered lines are taken.
+    // Only one coroutine may wait for lines at a time.
+    auto nextLine() {
+        return LineAwaiter { *core_, std::nullopt };
+    }
+
+private:
+    // A thread running posted tasks in order
+    struct Worker {
+        std::mutex mutex;
+        std::condition_variable wakeup;
+        std::deque<std::function<void()>> tasks;
+        bool stopping = false;
+        bool stopped = false;
+        std::thread thread;
+
+        void start() {
+            thread = std::thread([this] { run(); });
+        }
+
+        // Runs the tasks posted so far; later ones are dropped
+        void stop() {
+            {
+                std::lock_guard lock(mutex);
+                stopping = true;
+            }
+            wakeup.notify_one();
+            thread.join();
+            std::lock_guard lock(mutex);
+            stopped = true;
+            tasks.clear();
+        }
+
+        void post(std::function<void()> task) {
+            {
+                std::lock_guard lock(mutex);
+                if (stopped) return;
+                tasks.push_back(std::move(task));
+            }
+            wakeup.notify_one();
+        }
+
+        void run() {
+            std::unique_lock lock(mutex);
+            while (true) {
+                wakeup.wait(lock, [this] { return stopping || !tasks.empty(); });
+                if (tasks.empty()) return;
+                const auto task = std::move(tasks.front());
+                tasks.pop_front();
+                lock.unlock();
+                task();
+                lock.lock();
+            }
+        }
+    };
+
+    struct Core {
+        explicit Core(const size_t maxBufferedLines) : maxBufferedLines(maxBufferedLines) {}
+
+        // Runs the coroutines
+        Worker coroutines;
+        // Runs the client's blocking calls
+        Worker calls;
+
+        const size_t maxBufferedLines;
+        std::mutex lineMutex;
+        std::deque<std::string> lines;
+        bool linesClosed = false;
+        std::coroutine_handle<> lineWaiter;
+        std::optional<std::string>* waitingLine = nullptr;
+
+        void post(std::function<void()> task) {
+            coroutines.post(std::move(task));
+        }
+
+        // Runs on the thread that received the line, so only hands it over
+        void receive(const std::string_view line) {
+            std::lock_guard lock(lineMutex);
+            if (lineWaiter) {
+                waitingLine->emplace(line);
+                resumeWaiter();
+                return;
+            }
+            if (lines.size() == maxBufferedLines) lines.pop_front();
+            lines.emplace_back(line);
+        }
+
+        void openLines() {
+            std::lock_guard lock(lineMutex);
+            linesClosed = false;
+        }
+
+        void closeLines() {
+            std::lock_guard lock(lineMutex);
+            linesClosed = true;
+            if (lineWaiter) resumeWaiter();
+        }
+
+        // Either fills the line or tells that there will be none; false if the caller has to wait
+        bool takeLine(std::optional<std::string>& line) {
+            if (!lines.empty()) {
+                line.emplace(std::move(lines.front()));
+                lines.pop_front();
+                return true;
+            }
+            return linesClosed;
+        }
+
+        void resumeWaiter() {
+            post([handle = lineWaiter] { handle.resume(); });
+            lineWaiter = nullptr;
+            waitingLine = nullptr;
+        }
+    };
+
+    // Starts an operation whose completion stores the result and posts the coroutine's resumption
+    template<typename Result, typename Start>
+    struct Completion {
+        std::shared_ptr<Core> core;
+        Start start;
+        std::optional<Result> result;
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> handle) {
+            // The completion may run on any thread, even before start() returns, and after the facade is gone
+            start([this, core = core, handle](const Result& completed) {
+                result.emplace(completed);
+                core->post([handle] { handle.resume(); });
+            });
+        }
+        Result await_resume() { return std::move(*result); }
+    };
+
+    struct LineAwaiter {
+        Core& core;
+        std::optional<std::string> line;
+
+        bool await_ready() {
+            std::lock_guard lock(core.lineMutex);
+            return core.takeLine(line);
+        }
+        // A line that arrived since await_ready() is taken without suspending
+        bool await_suspend(const std::coroutine_handle<> handle) {
+            std::lock_guard lock(core.lineMutex);
+            if (core.takeLine(line)) return false;
+            core.lineWaiter = handle;
+            core.waitingLine = &line;
+            return true;
+        }
+        std::optional<std::string> await_resume() { return std::move(line); }
+    };
+
+    BleUartClient& client_;
+    std::shared_ptr<Core> core_;
+
+    template<typename Result, typename Start>
+    Completion<Result, std::decay_t<Start>> complete(Start&& start) {
+        return { core_, std::forward<Start>(start), std::nullopt };
+    }
+};
+
+} // namespace mimi
+
+#endif
+
+#endif //CLIENT_COROUTINES_H
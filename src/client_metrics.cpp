@@ -0,0 +1,70 @@
+#include "client_metrics.h"
+#include <iomanip>
+#include <utility>
+
+using namespace mimi;
+
+namespace {
+    double toMicroseconds(const std::chrono::nanoseconds duration) {
+        return static_cast<double>(duration.count()) / 1000.0;
+    }
+
+    template<typename Write>
+    void forEachStage(const ClientMetrics& metrics, Write&& write) {
+        write("send_to_write", metrics.sendToWrite);
+        write("write", metrics.write);
+        write("receive_to_line", metrics.receiveToLine);
+        write("line_to_dispatch", metrics.lineToDispatch);
+        write("round_trip", metrics.roundTrip);
+    }
+
+    template<typename Write>
+    void forEachCounter(const ClientMetrics& metrics, Write&& write) {
+        write("bytes_sent", metrics.bytesSent.load());
+        write("writes", metrics.writes.load());
+        write("bytes_received", metrics.bytesReceived.load());
+        write("notifications", metrics.notifications.load());
+        write("lines_received", metrics.linesReceived.load());
+        write("errors", metrics.errors.load());
+        write("reconnects", metrics.reconnects.load());
+        write("busy_retries", metrics.busyRetries.load());
+        write("pace_window", metrics.paceWindow.load());
+    }
+}
+
+void ClientMetrics::writeJson(std::ostream& out) const {
+    const auto flags = out.flags();
+    out << std::fixed << std::setprecision(1) << '{';
+    bool first = true;
+    forEachStage(*this, [&](const char* name, const LatencyHistogram& histogram) {
+        out << (first ? "" : ",") << '"' << name << "\":{\"count\":" << histogram.count()
+            << ",\"p50_us\":" << toMicroseconds(histogram.percentile(50))
+            << ",\"p99_us\":" << toMicroseconds(histogram.percentile(99))
+            << ",\"max_us\":" << toMicroseconds(histogram.max()) << '}';
+        first = false;
+    });
+    forEachCounter(*this, [&](const char* name, const uint64_t value) {
+        out << ",\"" << name << "\":" << value;
+    });
+    out << '}';
+    out.flags(flags);
+}
+
+void ClientMetrics::writeText(std::ostream& out) const {
+    const auto flags = out.flags();
+    out << std::fixed << std::setprecision(1);
+    forEachStage(*this, [&](const char* name, const LatencyHistogram& histogram) {
+        out << std::left << std::setw(18) << name << std::right
+            << " n=" << histogram.count()
+            << " p50=" << toMicroseconds(histogram.percentile(50)) << "us"
+            << " p99=" << toMicroseconds(histogram.percentile(99)) << "us"
+            << " max=" << toMicroseconds(histogram.max()) << "us\n";
+    });
+    bool first = true;
+    forEachCounter(*this, [&](const char* name, const uint64_t value) {
+        out << (first ? "" : " ") << name << '=' << value;
+        first = false;
+    });
+    out << '\n';
+    out.flags(flags);
+}
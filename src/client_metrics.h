@@ -0,0 +1,44 @@
+#ifndef CLIENT_METRICS_H
+#define CLIENT_METRICS_H
+
+#include "latency_histogram.h"
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+
+namespace mimi {
+
+// Timings and counters of one BleUartClient's hot paths, updated without locks
+struct ClientMetrics {
+    // From send()/sendAsync() to the completion of the write that carried the command
+    LatencyHistogram sendToWrite;
+    // One GATT write: until the WriteValue reply, or until BlueZ or the socket took it for write-without-response
+    LatencyHistogram write;
+    // From the arrival of the notification that completed a line to the line being queued as an event
+    LatencyHistogram receiveToLine;
+    // From a queued line to its receive callback being called by processCallbacks()
+    LatencyHistogram lineToDispatch;
+    // From request() to its reply
+    LatencyHistogram roundTrip;
+
+    std::atomic<uint64_t> bytesSent = 0;
+    std::atomic<uint64_t> writes = 0;
+    std::atomic<uint64_t> bytesReceived = 0;
+    std::atomic<uint64_t> notifications = 0;
+    std::atomic<uint64_t> linesReceived = 0;
+    std::atomic<uint64_t> errors = 0;
+    std::atomic<uint64_t> reconnects = 0;
+    // Writes refused by a congested link and sent again
+    std::atomic<uint64_t> busyRetries = 0;
+    // Bytes the write pacer currently lets onto the link per WritePacer::Interval
+    std::atomic<uint64_t> paceWindow = 0;
+
+    // One JSON object without a trailing newline; durations are in microseconds
+    void writeJson(std::ostream& out) const;
+    // One line per stage with its p50/p99/max, then the counters
+    void writeText(std::ostream& out) const;
+};
+
+} // namespace mimi
+
+#endif //CLIENT_METRICS_H
@@ -0,0 +1,114 @@
+#ifndef EVENT_QUEUE_H
+#define EVENT_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+namespace mimi {
+
+// Bounded lock-free queue (D. Vyukov's sequence-per-slot design) whose records are preallocated
+// and written and read in place, so pushing an event never allocates.
+template<typename T>
+class EventQueue {
+public:
+    explicit EventQueue(const size_t capacity) :
+        capacity_(roundUpToPowerOfTwo(capacity)),
+        mask_(capacity_ - 1),
+        slots_(new Slot[capacity_]) {
+        for (size_t i = 0; i < capacity_; ++i) {
+            slots_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    EventQueue(const EventQueue&) = delete;
+    EventQueue& operator=(const EventQueue&) = delete;
+
+    // Claims a slot, lets fill(T&) write the record and publishes it.
+    // Fails if the queue already holds `limit` records or more.
+    template<typename Fill>
+    bool tryPush(Fill&& fill, const size_t limit) {
+        size_t position = enqueuePosition_.load(std::memory_order_relaxed);
+        Slot* slot;
+        while (true) {
+            if (position - dequeuePosition_.load(std::memory_order_acquire) >= limit) return false;
+            slot = &slots_[position & mask_];
+            const size_t sequence = slot->sequence.load(std::memory_order_acquire);
+            const auto difference = static_cast<std::ptrdiff_t>(sequence - position);
+            if (difference == 0) {
+                if (enqueuePosition_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) break;
+            } else if (difference < 0) {
+                return false;
+            } else {
+                position = enqueuePosition_.load(std::memory_order_relaxed);
+            }
+        }
+
+        fill(slot->value);
+        slot->sequence.store(position + 1, std::memory_order_release);
+        updateHighWaterMark(position + 1 - dequeuePosition_.load(std::memory_order_relaxed));
+        return true;
+    }
+
+    // Hands the oldest record to consume(T&) while it is still in its slot.
+    // The slot is reused only after consume returns.
+    template<typename Consume>
+    bool tryPop(Consume&& consume) {
+        size_t position = dequeuePosition_.load(std::memory_order_relaxed);
+        Slot* slot;
+        while (true) {
+            slot = &slots_[position & mask_];
+            const size_t sequence = slot->sequence.load(std::memory_order_acquire);
+            const auto difference = static_cast<std::ptrdiff_t>(sequence - (position + 1));
+            if (difference == 0) {
+                if (dequeuePosition_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) break;
+            } else if (difference < 0) {
+                return false;
+            } else {
+                position = dequeuePosition_.load(std::memory_order_relaxed);
+            }
+        }
+
+        struct Release {
+            Slot* slot;
+            size_t sequence;
+            ~Release() { slot->sequence.store(sequence, std::memory_order_release); }
+        } release { slot, position + capacity_ };
+        consume(slot->value);
+        return true;
+    }
+
+    [[nodiscard]] size_t capacity() const { return capacity_; }
+    [[nodiscard]] size_t size() const {
+        return enqueuePosition_.load(std::memory_order_relaxed) - dequeuePosition_.load(std::memory_order_relaxed);
+    }
+    [[nodiscard]] size_t highWaterMark() const { return highWaterMark_.load(std::memory_order_relaxed); }
+
+private:
+    struct Slot {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    const size_t capacity_;
+    const size_t mask_;
+    std::unique_ptr<Slot[]> slots_;
+    alignas(64) std::atomic<size_t> enqueuePosition_ = 0;
+    alignas(64) std::atomic<size_t> dequeuePosition_ = 0;
+    alignas(64) std::atomic<size_t> highWaterMark_ = 0;
+
+    void updateHighWaterMark(const size_t size) {
+        size_t current = highWaterMark_.load(std::memory_order_relaxed);
+        while (size > current && !highWaterMark_.compare_exchange_weak(current, size, std::memory_order_relaxed)) {}
+    }
+
+    static size_t roundUpToPowerOfTwo(const size_t value) {
+        size_t result = 2;
+        while (result < value) result <<= 1;
+        return result;
+    }
+};
+
+} // namespace mimi
+
+#endif //EVENT_QUEUE_H
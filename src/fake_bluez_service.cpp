@@ -0,0 +1,236 @@
+#include "fake_bluez_service.h"
+#include "bluez_transport.h"
+#include <algorithm>
+#include <sdbus-c++/sdbus-c++.h>
+
+using namespace sdbus;
+using namespace mimi;
+
+namespace {
+    constexpr const char* AdapterInterface = "org.bluez.Adapter1";
+    constexpr const char* DeviceInterface = "org.bluez.Device1";
+    constexpr const char* ServiceInterface = "org.bluez.GattService1";
+    constexpr const char* CharacteristicInterface = "org.bluez.GattCharacteristic1";
+}
+
+FakeBluezService::FakeBluezService(IConnection& connection, const LinkOptions& options) :
+    connection_(connection),
+    peer_([](FakeBluezService& service, const std::string& alias, const std::string_view written) {
+        service.notify(alias, written);
+    }),
+    link_(options) {
+    connection_.requestName(BluezTransport::ServiceName);
+    connection_.addObjectManager("/");
+    registerAdapter();
+}
+
+FakeBluezService::~FakeBluezService() {
+    connection_.releaseName(BluezTransport::ServiceName);
+}
+
+PairedDevice FakeBluezService::addDevice(const std::string& alias, const std::string& address, const bool paired) {
+    auto device = std::make_unique<Device>();
+    std::string pathAddress = address;
+    std::replace(pathAddress.begin(), pathAddress.end(), ':', '_');
+    device->info = { alias, address, "/org/bluez/hci0/dev_" + pathAddress };
+    device->paired = paired;
+
+    const PairedDevice info = device->info;
+    std::lock_guard lock(mutex_);
+    if (paired || discovering_) registerDevice(*device);
+    devices_[alias] = std::move(device);
+    return info;
+}
+
+void FakeBluezService::removeDevice(const std::string& alias) {
+    std::unique_ptr<Device> device;
+    {
+        std::lock_guard lock(mutex_);
+        const auto it = devices_.find(alias);
+        if (it == devices_.end()) return;
+        device = std::move(it->second);
+        devices_.erase(it);
+    }
+    if (device->exported) {
+        for (const auto& object : { device->rxObject.get(), device->txObject.get(), device->serviceObject.get(), device->deviceObject.get() }) {
+            object->emitInterfacesRemovedSignal();
+        }
+    }
+    link_.flush();
+}
+
+void FakeBluezService::setPeer(Peer peer) {
+    std::lock_guard lock(peerMutex_);
+    peer_ = std::move(peer);
+}
+
+bool FakeBluezService::notify(const std::string& alias, const std::string_view data) {
+    Device* device = findDevice(alias);
+    if (device == nullptr) return false;
+
+    const size_t chunkSize = link_.getMaxPayloadSize();
+    bool delivered = true;
+    for (size_t offset = 0; offset < data.size(); offset += chunkSize) {
+        if (!device->connected || !device->notifying) return false;
+        const auto chunk = data.substr(offset, chunkSize);
+        delivered &= link_.deliver([device, value = std::vector<uint8_t>(chunk.begin(), chunk.end())] {
+            if (!device->notifying) return;
+            device->rxObject->emitSignal("PropertiesChanged")
+                .onInterface("org.freedesktop.DBus.Properties")
+                .withArguments(std::string(CharacteristicInterface),
+                               std::map<std::string, Variant>{{"Value", Variant(value)}},
+                               std::vector<std::string>{});
+        });
+    }
+    return delivered;
+}
+
+void FakeBluezService::dropLink(const std::string& alias) {
+    Device* device = findDevice(alias);
+    if (device == nullptr) return;
+    device->inRange = false;
+    link_.schedule(std::chrono::microseconds(0), [this, device] { setConnected(*device, false); });
+}
+
+void FakeBluezService::restoreLink(const std::string& alias) {
+    Device* device = findDevice(alias);
+    if (device == nullptr) return;
+    device->inRange = true;
+    link_.schedule(link_.getOptions().connectLatency, [this, device] {
+        if (device->inRange && !device->connected) setConnected(*device, true);
+    });
+}
+
+void FakeBluezService::flush() {
+    link_.flush();
+}
+
+bool FakeBluezService::isDiscovering() const {
+    return discovering_;
+}
+
+FakeBluezService::Device* FakeBluezService::findDevice(const std::string& alias) {
+    std::lock_guard lock(mutex_);
+    const auto it = devices_.find(alias);
+    return it != devices_.end() ? it->second.get() : nullptr;
+}
+
+void FakeBluezService::setConnected(Device& device, const bool connected) {
+    device.connected = connected;
+    if (!connected) device.notifying = false;
+    device.deviceObject->emitPropertiesChangedSignal(DeviceInterface, { "Connected", "ServicesResolved" });
+}
+
+void FakeBluezService::registerAdapter() {
+    adapterObject_ = createObject(connection_, "/org/bluez/hci0");
+    adapterObject_->registerMethod("SetDiscoveryFilter").onInterface(AdapterInterface).implementedAs(
+        [](const std::map<std::string, Variant>&) {});
+    adapterObject_->registerMethod("StartDiscovery").onInterface(AdapterInterface).implementedAs([this] {
+        if (discovering_.exchange(true)) throw Error("org.bluez.Error.InProgress", "Operation already in progress");
+        // Robots nobody has paired with are seen once their adverts are
+        link_.schedule(link_.getOptions().connectLatency, [this] {
+            std::lock_guard lock(mutex_);
+            for (auto& [alias, device] : devices_) {
+                if (!device->exported) registerDevice(*device);
+            }
+        });
+    });
+    adapterObject_->registerMethod("StopDiscovery").onInterface(AdapterInterface).implementedAs([this] {
+        if (!discovering_.exchange(false)) throw Error("org.bluez.Error.Failed", "No discovery started");
+    });
+    adapterObject_->registerProperty("Discovering").onInterface(AdapterInterface).withGetter([this] { return discovering_.load(); });
+    adapterObject_->finishRegistration();
+}
+
+void FakeBluezService::registerDevice(Device& device) {
+    const std::string& path = device.info.path;
+    const std::string servicePath = path + "/service0010";
+    const std::string txPath = servicePath + "/char0011";
+    const std::string rxPath = servicePath + "/char0013";
+    const auto mtu = static_cast<uint16_t>(link_.getOptions().mtu);
+
+    device.deviceObject = createObject(connection_, path);
+    device.deviceObject->registerMethod("Connect").onInterface(DeviceInterface).implementedAs([this, &device](Result<>&& result) {
+        auto pending = std::make_shared<Result<>>(std::move(result));
+        link_.schedule(link_.getOptions().connectLatency, [this, &device, pending] {
+            if (!device.inRange) {
+                pending->returnError(Error("org.bluez.Error.Failed", "le-connection-abort-by-local"));
+                return;
+            }
+            if (!device.connected) setConnected(device, true);
+            pending->returnResults();
+        });
+    });
+    device.deviceObject->registerMethod("Disconnect").onInterface(DeviceInterface).implementedAs([this, &device] {
+        setConnected(device, false);
+    });
+    device.deviceObject->registerProperty("Alias").onInterface(DeviceInterface).withGetter([&device] { return device.info.alias; });
+    device.deviceObject->registerProperty("Address").onInterface(DeviceInterface).withGetter([&device] { return device.info.address; });
+    device.deviceObject->registerProperty("Paired").onInterface(DeviceInterface).withGetter([&device] { return device.paired; });
+    device.deviceObject->registerProperty("UUIDs").onInterface(DeviceInterface).withGetter([] {
+        return std::vector<std::string>{ BluezTransport::UartServiceUuid };
+    });
+    device.deviceObject->registerProperty("Connected").onInterface(DeviceInterface).withGetter([&device] { return device.connected.load(); });
+    device.deviceObject->registerProperty("ServicesResolved").onInterface(DeviceInterface).withGetter([&device] { return device.connected.load(); });
+    device.deviceObject->finishRegistration();
+
+    device.serviceObject = createObject(connection_, servicePath);
+    device.serviceObject->registerProperty("UUID").onInterface(ServiceInterface).withGetter([] { return std::string(BluezTransport::UartServiceUuid); });
+    device.serviceObject->registerProperty("Device").onInterface(ServiceInterface).withGetter([path] { return ObjectPath(path); });
+    device.serviceObject->registerProperty("Primary").onInterface(ServiceInterface).withGetter([] { return true; });
+    device.serviceObject->finishRegistration();
+
+    device.txObject = createObject(connection_, txPath);
+    device.txObject->registerMethod("WriteValue").onInterface(CharacteristicInterface).implementedAs(
+        [this, &device](Result<>&& result, const std::vector<uint8_t>& value, const std::map<std::string, Variant>&) {
+            if (!device.connected) {
+                result.returnError(Error("org.bluez.Error.NotConnected", "Not connected"));
+                return;
+            }
+            if (value.size() > link_.getMaxPayloadSize()) {
+                result.returnError(Error("org.bluez.Error.InvalidValueLength", "Value exceeds the MTU"));
+                return;
+            }
+            auto pending = std::make_shared<Result<>>(std::move(result));
+            const auto transmission = link_.transmit(value.size(), [this, &device, pending, written = std::string(value.begin(), value.end())] {
+                {
+                    std::lock_guard lock(peerMutex_);
+                    if (peer_) peer_(*this, device.info.alias, written);
+                }
+                pending->returnResults();
+            });
+            if (transmission == LinkSimulator::Transmission::Busy) pending->returnError(Error("org.bluez.Error.InProgress", "In Progress"));
+            if (transmission == LinkSimulator::Transmission::Lost) pending->returnError(Error("org.bluez.Error.Failed", "Write was not acknowledged"));
+        });
+    device.txObject->registerMethod("AcquireWrite").onInterface(CharacteristicInterface).implementedAs(
+        [](const std::map<std::string, Variant>&) -> std::tuple<UnixFd, uint16_t> {
+            throw Error("org.bluez.Error.NotSupported", "Not supported");
+        });
+    device.txObject->registerProperty("UUID").onInterface(CharacteristicInterface).withGetter([] { return std::string(BluezTransport::TxCharacteristicUuid); });
+    device.txObject->registerProperty("Service").onInterface(CharacteristicInterface).withGetter([servicePath] { return ObjectPath(servicePath); });
+    device.txObject->registerProperty("MTU").onInterface(CharacteristicInterface).withGetter([mtu] { return mtu; });
+    device.txObject->finishRegistration();
+
+    device.rxObject = createObject(connection_, rxPath);
+    device.rxObject->registerMethod("StartNotify").onInterface(CharacteristicInterface).implementedAs([&device] {
+        if (!device.connected) throw Error("org.bluez.Error.NotConnected", "Not connected");
+        device.notifying = true;
+    });
+    device.rxObject->registerMethod("StopNotify").onInterface(CharacteristicInterface).implementedAs([&device] {
+        device.notifying = false;
+    });
+    device.rxObject->registerMethod("AcquireNotify").onInterface(CharacteristicInterface).implementedAs(
+        [](const std::map<std::string, Variant>&) -> std::tuple<UnixFd, uint16_t> {
+            throw Error("org.bluez.Error.NotSupported", "Not supported");
+        });
+    device.rxObject->registerProperty("UUID").onInterface(CharacteristicInterface).withGetter([] { return std::string(BluezTransport::RxCharacteristicUuid); });
+    device.rxObject->registerProperty("Service").onInterface(CharacteristicInterface).withGetter([servicePath] { return ObjectPath(servicePath); });
+    device.rxObject->registerProperty("MTU").onInterface(CharacteristicInterface).withGetter([mtu] { return mtu; });
+    device.rxObject->registerProperty("Notifying").onInterface(CharacteristicInterface).withGetter([&device] { return device.notifying.load(); });
+    device.rxObject->finishRegistration();
+
+    for (const auto& object : { device.deviceObject.get(), device.serviceObject.get(), device.txObject.get(), device.rxObject.get() }) {
+        object->emitInterfacesAddedSignal();
+    }
+    device.exported = true;
+}
@@ -0,0 +1,74 @@
+#ifndef FAKE_BLUEZ_SERVICE_H
+#define FAKE_BLUEZ_SERVICE_H
+
+#include "gatt_transport.h"
+#include "link_simulator.h"
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <sdbus-c++/IConnection.h>
+#include <sdbus-c++/IObject.h>
+
+namespace mimi {
+
+// Emulates the parts of org.bluez that BluezTransport and BleUartFleet use (ObjectManager, Adapter1, Device1
+// and the UART GattCharacteristic1 objects) on a bus other than the system bus, typically the session bus.
+// Robots added with addDevice() echo every write back as notifications unless a peer is set.
+// Unpaired robots, like with BlueZ, only appear once a discovery has been started.
+class FakeBluezService {
+public:
+    using Peer = std::function<void(FakeBluezService& service, const std::string& alias, std::string_view written)>;
+
+    // Takes the org.bluez name on the connection; the caller runs the connection's event loop
+    explicit FakeBluezService(sdbus::IConnection& connection, const LinkOptions& options = {});
+    ~FakeBluezService();
+    FakeBluezService(const FakeBluezService&) = delete;
+    FakeBluezService& operator=(const FakeBluezService&) = delete;
+
+    PairedDevice addDevice(const std::string& alias, const std::string& address, bool paired = true);
+    void removeDevice(const std::string& alias);
+    void setPeer(Peer peer);
+
+    bool notify(const std::string& alias, std::string_view data);
+    // Connects fail while the robot is out of range
+    void dropLink(const std::string& alias);
+    // Brings the robot back in range; like BlueZ with a bonded device, the service reconnects on its own
+    void restoreLink(const std::string& alias);
+    void flush();
+    [[nodiscard]] bool isDiscovering() const;
+
+private:
+    struct Device {
+        PairedDevice info;
+        bool paired = true;
+        bool exported = false;
+        std::atomic<bool> inRange = true;
+        std::atomic<bool> connected = false;
+        std::atomic<bool> notifying = false;
+        std::unique_ptr<sdbus::IObject> deviceObject;
+        std::unique_ptr<sdbus::IObject> serviceObject;
+        std::unique_ptr<sdbus::IObject> txObject;
+        std::unique_ptr<sdbus::IObject> rxObject;
+    };
+
+    sdbus::IConnection& connection_;
+    std::mutex mutex_;
+    std::map<std::string, std::unique_ptr<Device>> devices_;
+    std::unique_ptr<sdbus::IObject> adapterObject_;
+    std::atomic<bool> discovering_ = false;
+    std::mutex peerMutex_;
+    Peer peer_;
+    // Destroyed first, so that no packet is delivered to a removed object
+    LinkSimulator link_;
+
+    Device* findDevice(const std::string& alias);
+    void registerAdapter();
+    void registerDevice(Device& device);
+    void setConnected(Device& device, bool connected);
+};
+
+} // namespace mimi
+
+#endif //FAKE_BLUEZ_SERVICE_H
@@ -0,0 +1,416 @@
+// ReSharper disable CppTooWideScopeInitStatement
+#include "gatt_cache.h"
+#include "bluez_transport.h"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <strings.h>
+#include <sdbus-c++/sdbus-c++.h>
+
+using namespace sdbus;
+using namespace mimi;
+
+namespace {
+    constexpr const char* AdapterInterface = "org.bluez.Adapter1";
+    constexpr const char* DeviceInterface = "org.bluez.Device1";
+    constexpr const char* CharacteristicInterface = "org.bluez.GattCharacteristic1";
+    constexpr const char* FileHeader = "# mimi-ble-terminal GATT cache v2";
+    // Without the column telling whether the device advertises the UART service
+    constexpr const char* FileHeaderV1 = "# mimi-ble-terminal GATT cache v1";
+}
+
+GattCache::GattCache(IConnection& connection) :
+    connection_(connection),
+    objectManager_(createProxy(connection, BluezTransport::ServiceName, "/")) {
+    objectManager_->uponSignal("InterfacesAdded")
+        .onInterface("org.freedesktop.DBus.ObjectManager")
+        .call([this](const ObjectPath& path, const InterfaceMap& interfaces) {
+            PairedDevice device { "", "", path };
+            {
+                std::lock_guard lock(mutex_);
+                if (applyInterfacesLocked(path, interfaces)) {
+                    rebuildAliasIndexLocked();
+                    saveLocked();
+                }
+                const auto it = entries_.find(path);
+                if (it != entries_.end()) device = it->second.device;
+            }
+            const auto deviceIt = interfaces.find(DeviceInterface);
+            if (deviceIt != interfaces.end()) notifyListeners(device, deviceIt->second, true);
+        });
+    objectManager_->uponSignal("InterfacesRemoved")
+        .onInterface("org.freedesktop.DBus.ObjectManager")
+        .call([this](const ObjectPath& path, const std::vector<std::string>& interfaces) {
+            // Removed characteristics are kept on purpose, see the class comment
+            if (std::find(interfaces.begin(), interfaces.end(), DeviceInterface) == interfaces.end()) return;
+            std::lock_guard lock(mutex_);
+            const auto it = entries_.find(path);
+            if (it == entries_.end()) return;
+            const bool wasRobot = isRobot(it->second);
+            entries_.erase(it);
+            if (wasRobot) {
+                rebuildAliasIndexLocked();
+                saveLocked();
+            }
+        });
+    objectManager_->finishRegistration();
+
+    // Renames and unpairing only show up as Device1 property changes on the device objects themselves
+    const std::string match = std::string("type='signal',sender='") + BluezTransport::ServiceName +
+        "',interface='org.freedesktop.DBus.Properties',member='PropertiesChanged',arg0='" + DeviceInterface + "'";
+    propertiesMatch_ = connection_.addMatch(match, [this](Message& message) {
+        std::string interface;
+        VariantMap changed;
+        message >> interface >> changed;
+        const std::string path = message.getPath();
+        PairedDevice device { "", "", path };
+        {
+            std::lock_guard lock(mutex_);
+            const auto it = entries_.find(path);
+            if (it != entries_.end()) {
+                const Entry before = it->second;
+                applyDevicePropertiesLocked(it->second, changed);
+                if ((isRobot(before) || isRobot(it->second)) &&
+                    (it->second.device.alias != before.device.alias || it->second.paired != before.paired ||
+                     it->second.advertisesUart != before.advertisesUart)) {
+                    rebuildAliasIndexLocked();
+                    saveLocked();
+                }
+                device = it->second.device;
+            }
+        }
+        notifyListeners(device, changed, false);
+    });
+}
+
+GattCache::~GattCache() {
+    // Unsubscribe before the state the signal handlers use is destroyed
+    propertiesMatch_.reset();
+    objectManager_.reset();
+    stopSaver();
+}
+
+void GattCache::setFile(const std::string& filePath) {
+    std::lock_guard lock(mutex_);
+    filePath_ = filePath;
+    loadLocked();
+    if (!saverThread_.joinable()) saverThread_ = std::thread([this] { saverLoop(); });
+}
+
+std::vector<PairedDevice> GattCache::getPairedDevices() {
+    bool scanned;
+    {
+        std::lock_guard lock(mutex_);
+        scanned = scanned_;
+    }
+    if (!scanned) refresh();
+
+    std::vector<PairedDevice> devices;
+    std::lock_guard lock(mutex_);
+    for (const auto& [path, entry] : entries_) {
+        if (entry.paired) devices.push_back(entry.device);
+    }
+    return devices;
+}
+
+bool GattCache::findDevice(const std::string& alias, PairedDevice& device) {
+    const auto lookup = [&] {
+        const auto it = aliasIndex_.find(alias);
+        if (it == aliasIndex_.end()) return false;
+        device = entries_.at(it->second).device;
+        return true;
+    };
+    size_t scans;
+    {
+        std::lock_guard lock(mutex_);
+        if (lookup()) {
+            ++stats_.hits;
+            return true;
+        }
+        ++stats_.misses;
+        scans = stats_.scans;
+    }
+    refreshUnlessScannedSince(scans);
+    std::lock_guard lock(mutex_);
+    return lookup();
+}
+
+bool GattCache::findCharacteristics(const std::string& devicePath, std::string& txPath, std::string& rxPath) {
+    const auto lookup = [&] {
+        const auto it = entries_.find(devicePath);
+        if (it == entries_.end() || it->second.txPath.empty() || it->second.rxPath.empty()) return false;
+        txPath = it->second.txPath;
+        rxPath = it->second.rxPath;
+        return true;
+    };
+    size_t scans;
+    {
+        std::lock_guard lock(mutex_);
+        if (lookup()) {
+            ++stats_.hits;
+            return true;
+        }
+        ++stats_.misses;
+        scans = stats_.scans;
+    }
+    refreshUnlessScannedSince(scans);
+    std::lock_guard lock(mutex_);
+    return lookup();
+}
+
+void GattCache::forgetDevice(const std::string& devicePath) {
+    std::lock_guard lock(mutex_);
+    const auto it = entries_.find(devicePath);
+    if (it == entries_.end()) return;
+    const bool wasRobot = isRobot(it->second);
+    entries_.erase(it);
+    if (!wasRobot) return;
+    rebuildAliasIndexLocked();
+    saveLocked();
+}
+
+void GattCache::forgetCharacteristics(const std::string& devicePath) {
+    std::lock_guard lock(mutex_);
+    const auto it = entries_.find(devicePath);
+    if (it == entries_.end()) return;
+    it->second.txPath.clear();
+    it->second.rxPath.clear();
+    saveLocked();
+}
+
+void GattCache::refresh() {
+    std::lock_guard scanLock(scanMutex_);
+    scan();
+}
+
+void GattCache::refreshUnlessScannedSince(const size_t scans) {
+    std::lock_guard scanLock(scanMutex_);
+    {
+        std::lock_guard lock(mutex_);
+        if (stats_.scans != scans) return;
+    }
+    scan();
+}
+
+std::string GattCache::getAdapterPath() {
+    bool scanned;
+    {
+        std::lock_guard lock(mutex_);
+        scanned = scanned_;
+    }
+    if (!scanned) refresh();
+    std::lock_guard lock(mutex_);
+    return adapterPath_;
+}
+
+void GattCache::scan() {
+    // The reply is delivered by the event loop thread, which may be waiting for mutex_ in a signal handler
+    std::map<ObjectPath, InterfaceMap> objects;
+    const auto method = objectManager_->createMethodCall("org.freedesktop.DBus.ObjectManager", "GetManagedObjects");
+    auto reply = objectManager_->callMethod(method);
+    reply >> objects;
+
+    std::lock_guard lock(mutex_);
+    auto previous = std::move(entries_);
+    entries_.clear();
+    adapterPath_.clear();
+    for (const auto& [path, interfaces] : objects) {
+        if (interfaces.count(AdapterInterface) != 0 && adapterPath_.empty()) adapterPath_ = path;
+        if (interfaces.count(DeviceInterface) != 0) applyInterfacesLocked(path, interfaces);
+    }
+    for (const auto& [path, interfaces] : objects) {
+        if (interfaces.count(DeviceInterface) == 0) applyInterfacesLocked(path, interfaces);
+    }
+    for (auto& [path, entry] : entries_) {
+        const auto old = previous.find(path);
+        if (old == previous.end()) continue;
+        if (entry.txPath.empty()) entry.txPath = old->second.txPath;
+        if (entry.rxPath.empty()) entry.rxPath = old->second.rxPath;
+    }
+    scanned_ = true;
+    ++stats_.scans;
+    rebuildAliasIndexLocked();
+    saveLocked();
+}
+
+size_t GattCache::addDeviceListener(const std::string& devicePath, DeviceListener listener) {
+    std::lock_guard lock(listenerMutex_);
+    const size_t id = nextListenerId_++;
+    listeners_.emplace(id, std::make_pair(devicePath, std::move(listener)));
+    return id;
+}
+
+void GattCache::removeDeviceListener(const size_t id) {
+    std::lock_guard lock(listenerMutex_);
+    listeners_.erase(id);
+}
+
+void GattCache::notifyListeners(const PairedDevice& device, const VariantMap& properties, const bool appeared) {
+    std::lock_guard lock(listenerMutex_);
+    for (const auto& [id, listener] : listeners_) {
+        if (listener.first.empty() || listener.first == device.path) listener.second(device, properties, appeared);
+    }
+}
+
+GattCache::Stats GattCache::getStats() const {
+    std::lock_guard lock(mutex_);
+    return stats_;
+}
+
+bool GattCache::applyInterfacesLocked(const std::string& path, const InterfaceMap& interfaces) {
+    bool changed = false;
+
+    const auto deviceIt = interfaces.find(DeviceInterface);
+    if (deviceIt != interfaces.end()) {
+        const auto [entryIt, added] = entries_.try_emplace(path);
+        Entry& entry = entryIt->second;
+        const Entry before = entry;
+        entry.device.path = path;
+        applyDevicePropertiesLocked(entry, deviceIt->second);
+        // Every phone and beacon a discovery sees is exported too; only robots are worth an alias index or a save
+        changed = (isRobot(entry) || (!added && isRobot(before))) &&
+            (added || entry.device.alias != before.device.alias || entry.device.address != before.device.address ||
+             entry.paired != before.paired || entry.advertisesUart != before.advertisesUart);
+    }
+
+    const auto characteristicIt = interfaces.find(CharacteristicInterface);
+    if (characteristicIt != interfaces.end()) {
+        const auto& props = characteristicIt->second;
+        const auto uuidIt = props.find("UUID");
+        if (uuidIt == props.end()) return changed;
+
+        const auto uuid = uuidIt->second.get<std::string>();
+        const bool isTx = strcasecmp(uuid.c_str(), BluezTransport::TxCharacteristicUuid) == 0;
+        const bool isRx = strcasecmp(uuid.c_str(), BluezTransport::RxCharacteristicUuid) == 0;
+        if (!isTx && !isRx) return changed;
+
+        const std::string devicePath = devicePathOf(path);
+        const auto entryIt = entries_.find(devicePath);
+        if (entryIt == entries_.end()) return changed;
+        std::string& cached = isTx ? entryIt->second.txPath : entryIt->second.rxPath;
+        if (cached != path) {
+            cached = path;
+            changed = changed || isRobot(entryIt->second);
+        }
+    }
+    return changed;
+}
+
+void GattCache::applyDevicePropertiesLocked(Entry& entry, const VariantMap& properties) {
+    const auto pairedIt = properties.find("Paired");
+    const auto aliasIt  = properties.find("Alias");
+    const auto addrIt   = properties.find("Address");
+    const auto uuidsIt  = properties.find("UUIDs");
+    if (pairedIt != properties.end()) entry.paired = pairedIt->second.get<bool>();
+    if (uuidsIt != properties.end()) {
+        const auto uuids = uuidsIt->second.get<std::vector<std::string>>();
+        entry.advertisesUart = std::any_of(uuids.begin(), uuids.end(), [](const std::string& uuid) {
+            return strcasecmp(uuid.c_str(), BluezTransport::UartServiceUuid) == 0;
+        });
+    }
+    if (aliasIt != properties.end()) entry.device.alias = aliasIt->second.get<std::string>();
+    else if (entry.device.alias.empty()) entry.device.alias = "(unknown)";
+    if (addrIt != properties.end()) entry.device.address = addrIt->second.get<std::string>();
+    else if (entry.device.address.empty()) entry.device.address = "(no address)";
+}
+
+void GattCache::rebuildAliasIndexLocked() {
+    aliasIndex_.clear();
+    for (const auto& [path, entry] : entries_) {
+        // Object path order, so the first match wins just like a scan of GetManagedObjects
+        if (entry.paired) aliasIndex_.emplace(entry.device.alias, path);
+    }
+    // A paired robot wins over an unpaired one with the same alias
+    for (const auto& [path, entry] : entries_) {
+        if (!entry.paired && entry.advertisesUart) aliasIndex_.emplace(entry.device.alias, path);
+    }
+}
+
+void GattCache::loadLocked() {
+    std::ifstream file(filePath_);
+    std::string line;
+    if (!file || !std::getline(file, line) || (line != FileHeader && line != FileHeaderV1)) return;
+    const bool hasUartColumn = line == FileHeader;
+
+    while (std::getline(file, line)) {
+        std::istringstream fields(line);
+        Entry entry;
+        std::string paired;
+        std::string uart;
+        if (!std::getline(fields, entry.device.path, '\t') ||
+            !std::getline(fields, entry.device.alias, '\t') ||
+            !std::getline(fields, entry.device.address, '\t') ||
+            !std::getline(fields, paired, '\t') ||
+            (hasUartColumn && !std::getline(fields, uart, '\t'))) continue;
+        std::getline(fields, entry.txPath, '\t');
+        std::getline(fields, entry.rxPath, '\t');
+        entry.paired = paired == "1";
+        entry.advertisesUart = uart == "1";
+        // Earlier versions saved every device BlueZ knew
+        if (isRobot(entry)) entries_.emplace(entry.device.path, std::move(entry));
+    }
+    rebuildAliasIndexLocked();
+}
+
+void GattCache::saveLocked() {
+    if (filePath_.empty() || saveDue_) return;
+    saveDue_ = true;
+    saverWakeup_.notify_one();
+}
+
+void GattCache::saverLoop() {
+    std::unique_lock lock(mutex_);
+    while (true) {
+        saverWakeup_.wait(lock, [this] { return saveDue_ || stoppingSaver_; });
+        // The rest of a burst of changes, such as a scan followed by its signals, goes into the same save
+        saverWakeup_.wait_for(lock, SaveDelay, [this] { return stoppingSaver_; });
+        if (saveDue_) {
+            saveDue_ = false;
+            ++stats_.saves;
+            const std::string filePath = filePath_;
+            const std::string contents = formatLocked();
+            lock.unlock();
+            // Written next to the target and renamed, so that a crash never leaves half a file behind
+            const std::string tempPath = filePath + ".tmp";
+            bool written;
+            {
+                std::ofstream file(tempPath, std::ios::trunc);
+                written = file && (file << contents) && file.flush();
+            }
+            if (written) std::rename(tempPath.c_str(), filePath.c_str());
+            lock.lock();
+        }
+        if (stoppingSaver_) return;
+    }
+}
+
+void GattCache::stopSaver() {
+    {
+        std::lock_guard lock(mutex_);
+        stoppingSaver_ = true;
+    }
+    saverWakeup_.notify_one();
+    // A change still waiting for its save is written before the thread ends
+    if (saverThread_.joinable()) saverThread_.join();
+}
+
+std::string GattCache::formatLocked() const {
+    std::ostringstream file;
+    file << FileHeader << '\n';
+    for (const auto& [path, entry] : entries_) {
+        if (!isRobot(entry)) continue;
+        std::string alias = entry.device.alias;
+        std::replace(alias.begin(), alias.end(), '\t', ' ');
+        std::replace(alias.begin(), alias.end(), '\n', ' ');
+        file << path << '\t' << alias << '\t' << entry.device.address << '\t' << (entry.paired ? '1' : '0')
+             << '\t' << (entry.advertisesUart ? '1' : '0') << '\t' << entry.txPath << '\t' << entry.rxPath << '\n';
+    }
+    return file.str();
+}
+
+std::string GattCache::devicePathOf(const std::string& objectPath) {
+    // /org/bluez/hci0/dev_XX_XX_XX_XX_XX_XX/serviceNNNN/charNNNN
+    const auto pos = objectPath.find("/service");
+    return pos != std::string::npos ? objectPath.substr(0, pos) : objectPath;
+}
@@ -0,0 +1,135 @@
+#ifndef GATT_CACHE_H
+#define GATT_CACHE_H
+
+#include "gatt_transport.h"
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <sdbus-c++/IConnection.h>
+#include <sdbus-c++/IProxy.h>
+#include <sdbus-c++/Types.h>
+
+namespace mimi {
+
+// Remembers which BlueZ object belongs to which alias and where a device's UART characteristics are,
+// so that only the first connect has to walk BlueZ's whole object tree. After one GetManagedObjects
+// scan the cache follows InterfacesAdded/InterfacesRemoved and Device1 property changes.
+// Characteristic paths survive InterfacesRemoved: BlueZ drops the GATT objects on every disconnect
+// and exports them under the same paths on reconnect. A path that turns out to be wrong is dropped
+// with forgetCharacteristics() and found again by the next scan. Lookups that miss at the same time
+// share one scan. Besides paired devices, aliases also find unpaired ones that advertise the UART service,
+// such as robots seen by a discovery.
+// Only paired and UART-advertising devices are saved to the file, by a thread of the cache, SaveDelay after
+// the first of a burst of changes, so that the devices a discovery turns up never hold up the signal handlers.
+// Other devices are only kept while BlueZ exports them, in case their advertised services show up later.
+// The connection's event loop has to be running, and lookups must not be made from inside it.
+class GattCache {
+public:
+    // Device1 properties that changed or, when appeared is true, those of a newly exported device object.
+    // The device is as the cache knows it after the change; only its path is set for a device it does not know.
+    using DeviceListener = std::function<void(const PairedDevice& device, const std::map<std::string, sdbus::Variant>& properties,
+                                              bool appeared)>;
+
+    struct Stats {
+        size_t scans;
+        size_t hits;
+        size_t misses;
+        size_t saves;
+    };
+
+    static constexpr std::chrono::milliseconds SaveDelay { 500 };
+
+    explicit GattCache(sdbus::IConnection& connection);
+    ~GattCache();
+    GattCache(const GattCache&) = delete;
+    GattCache& operator=(const GattCache&) = delete;
+
+    // Loads entries saved by an earlier run and keeps the file updated from then on, until the cache is destroyed.
+    // A missing or unreadable file just starts an empty cache.
+    void setFile(const std::string& filePath);
+
+    std::vector<PairedDevice> getPairedDevices();
+    // Scans BlueZ again if the alias is unknown
+    bool findDevice(const std::string& alias, PairedDevice& device);
+    // Scans BlueZ again if the device has no known UART characteristics
+    bool findCharacteristics(const std::string& devicePath, std::string& txPath, std::string& rxPath);
+
+    void forgetDevice(const std::string& devicePath);
+    void forgetCharacteristics(const std::string& devicePath);
+    // Replaces everything with a fresh GetManagedObjects scan
+    void refresh();
+    // The first Bluetooth adapter; empty if there is none
+    std::string getAdapterPath();
+
+    // Listeners run on the event loop thread and must not call back into the cache.
+    // A listener added for an empty path hears about every device.
+    // Once removeDeviceListener() returns, the listener is not running and will not run again.
+    size_t addDeviceListener(const std::string& devicePath, DeviceListener listener);
+    void removeDeviceListener(size_t id);
+
+    [[nodiscard]] Stats getStats() const;
+
+private:
+    using VariantMap = std::map<std::string, sdbus::Variant>;
+    using InterfaceMap = std::map<std::string, VariantMap>;
+
+    struct Entry {
+        PairedDevice device;
+        bool paired = false;
+        bool advertisesUart = false;
+        std::string txPath;
+        std::string rxPath;
+    };
+
+    sdbus::IConnection& connection_;
+    std::unique_ptr<sdbus::IProxy> objectManager_;
+    sdbus::Slot propertiesMatch_;
+    mutable std::mutex mutex_;
+    bool scanned_ = false;
+    // Held for a whole scan, so that lookups missing together wait for one scan instead of making their own
+    std::mutex scanMutex_;
+    std::string adapterPath_;
+    // Keyed by device object path
+    std::map<std::string, Entry> entries_;
+    std::unordered_map<std::string, std::string> aliasIndex_;
+    std::string filePath_;
+    Stats stats_ {};
+    // Writes the file, so that no signal handler or lookup ever waits for the disk
+    std::thread saverThread_;
+    std::condition_variable saverWakeup_;
+    bool saveDue_ = false;
+    bool stoppingSaver_ = false;
+    std::mutex listenerMutex_;
+    std::map<size_t, std::pair<std::string, DeviceListener>> listeners_;
+    size_t nextListenerId_ = 1;
+
+    void scan();
+    // Scans unless a scan has finished since the caller saw stats_.scans at scans
+    void refreshUnlessScannedSince(size_t scans);
+    bool applyInterfacesLocked(const std::string& path, const InterfaceMap& interfaces);
+    void applyDevicePropertiesLocked(Entry& entry, const VariantMap& properties);
+    void rebuildAliasIndexLocked();
+    void notifyListeners(const PairedDevice& device, const VariantMap& properties, bool appeared);
+    void loadLocked();
+    // Has the saver thread write the file soon
+    void saveLocked();
+    void saverLoop();
+    void stopSaver();
+    [[nodiscard]] std::string formatLocked() const;
+
+    // Devices worth remembering across runs, and the only ones found by alias
+    static bool isRobot(const Entry& entry) { return entry.paired || entry.advertisesUart; }
+
+    static std::string devicePathOf(const std::string& objectPath);
+};
+
+} // namespace mimi
+
+#endif //GATT_CACHE_H
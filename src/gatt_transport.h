@@ -0,0 +1,67 @@
+#ifndef GATT_TRANSPORT_H
+#define GATT_TRANSPORT_H
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace mimi {
+
+struct PairedDevice {
+    std::string alias;
+    std::string address;
+    std::string path;
+};
+
+// GATT operations BleUartClient needs from a link to a UART-over-BLE peripheral.
+// Failing operations throw sdbus::Error, whose name and message end up in the client's ErrorCallback.
+class GattTransport {
+public:
+    struct Handlers {
+        // A notification from the RX characteristic. The data may be modified in place.
+        std::function<void(char* data, size_t size)> received;
+        // The peripheral dropped the link without being asked to
+        std::function<void()> linkLost;
+        // After a linkLost: the peripheral was seen again, so a reconnect attempt is likely to succeed now
+        std::function<void()> linkAvailable;
+        // An asynchronous write failed after write() had returned
+        std::function<void(const std::string& message, const std::string& errorName)> writeFailed;
+    };
+
+    virtual ~GattTransport() = default;
+
+    void setHandlers(Handlers handlers) { handlers_ = std::move(handlers); }
+
+    virtual std::vector<PairedDevice> listPairedDevices() = 0;
+    // Returns false if no paired device has the alias
+    virtual bool findPairedDevice(const std::string& alias, PairedDevice& device) {
+        for (auto& paired : listPairedDevices()) {
+            if (paired.alias == alias) {
+                device = std::move(paired);
+                return true;
+            }
+        }
+        return false;
+    }
+    virtual void connectDevice(const PairedDevice& device) = 0;
+    // Returns false if the device has no UART TX and RX characteristics
+    virtual bool discoverCharacteristics() = 0;
+    virtual void startNotifications() = 0;
+    // Reports linkLost and linkAvailable until disconnectDevice()
+    virtual void watchConnection() = 0;
+    virtual void write(const char* data, size_t size, bool withResponse) = 0;
+    // Never throws
+    virtual void disconnectDevice() = 0;
+
+    [[nodiscard]] virtual bool isReady() const = 0;
+    [[nodiscard]] virtual size_t getMaxWriteSize() const = 0;
+    [[nodiscard]] virtual bool supportsWriteWithResponse() const = 0;
+
+protected:
+    Handlers handlers_;
+};
+
+} // namespace mimi
+
+#endif //GATT_TRANSPORT_H
@@ -0,0 +1,94 @@
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace mimi {
+
+// Lock-free log-linear histogram of durations in nanoseconds, in the spirit of HdrHistogram:
+// every power of two is split into 32 linear buckets, so any recorded value is known to within ~3%.
+// Recording is wait-free and may happen on any thread; reads are approximate while recording goes on.
+class LatencyHistogram {
+public:
+    static constexpr unsigned SubBucketBits = 5;
+    static constexpr unsigned MaxValueBits = 43; // About two hours; longer durations are clamped
+    static constexpr size_t SubBucketCount = size_t(1) << SubBucketBits;
+    static constexpr size_t BucketCount = (MaxValueBits - SubBucketBits + 1) * SubBucketCount;
+
+    void record(const std::chrono::nanoseconds duration) {
+        const auto value = static_cast<uint64_t>(duration.count() > 0 ? duration.count() : 0);
+        const uint64_t clamped = value < (uint64_t(1) << MaxValueBits) ? value : (uint64_t(1) << MaxValueBits) - 1;
+        buckets_[indexOf(clamped)].fetch_add(1, std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+        sum_.fetch_add(clamped, std::memory_order_relaxed);
+        uint64_t current = max_.load(std::memory_order_relaxed);
+        while (clamped > current && !max_.compare_exchange_weak(current, clamped, std::memory_order_relaxed)) {}
+    }
+
+    template<typename Rep, typename Period>
+    void record(const std::chrono::duration<Rep, Period> duration) {
+        record(std::chrono::duration_cast<std::chrono::nanoseconds>(duration));
+    }
+
+    [[nodiscard]] uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+    [[nodiscard]] std::chrono::nanoseconds max() const { return std::chrono::nanoseconds(max_.load(std::memory_order_relaxed)); }
+    [[nodiscard]] std::chrono::nanoseconds mean() const {
+        const uint64_t n = count();
+        return std::chrono::nanoseconds(n > 0 ? sum_.load(std::memory_order_relaxed) / n : 0);
+    }
+
+    // The highest value that falls into the same bucket as the requested percentile (0..100)
+    [[nodiscard]] std::chrono::nanoseconds percentile(const double percent) const {
+        const uint64_t total = count();
+        if (total == 0) return std::chrono::nanoseconds(0);
+        const double clampedPercent = percent < 0.0 ? 0.0 : percent > 100.0 ? 100.0 : percent;
+        uint64_t rank = static_cast<uint64_t>(clampedPercent / 100.0 * static_cast<double>(total) + 0.5);
+        if (rank == 0) rank = 1;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < BucketCount; ++i) {
+            seen += buckets_[i].load(std::memory_order_relaxed);
+            if (seen >= rank) {
+                const uint64_t highest = highestValueAt(i);
+                const uint64_t maxValue = max_.load(std::memory_order_relaxed);
+                return std::chrono::nanoseconds(highest < maxValue ? highest : maxValue);
+            }
+        }
+        return max();
+    }
+
+    void reset() {
+        for (auto& bucket : buckets_) bucket.store(0, std::memory_order_relaxed);
+        count_.store(0, std::memory_order_relaxed);
+        sum_.store(0, std::memory_order_relaxed);
+        max_.store(0, std::memory_order_relaxed);
+    }
+
+private:
+    std::array<std::atomic<uint64_t>, BucketCount> buckets_ {};
+    std::atomic<uint64_t> count_ = 0;
+    std::atomic<uint64_t> sum_ = 0;
+    std::atomic<uint64_t> max_ = 0;
+
+    static size_t indexOf(const uint64_t value) {
+        // Values below 2 * SubBucketCount get a bucket each
+        if (value < 2 * SubBucketCount) return static_cast<size_t>(value);
+        const unsigned highestBit = 63 - static_cast<unsigned>(__builtin_clzll(value));
+        const unsigned shift = highestBit - SubBucketBits;
+        return (shift + 1) * SubBucketCount + static_cast<size_t>((value >> shift) - SubBucketCount);
+    }
+
+    static uint64_t highestValueAt(const size_t index) {
+        if (index < 2 * SubBucketCount) return index;
+        const size_t shift = index / SubBucketCount - 1;
+        const uint64_t lowest = (SubBucketCount + index % SubBucketCount) << shift;
+        return lowest + (uint64_t(1) << shift) - 1;
+    }
+};
+
+} // namespace mimi
+
+#endif //LATENCY_HISTOGRAM_H
@@ -0,0 +1,85 @@
+#include "line_framer.h"
+#include <algorithm>
+#include <cstring>
+
+using namespace mimi;
+
+LineFramer::LineFramer(const size_t capacity, const OverlongPolicy overlongPolicy) :
+    capacity_(capacity),
+    overlongPolicy_(overlongPolicy),
+    partial_(new char[capacity]) {
+}
+
+void LineFramer::setHandlers(LineHandler lineHandler, OverlongHandler overlongHandler) {
+    lineHandler_ = std::move(lineHandler);
+    overlongHandler_ = std::move(overlongHandler);
+}
+
+void LineFramer::setOverlongPolicy(const OverlongPolicy& overlongPolicy) {
+    overlongPolicy_ = overlongPolicy;
+}
+
+size_t LineFramer::feed(char* data, const size_t size) {
+    char* position = data;
+    char* const end = data + size;
+    while (position < end) {
+        const auto newline = static_cast<char*>(std::memchr(position, '\n', end - position));
+        if (newline == nullptr) {
+            appendPartial(position, end - position);
+            return size;
+        }
+
+        const auto length = static_cast<size_t>(newline - position);
+        if (partialLineLength_ == 0) {
+            // The whole line is inside this fragment: deliver it without copying
+            emitLine(position, std::min(length, capacity_), length);
+        } else {
+            appendPartial(position, length);
+            emitLine(partial_.get(), partialSize_, partialLineLength_);
+            partialSize_ = 0;
+            partialLineLength_ = 0;
+        }
+        position = newline + 1;
+        if (stopped_) {
+            stopped_ = false;
+            return static_cast<size_t>(position - data);
+        }
+    }
+    return size;
+}
+
+void LineFramer::stopAfterLine() {
+    stopped_ = true;
+}
+
+void LineFramer::reset() {
+    partialSize_ = 0;
+    partialLineLength_ = 0;
+    stopped_ = false;
+}
+
+void LineFramer::appendPartial(const char* data, const size_t size) {
+    const size_t copied = std::min(size, capacity_ - partialSize_);
+    std::memcpy(partial_.get() + partialSize_, data, copied);
+    partialSize_ += copied;
+    partialLineLength_ += size;
+}
+
+void LineFramer::emitLine(char* data, const size_t size, const size_t lineLength) {
+    if (lineLength > capacity_) {
+        if (overlongHandler_) overlongHandler_(lineLength);
+        if (overlongPolicy_ == OverlongPolicy::Error) return;
+    }
+    if (lineHandler_) lineHandler_(std::string_view(data, stripCarriageReturns(data, size)));
+}
+
+size_t LineFramer::stripCarriageReturns(char* data, const size_t size) {
+    auto cr = static_cast<char*>(std::memchr(data, '\r', size));
+    if (cr == nullptr) return size;
+    char* const end = data + size;
+    char* out = cr;
+    for (const char* in = cr; in < end; ++in) {
+        if (*in != '\r') *out++ = *in;
+    }
+    return out - data;
+}
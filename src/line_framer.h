@@ -0,0 +1,56 @@
+#ifndef LINE_FRAMER_H
+#define LINE_FRAMER_H
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string_view>
+
+namespace mimi {
+
+class LineFramer {
+public:
+    enum class OverlongPolicy {
+        Truncate,
+        Error,
+    };
+
+    using LineHandler = std::function<void(std::string_view line)>;
+    using OverlongHandler = std::function<void(size_t lineLength)>;
+
+    static constexpr size_t DefaultCapacity = 1024;
+
+    explicit LineFramer(size_t capacity = DefaultCapacity, OverlongPolicy overlongPolicy = OverlongPolicy::Truncate);
+
+    void setHandlers(LineHandler lineHandler, OverlongHandler overlongHandler);
+    void setOverlongPolicy(const OverlongPolicy& overlongPolicy);
+    [[nodiscard]] OverlongPolicy getOverlongPolicy() const { return overlongPolicy_; }
+    [[nodiscard]] size_t capacity() const { return capacity_; }
+
+    // Data is modified in place ('\r' is stripped) and complete lines are handed out as views into it
+    // whenever possible. Only the unterminated tail is copied into the framer's own buffer.
+    // Returns the number of bytes taken, which is less than size only if the line handler called stopAfterLine().
+    size_t feed(char* data, size_t size);
+    // Makes feed() return right after the line being handled, leaving the rest of the data to another framer
+    void stopAfterLine();
+    void reset();
+
+private:
+    const size_t capacity_;
+    OverlongPolicy overlongPolicy_;
+    LineHandler lineHandler_ = nullptr;
+    OverlongHandler overlongHandler_ = nullptr;
+
+    std::unique_ptr<char[]> partial_;
+    size_t partialSize_ = 0;
+    size_t partialLineLength_ = 0;
+    bool stopped_ = false;
+
+    void appendPartial(const char* data, size_t size);
+    void emitLine(char* data, size_t size, size_t lineLength);
+    static size_t stripCarriageReturns(char* data, size_t size);
+};
+
+} // namespace mimi
+
+#endif //LINE_FRAMER_H
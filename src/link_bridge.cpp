@@ -0,0 +1,378 @@
+// ReSharper disable CppTooWideScopeInitStatement
+#include "link_bridge.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+using namespace mimi;
+
+namespace {
+    constexpr int ListenBacklog = 128;
+    constexpr size_t ReadChunkSize = 4096;
+    constexpr size_t MaxIovecs = 64;
+    constexpr int MaxEvents = 64;
+
+    int listenOn(const sockaddr* address, const socklen_t addressSize) {
+        const int fd = socket(address->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) return -1;
+        constexpr int on = 1;
+        if (address->sa_family == AF_INET) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (bind(fd, address, addressSize) < 0 || ::listen(fd, ListenBacklog) < 0) {
+            const int error = errno;
+            close(fd);
+            errno = error;
+            return -1;
+        }
+        return fd;
+    }
+}
+
+LinkBridge::WriteCompletions::WriteCompletions() {
+    fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+LinkBridge::WriteCompletions::~WriteCompletions() {
+    close(fd);
+}
+
+LinkBridge::LinkBridge(BleUartClient& client, Options options) :
+    client_(client),
+    options_(std::move(options)),
+    completions_(std::make_shared<WriteCompletions>()) {
+    epollFd_ = epoll_create1(EPOLL_CLOEXEC);
+    stopFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    setCallbacks();
+}
+
+LinkBridge::~LinkBridge() {
+    for (const auto& [fd, subscriber] : subscribers_) {
+        close(fd);
+    }
+    if (unixListenFd_ >= 0) {
+        close(unixListenFd_);
+        unlink(options_.socketPath.c_str());
+    }
+    if (tcpListenFd_ >= 0) close(tcpListenFd_);
+    close(stopFd_);
+    close(epollFd_);
+}
+
+bool LinkBridge::listen() {
+    sockaddr_un unixAddress {};
+    unixAddress.sun_family = AF_UNIX;
+    if (options_.socketPath.empty() || options_.socketPath.size() >= sizeof(unixAddress.sun_path)) {
+        errno = EINVAL;
+        return false;
+    }
+    std::memcpy(unixAddress.sun_path, options_.socketPath.c_str(), options_.socketPath.size() + 1);
+    // Only a socket left behind by an earlier bridge is removed, never a regular file
+    struct stat status {};
+    if (lstat(options_.socketPath.c_str(), &status) == 0 && S_ISSOCK(status.st_mode)) {
+        unlink(options_.socketPath.c_str());
+    }
+    unixListenFd_ = listenOn(reinterpret_cast<const sockaddr*>(&unixAddress), sizeof(unixAddress));
+    if (unixListenFd_ < 0) return false;
+
+    if (options_.tcpPort != 0) {
+        sockaddr_in tcpAddress {};
+        tcpAddress.sin_family = AF_INET;
+        tcpAddress.sin_port = htons(options_.tcpPort);
+        tcpAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        tcpListenFd_ = listenOn(reinterpret_cast<const sockaddr*>(&tcpAddress), sizeof(tcpAddress));
+        if (tcpListenFd_ < 0) return false;
+    }
+    return true;
+}
+
+void LinkBridge::setCallbacks() {
+    client_.setCallbacks(
+        [this](const std::string& deviceAlias, const std::string&, const bool) {
+            fanOut(str(StatusPrefix, "connected ", deviceAlias));
+        },
+        [this](const std::string& deviceAlias, const std::string&, const bool isFailure) {
+            fanOut(str(StatusPrefix, isFailure ? "lost " : "disconnected ", deviceAlias));
+        },
+        [](const std::string&, const BleUartClient::State&) {
+        },
+        [this](const std::string&, const std::string& errorText, const std::string&, const BleUartClient::State&) {
+            fanOut(str(StatusPrefix, "error ", errorText));
+        },
+        nullptr
+    );
+    client_.setReceiveViewCallback([this](const std::string&, const std::string_view receivedText) {
+        fanOut(receivedText);
+    });
+}
+
+void LinkBridge::run() {
+    epoll_event event {};
+    event.events = EPOLLIN;
+    for (const int fd : {stopFd_, client_.getCallbackFd(), completions_->fd, unixListenFd_, tcpListenFd_}) {
+        if (fd < 0) continue;
+        event.data.fd = fd;
+        epoll_ctl(epollFd_, EPOLL_CTL_ADD, fd, &event);
+    }
+
+    bool stopping = false;
+    while (!stopping) {
+        epoll_event events[MaxEvents];
+        const int count = epoll_wait(epollFd_, events, MaxEvents, -1);
+        for (int i = 0; i < count; ++i) {
+            const int fd = events[i].data.fd;
+            if (fd == stopFd_) {
+                stopping = true;
+            } else if (fd == client_.getCallbackFd()) {
+                // Lines are only queued here; every subscriber gets everything from one batch in one write below
+                client_.processCallbacks();
+            } else if (fd == completions_->fd) {
+                collectCompletions();
+            } else if (fd == unixListenFd_ || fd == tcpListenFd_) {
+                accept(fd);
+            } else {
+                const auto found = subscribers_.find(fd);
+                if (found == subscribers_.end()) continue;
+                Subscriber& subscriber = found->second;
+                if (subscriber.closing) continue;
+                if ((events[i].events & (EPOLLHUP | EPOLLERR)) != 0 && (events[i].events & EPOLLIN) == 0) {
+                    closeSubscriber(subscriber);
+                    continue;
+                }
+                if ((events[i].events & EPOLLIN) != 0) readFrom(subscriber);
+                if ((events[i].events & EPOLLOUT) != 0) flush(subscriber);
+            }
+        }
+        for (auto& [fd, subscriber] : subscribers_) {
+            if (!subscriber.closing && !subscriber.writeArmed && !subscriber.outgoing.empty()) flush(subscriber);
+        }
+        forwardCommands();
+        closePending();
+    }
+    // Commands handed to the client are still written; only the bridge stops waiting for them
+    collectCompletions();
+    commandsInFlight_ = 0;
+}
+
+void LinkBridge::stop() {
+    constexpr uint64_t signal = 1;
+    [[maybe_unused]] const auto n = write(stopFd_, &signal, sizeof(signal));
+}
+
+LinkBridge::Stats LinkBridge::getStats() const {
+    Stats stats = stats_;
+    stats.subscribers = subscribers_.size();
+    return stats;
+}
+
+void LinkBridge::accept(const int listenFd) {
+    while (true) {
+        const int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) return;
+        if (listenFd == tcpListenFd_) {
+            constexpr int on = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        }
+        Subscriber& subscriber = subscribers_[fd];
+        subscriber.fd = fd;
+        epoll_event event {};
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        epoll_ctl(epollFd_, EPOLL_CTL_ADD, fd, &event);
+        ++stats_.accepted;
+
+        const auto line = std::make_shared<const std::string>(
+            str(StatusPrefix, "state ", BleUartClient::stateToString(client_.getState()), '\n'));
+        subscriber.backlog += line->size();
+        subscriber.outgoing.push_back(line);
+    }
+}
+
+void LinkBridge::readFrom(Subscriber& subscriber) {
+    // One read per wakeup, so that a subscriber sending a flood gets no more turns than the others
+    char buffer[ReadChunkSize];
+    const ssize_t n = recv(subscriber.fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        closeSubscriber(subscriber);
+        return;
+    }
+    if (n == 0) {
+        // Commands sent just before the end of input are still forwarded, as with "echo ... | socat"
+        subscriber.inputClosed = true;
+        if (subscriber.commands.empty()) closeSubscriber(subscriber);
+        else updateInterest(subscriber);
+        return;
+    }
+    if (n > 0) subscriber.input.append(buffer, static_cast<size_t>(n));
+    takeCommands(subscriber);
+}
+
+void LinkBridge::takeCommands(Subscriber& subscriber) {
+    std::string& input = subscriber.input;
+    size_t position = 0;
+    while (subscriber.commands.size() < options_.maxQueuedCommands) {
+        const size_t newline = input.find('\n', position);
+        if (newline == std::string::npos) break;
+        size_t end = newline;
+        if (end > position && input[end - 1] == '\r') --end;
+        if (subscriber.discardingInput) {
+            subscriber.discardingInput = false;
+        } else if (end > position) {
+            subscriber.commands.emplace_back(input, position, end - position);
+            ++queuedCommands_;
+        }
+        position = newline + 1;
+    }
+    input.erase(0, position);
+    // An overlong command is dropped up to its newline instead of being buffered without limit
+    if (input.size() > options_.maxCommandLength && input.find('\n') == std::string::npos) {
+        input.clear();
+        subscriber.discardingInput = true;
+    }
+
+    const bool full = subscriber.commands.size() >= options_.maxQueuedCommands;
+    if (full != subscriber.readPaused) {
+        subscriber.readPaused = full;
+        updateInterest(subscriber);
+    }
+}
+
+void LinkBridge::flush(Subscriber& subscriber) {
+    while (!subscriber.outgoing.empty()) {
+        iovec iovecs[MaxIovecs];
+        size_t count = 0;
+        for (auto it = subscriber.outgoing.begin(); it != subscriber.outgoing.end() && count < MaxIovecs; ++it) {
+            const size_t offset = count == 0 ? subscriber.sentOfFront : 0;
+            iovecs[count].iov_base = const_cast<char*>((*it)->data() + offset);
+            iovecs[count].iov_len = (*it)->size() - offset;
+            ++count;
+        }
+        msghdr message {};
+        message.msg_iov = iovecs;
+        message.msg_iovlen = count;
+        const ssize_t n = sendmsg(subscriber.fd, &message, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            closeSubscriber(subscriber);
+            return;
+        }
+        auto sent = static_cast<size_t>(n);
+        subscriber.backlog -= sent;
+        while (sent > 0) {
+            const size_t remaining = subscriber.outgoing.front()->size() - subscriber.sentOfFront;
+            if (sent < remaining) {
+                subscriber.sentOfFront += sent;
+                break;
+            }
+            sent -= remaining;
+            subscriber.outgoing.pop_front();
+            subscriber.sentOfFront = 0;
+        }
+    }
+    const bool armed = !subscriber.outgoing.empty();
+    if (armed != subscriber.writeArmed) {
+        subscriber.writeArmed = armed;
+        updateInterest(subscriber);
+    }
+}
+
+void LinkBridge::updateInterest(Subscriber& subscriber) const {
+    epoll_event event {};
+    event.events = 0;
+    if (!subscriber.readPaused && !subscriber.inputClosed) event.events |= EPOLLIN;
+    if (subscriber.writeArmed) event.events |= EPOLLOUT;
+    event.data.fd = subscriber.fd;
+    epoll_ctl(epollFd_, EPOLL_CTL_MOD, subscriber.fd, &event);
+}
+
+void LinkBridge::fanOut(const std::string_view line) {
+    if (subscribers_.empty()) return;
+    std::string text;
+    text.reserve(line.size() + 1);
+    text.append(line).push_back('\n');
+    const SharedLine shared = std::make_shared<const std::string>(std::move(text));
+    ++stats_.linesFannedOut;
+
+    for (auto& [fd, subscriber] : subscribers_) {
+        if (subscriber.closing) continue;
+        // Lines of a batch are held back to be sent together, but not past the limit of a subscriber keeping up
+        if (subscriber.backlog + shared->size() > options_.maxBacklog && !subscriber.writeArmed) flush(subscriber);
+        if (subscriber.closing) continue;
+        // A line longer than the whole backlog still goes to a subscriber that has caught up
+        if (subscriber.backlog > 0 && subscriber.backlog + shared->size() > options_.maxBacklog) {
+            if (options_.slowConsumerPolicy == SlowConsumerPolicy::DropLines) {
+                ++stats_.droppedLines;
+            } else {
+                ++stats_.slowConsumersDisconnected;
+                closeSubscriber(subscriber);
+            }
+            continue;
+        }
+        subscriber.backlog += shared->size();
+        subscriber.outgoing.push_back(shared);
+    }
+}
+
+void LinkBridge::collectCompletions() {
+    uint64_t completed = 0;
+    if (read(completions_->fd, &completed, sizeof(completed)) != sizeof(completed)) return;
+    // Completions may still arrive for commands that the last run() stopped counting when it returned
+    commandsInFlight_ -= std::min<size_t>(completed, commandsInFlight_);
+}
+
+void LinkBridge::forwardCommands() {
+    while (queuedCommands_ > 0 && commandsInFlight_ < MaxCommandsInFlight) {
+        auto next = subscribers_.upper_bound(lastServedFd_);
+        for (size_t checked = 0; checked < subscribers_.size(); ++checked, ++next) {
+            if (next == subscribers_.end()) next = subscribers_.begin();
+            if (!next->second.commands.empty()) break;
+        }
+        Subscriber& subscriber = next->second;
+        lastServedFd_ = next->first;
+
+        std::string command = std::move(subscriber.commands.front());
+        subscriber.commands.pop_front();
+        --queuedCommands_;
+        command.push_back('\n');
+        ++commandsInFlight_;
+        // Runs on the writer thread, or right here if the command is refused
+        client_.sendAsync(std::move(command), [completions = completions_](bool) {
+            constexpr uint64_t one = 1;
+            [[maybe_unused]] const auto n = write(completions->fd, &one, sizeof(one));
+        });
+        ++stats_.commandsForwarded;
+        if (subscriber.inputClosed) {
+            if (subscriber.commands.empty()) closeSubscriber(subscriber);
+        } else if (subscriber.readPaused) {
+            // Lines already read from a paused subscriber take the freed room before it is read from again
+            takeCommands(subscriber);
+        }
+    }
+}
+
+void LinkBridge::closeSubscriber(Subscriber& subscriber) {
+    if (subscriber.closing) return;
+    subscriber.closing = true;
+    queuedCommands_ -= subscriber.commands.size();
+    subscriber.commands.clear();
+    subscriber.outgoing.clear();
+    subscriber.backlog = 0;
+    closing_.push_back(subscriber.fd);
+}
+
+void LinkBridge::closePending() {
+    for (const int fd : closing_) {
+        epoll_ctl(epollFd_, EPOLL_CTL_DEL, fd, nullptr);
+        close(fd);
+        subscribers_.erase(fd);
+    }
+    closing_.clear();
+}
@@ -0,0 +1,126 @@
+#ifndef LINK_BRIDGE_H
+#define LINK_BRIDGE_H
+
+#include "ble_uart_client.h"
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace mimi {
+
+// Shares one robot connection among local processes. Subscribers connect to a Unix domain socket (and, if asked,
+// to a TCP port on 127.0.0.1), receive every line from the robot and send lines that are forwarded to it.
+// Connection events reach subscribers as lines starting with "@bridge ". The bridge replaces the client's callbacks
+// and runs everything on one epoll loop in run(); call the client's connect() and disconnect() only while run() is
+// not running, as they dispatch callbacks on the calling thread. Finished writes are signalled through an eventfd.
+class LinkBridge {
+public:
+    // What happens to a subscriber that falls further behind than maxBacklog
+    enum class SlowConsumerPolicy {
+        Disconnect,
+        DropLines,
+    };
+
+    struct Options {
+        std::string socketPath;
+        // Zero for no TCP listener
+        uint16_t tcpPort = 0;
+        size_t maxBacklog = 256 * 1024;
+        SlowConsumerPolicy slowConsumerPolicy = SlowConsumerPolicy::Disconnect;
+        // Commands of one subscriber waiting for their turn; reading from it pauses until there is room again
+        size_t maxQueuedCommands = 64;
+        size_t maxCommandLength = LineFramer::DefaultCapacity;
+    };
+
+    struct Stats {
+        size_t subscribers;
+        uint64_t accepted;
+        uint64_t linesFannedOut;
+        uint64_t commandsForwarded;
+        uint64_t droppedLines;
+        uint64_t slowConsumersDisconnected;
+    };
+
+    // Commands of all subscribers handed to the client and not yet written
+    static constexpr size_t MaxCommandsInFlight = 16;
+    static constexpr const char* StatusPrefix = "@bridge ";
+
+    LinkBridge(BleUartClient& client, Options options);
+    ~LinkBridge();
+    LinkBridge(const LinkBridge&) = delete;
+    LinkBridge& operator=(const LinkBridge&) = delete;
+
+    // Opens the listening sockets; returns false with errno set if one cannot be opened.
+    // A stale socket file at socketPath is replaced.
+    bool listen();
+    // Serves subscribers until stop() is called
+    void run();
+    // Safe to call from a signal handler
+    void stop();
+    // Only from the thread running run(), or after it returned
+    [[nodiscard]] Stats getStats() const;
+
+private:
+    // One line shared by every subscriber it is sent to
+    using SharedLine = std::shared_ptr<const std::string>;
+
+    // Counts commands the writer has finished with; shared with the completions, which may outlive the bridge
+    struct WriteCompletions {
+        WriteCompletions();
+        ~WriteCompletions();
+        WriteCompletions(const WriteCompletions&) = delete;
+        WriteCompletions& operator=(const WriteCompletions&) = delete;
+        int fd = -1;
+    };
+
+    struct Subscriber {
+        int fd = -1;
+        std::deque<SharedLine> outgoing;
+        // Already sent bytes of outgoing.front()
+        size_t sentOfFront = 0;
+        size_t backlog = 0;
+        std::string input;
+        bool discardingInput = false;
+        std::deque<std::string> commands;
+        bool readPaused = false;
+        // The subscriber has shut down its sending side
+        bool inputClosed = false;
+        bool writeArmed = false;
+        // Closed at the end of the loop iteration, after every event that refers to it
+        bool closing = false;
+    };
+
+    BleUartClient& client_;
+    const Options options_;
+    int epollFd_ = -1;
+    int stopFd_ = -1;
+    int unixListenFd_ = -1;
+    int tcpListenFd_ = -1;
+    std::map<int, Subscriber> subscribers_;
+    // Subscribers are served round-robin, starting after the one served last
+    int lastServedFd_ = -1;
+    size_t queuedCommands_ = 0;
+    size_t commandsInFlight_ = 0;
+    std::shared_ptr<WriteCompletions> completions_;
+    std::vector<int> closing_;
+    Stats stats_ {};
+
+    void setCallbacks();
+    void accept(int listenFd);
+    void readFrom(Subscriber& subscriber);
+    void takeCommands(Subscriber& subscriber);
+    void flush(Subscriber& subscriber);
+    void updateInterest(Subscriber& subscriber) const;
+    void fanOut(std::string_view line);
+    void collectCompletions();
+    void forwardCommands();
+    void closeSubscriber(Subscriber& subscriber);
+    void closePending();
+};
+
+} // namespace mimi
+
+#endif //LINK_BRIDGE_H
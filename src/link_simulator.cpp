@@ -0,0 +1,92 @@
+#include "link_simulator.h"
+#include <algorithm>
+
+using namespace mimi;
+
+LinkSimulator::LinkSimulator(const LinkOptions& options) :
+    options_(options),
+    random_(options.seed),
+    loss_(options.lossRate) {
+    thread_ = std::thread([this] { run(); });
+}
+
+LinkSimulator::~LinkSimulator() {
+    {
+        std::lock_guard lock(mutex_);
+        stopping_ = true;
+    }
+    wakeup_.notify_all();
+    thread_.join();
+}
+
+size_t LinkSimulator::getMaxPayloadSize() const {
+    constexpr size_t attHeaderSize = 3;
+    return options_.mtu > attHeaderSize ? options_.mtu - attHeaderSize : 1;
+}
+
+bool LinkSimulator::deliver(std::function<void()> packet) {
+    {
+        std::lock_guard lock(mutex_);
+        if (loss_(random_)) return false;
+        packets_.push({ Clock::now() + options_.latency, nextSequence_++, std::move(packet) });
+    }
+    wakeup_.notify_one();
+    return true;
+}
+
+LinkSimulator::Transmission LinkSimulator::transmit(const size_t size, std::function<void()> packet) {
+    if (options_.throughput == 0) return deliver(std::move(packet)) ? Transmission::Sent : Transmission::Lost;
+    {
+        std::lock_guard lock(mutex_);
+        const auto now = Clock::now();
+        const auto queued = std::max(txIdleAt_, now) - now;
+        const auto airTime = std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(static_cast<double>(size) / options_.throughput));
+        const auto queuedBytes = static_cast<size_t>(std::chrono::duration<double>(queued).count() * options_.throughput);
+        if (options_.txBufferSize > 0 && queuedBytes + size > options_.txBufferSize) return Transmission::Busy;
+        // A lost write still takes its air time
+        txIdleAt_ = now + queued + airTime;
+        if (loss_(random_)) return Transmission::Lost;
+        packets_.push({ txIdleAt_ + options_.latency, nextSequence_++, std::move(packet) });
+    }
+    wakeup_.notify_one();
+    return Transmission::Sent;
+}
+
+void LinkSimulator::schedule(const std::chrono::microseconds delay, std::function<void()> handler) {
+    {
+        std::lock_guard lock(mutex_);
+        packets_.push({ Clock::now() + delay, nextSequence_++, std::move(handler) });
+    }
+    wakeup_.notify_one();
+}
+
+void LinkSimulator::flush() {
+    std::unique_lock lock(mutex_);
+    const uint64_t target = nextSequence_;
+    idle_.wait(lock, [&] { return handledSequence_ >= target || stopping_; });
+}
+
+void LinkSimulator::run() {
+    std::unique_lock lock(mutex_);
+    while (true) {
+        if (stopping_) return;
+        if (packets_.empty()) {
+            wakeup_.wait(lock);
+            continue;
+        }
+        const Clock::time_point dueTime = packets_.top().dueTime;
+        if (Clock::now() < dueTime) {
+            wakeup_.wait_until(lock, dueTime);
+            continue;
+        }
+
+        auto handler = std::move(const_cast<Packet&>(packets_.top()).handler);
+        packets_.pop();
+        lock.unlock();
+        handler();
+        lock.lock();
+        ++handledSequence_;
+        idle_.notify_all();
+    }
+}
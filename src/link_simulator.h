@@ -0,0 +1,88 @@
+#ifndef LINK_SIMULATOR_H
+#define LINK_SIMULATOR_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <thread>
+#include <vector>
+
+namespace mimi {
+
+struct LinkOptions {
+    uint16_t mtu = 23;
+    // One-way delay of every write and notification
+    std::chrono::microseconds latency { 0 };
+    std::chrono::microseconds connectLatency { 0 };
+    // Probability that a write or notification is silently lost
+    double lossRate = 0.0;
+    uint32_t seed = 1;
+    // Bytes per second of writes the link carries; writes beyond it wait in the transmit buffer. Zero for no limit.
+    uint32_t throughput = 0;
+    // Bytes the transmit buffer holds; a write that does not fit is refused as busy. Zero for no limit.
+    size_t txBufferSize = 0;
+};
+
+// Delivers packets of a simulated BLE link in order on its own thread, after the configured latency.
+// The thread plays the role of the D-Bus dispatch thread of a real connection.
+class LinkSimulator {
+public:
+    explicit LinkSimulator(const LinkOptions& options);
+    ~LinkSimulator();
+    LinkSimulator(const LinkSimulator&) = delete;
+    LinkSimulator& operator=(const LinkSimulator&) = delete;
+
+    [[nodiscard]] const LinkOptions& getOptions() const { return options_; }
+    [[nodiscard]] size_t getMaxPayloadSize() const;
+
+    enum class Transmission {
+        Sent,
+        Lost,
+        Busy,
+    };
+
+    // Returns false if the packet was lost
+    bool deliver(std::function<void()> packet);
+    // A write of the size: delivered after the writes before it have gone out at the configured throughput
+    Transmission transmit(size_t size, std::function<void()> packet);
+    // Runs the handler on the link thread after the delay; never lost
+    void schedule(std::chrono::microseconds delay, std::function<void()> handler);
+    // Waits until everything delivered so far has been handled
+    void flush();
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Packet {
+        Clock::time_point dueTime;
+        uint64_t sequence;
+        std::function<void()> handler;
+        bool operator>(const Packet& other) const {
+            return dueTime != other.dueTime ? dueTime > other.dueTime : sequence > other.sequence;
+        }
+    };
+
+    const LinkOptions options_;
+    std::mt19937 random_;
+    std::bernoulli_distribution loss_;
+
+    std::mutex mutex_;
+    std::condition_variable wakeup_;
+    std::condition_variable idle_;
+    std::priority_queue<Packet, std::vector<Packet>, std::greater<>> packets_;
+    uint64_t nextSequence_ = 0;
+    uint64_t handledSequence_ = 0;
+    // When the transmit buffer will have been emptied
+    Clock::time_point txIdleAt_;
+    bool stopping_ = false;
+    std::thread thread_;
+    void run();
+};
+
+} // namespace mimi
+
+#endif //LINK_SIMULATOR_H
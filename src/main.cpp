@@ -1,17 +1,29 @@
 // ReSharper disable CppTooWideScopeInitStatement
 #include "ble_uart_client.h"
+#include "ble_uart_fleet.h"
+#include "bluez_transport.h"
+#include "link_bridge.h"
+#include "script_runner.h"
+#include "session_reader.h"
+#include "terminal_renderer.h"
 #include <iostream>
+#include <fstream>
 #include <unistd.h>
 #include <fcntl.h>
-#include <sys/select.h>
-#include <chrono>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <cerrno>
+#include <cstdlib>
+#include <csignal>
+#include <cstring>
 #include <filesystem>
-#include <thread>
+#include <functional>
+#include <future>
+#include <map>
 
 using namespace mimi;
 
-std::string get_robot_name_from_args(const int argc, char* argv[]) {
-    const std::string prefix = "--robot-name=";
+std::string get_arg_value(const int argc, char* argv[], const std::string& prefix) {
     for (int i = 1; i < argc; ++i) {
         const std::string arg = argv[i];
         if (arg.rfind(prefix, 0) == 0) { // starts with prefix
@@ -21,46 +33,454 @@ std::string get_robot_name_from_args(const int argc, char* argv[]) {
     return {};
 }
 
+std::vector<std::string> get_arg_values(const int argc, char* argv[], const std::string& prefix) {
+    std::vector<std::string> values;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg.rfind(prefix, 0) == 0) values.push_back(arg.substr(prefix.length()));
+    }
+    return values;
+}
+
+std::string get_robot_name_from_args(const int argc, char* argv[]) {
+    return get_arg_value(argc, argv, "--robot-name=");
+}
+
+bool has_flag_in_args(const int argc, char* argv[], const std::string& flag) {
+    for (int i = 1; i < argc; ++i) {
+        if (argv[i] == flag) return true;
+    }
+    return false;
+}
+
 bool prompt_has_been_shown = false;
 
+LinkBridge* running_bridge = nullptr;
+
+void stop_bridge(int) {
+    if (running_bridge != nullptr) running_bridge->stop();
+}
+
 void output_command_prompt() {
     if (prompt_has_been_shown) std::cout << "> " << std::flush;
 }
 
-int main(const int argc, char* argv[]) {
-    std::cout.setf(std::ios::unitbuf);  // автоматический flush
-
-    const auto devices = BleUartClient::listPairedDevices();
+void output_paired_devices(const std::vector<PairedDevice>& devices) {
     std::cout << "📌 Paired devices (output format \"<name> [MAC-address]\"):\n";
     for (const auto& d : devices) {
         std::cout << " • " << d.alias << " [" << d.address << "]\n";
     }
+}
+
+int output_usage(char* argv[]) {
+    const std::string execName = std::filesystem::path(argv[0]).filename().string();
+    std::cout << "\nUsage: " << execName << " --robot-name=\"<alias>\" [--robot-name=\"<alias>\" ...]" << std::endl;
+    return EXIT_FAILURE;
+}
+
+std::string format_connect_timings(const BleUartClient::ConnectTimings& timings) {
+    const auto ms = [](const std::chrono::microseconds duration) { return std::to_string(duration.count() / 1000); };
+    return str("lookup ", ms(timings.lookup), " ms, connect ", ms(timings.connect), " ms, discovery ",
+               ms(timings.discovery), " ms, notifications ", ms(timings.notifications), " ms, total ",
+               ms(timings.total), " ms");
+}
+
+// Aliases are chosen by users and may contain anything
+void output_json_string(std::ostream& out, const std::string& text) {
+    out << '"';
+    for (const char ch : text) {
+        if (ch == '"' || ch == '\\') {
+            out << '\\' << ch;
+        } else if (static_cast<unsigned char>(ch) < 0x20) {
+            constexpr char hex[] = "0123456789abcdef";
+            out << "\\u00" << hex[ch >> 4] << hex[ch & 0xf];
+        } else {
+            out << ch;
+        }
+    }
+    out << '"';
+}
+
+void output_stats_json(std::ostream& out, const std::string& alias, const BleUartClient& client) {
+    const auto now = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch());
+    out << "{\"time_ms\":" << now.count() << ",\"robot\":";
+    output_json_string(out, alias);
+    out << ",\"state\":\"" << BleUartClient::stateToString(client.getState()) << "\",\"metrics\":";
+    client.getMetrics().writeJson(out);
+    out << "}" << std::endl;
+}
+
+TerminalRenderer::Options get_render_options(const int argc, char* argv[]) {
+    TerminalRenderer::Options renderOptions;
+    const std::string frameMs = get_arg_value(argc, argv, "--frame-ms=");
+    if (!frameMs.empty()) renderOptions.frameInterval = std::chrono::milliseconds(std::atol(frameMs.c_str()));
+    const std::string summaryRate = get_arg_value(argc, argv, "--summary-rate=");
+    if (!summaryRate.empty()) renderOptions.summaryThreshold = std::atof(summaryRate.c_str());
+    return renderOptions;
+}
+
+// What the interactive terminal talks to: one robot or a fleet of them
+struct InteractiveTarget {
+    int callbackFd = -1;
+    std::function<void()> processCallbacks;
+    // Queues the command; false if it was refused right away
+    std::function<bool(const std::string& command)> send;
+    std::function<void(std::ostream& out)> writeStats;
+    std::function<void(std::ostream& out)> writeStatsJson;
+};
+
+void run_interactive(const int argc, char* argv[], TerminalRenderer& renderer, const InteractiveTarget& target) {
+    // Stats as JSON lines every N seconds, to stderr unless --stats-file is given
+    const int statsInterval = std::atoi(get_arg_value(argc, argv, "--stats-interval=").c_str());
+    const std::string statsFileName = get_arg_value(argc, argv, "--stats-file=");
+    std::ofstream statsFile;
+    if (!statsFileName.empty()) statsFile.open(statsFileName, std::ios::app);
+    std::ostream& statsOut = statsFile.is_open() ? statsFile : std::cerr;
+
+    renderer.flush();
+    prompt_has_been_shown = true;
+    renderer.setPrompt("> ");
+    std::cout << "\n💬 Type commands to send to robot. Type ':stats' for timings, 'q' to quit." << std::endl;
+    output_command_prompt();
+
+    std::string inputBuffer;
+    // Настроим stdin в неблокирующий режим
+    const int flags = fcntl(STDIN_FILENO, F_GETFL, 0);
+    fcntl(STDIN_FILENO, F_SETFL, flags | O_NONBLOCK);
+
+    // Ждём либо ввода, либо BLE-событий, без периодического опроса
+    const int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    epoll_event event {};
+    event.events = EPOLLIN;
+    event.data.fd = target.callbackFd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, target.callbackFd, &event);
+    event.data.fd = STDIN_FILENO;
+    // Regular files cannot be polled, they are always ready for reading
+    const bool stdinIsPollable = epoll_ctl(epollFd, EPOLL_CTL_ADD, STDIN_FILENO, &event) == 0;
+    int statsTimerFd = -1;
+    if (statsInterval > 0) {
+        statsTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        itimerspec period {};
+        period.it_interval.tv_sec = statsInterval;
+        period.it_value.tv_sec = statsInterval;
+        timerfd_settime(statsTimerFd, 0, &period, nullptr);
+        event.data.fd = statsTimerFd;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, statsTimerFd, &event);
+    }
+    event.data.fd = renderer.getTimerFd();
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, renderer.getTimerFd(), &event);
+
+    target.processCallbacks();
+    bool quit = false;
+    char readBuffer[4096];
+    while (!quit) {
+        epoll_event events[4];
+        const int count = epoll_wait(epollFd, events, 4, stdinIsPollable ? -1 : 0);
+        if (count < 0 && errno != EINTR) break;
+
+        bool stdinIsReady = !stdinIsPollable;
+        for (int i = 0; i < count; ++i) {
+            if (events[i].data.fd == target.callbackFd) {
+                // Обработка входящих BLE-сообщений
+                target.processCallbacks();
+            } else if (events[i].data.fd == statsTimerFd) {
+                uint64_t expirations;
+                [[maybe_unused]] const auto r = read(statsTimerFd, &expirations, sizeof(expirations));
+                target.writeStatsJson(statsOut);
+            } else if (events[i].data.fd == renderer.getTimerFd()) {
+                renderer.render();
+            } else {
+                stdinIsReady = true;
+            }
+        }
+        if (!stdinIsReady) continue;
+
+        const ssize_t n = read(STDIN_FILENO, readBuffer, sizeof(readBuffer));
+        if (n == 0) break;
+        for (ssize_t i = 0; i < n; ++i) {
+            const char ch = readBuffer[i];
+            if (ch == '\n') {
+                // The typed line stays on screen; output so far goes above it
+                renderer.flush();
+                if (inputBuffer == "q") {
+                    quit = true;
+                    break;
+                }
+                if (inputBuffer == ":stats") {
+                    target.writeStats(std::cout);
+                    output_command_prompt();
+                } else if (!inputBuffer.empty()) {
+                    if (target.send(inputBuffer + "\n")) {
+                        output_command_prompt();
+                    }
+                }
+                inputBuffer.clear();
+            } else {
+                inputBuffer += ch;
+            }
+        }
+    }
+    close(epollFd);
+    if (statsTimerFd >= 0) close(statsTimerFd);
+}
+
+// Brings all robots up together and sends every typed command to each of them
+int run_fleet(const int argc, char* argv[], const std::vector<std::string>& names, const bool discover) {
+    BleUartFleet fleet;
+    const std::string cacheFile = get_arg_value(argc, argv, "--gatt-cache=");
+    if (!cacheFile.empty()) fleet.setCacheFile(cacheFile);
+    output_paired_devices(fleet.listPairedDevices());
+    if (names.empty()) return output_usage(argv);
+
+    TerminalRenderer renderer(STDOUT_FILENO, get_render_options(argc, argv));
+    const auto allConnected = [&fleet] {
+        for (const auto& alias : fleet.getAliases()) {
+            if (fleet.find(alias)->getState() != BleUartClient::State::Connected) return false;
+        }
+        return true;
+    };
+    fleet.setCallbacks(
+        [&](const std::string& deviceAlias, const std::string& connectedText, bool) {
+            renderer.status("✅", deviceAlias, connectedText);
+            renderer.status("⏱️", deviceAlias, format_connect_timings(fleet.find(deviceAlias)->getConnectTimings()));
+            // Discovery slows connections down, so it ends once every robot is there
+            if (fleet.isDiscovering() && allConnected()) fleet.stopDiscovery();
+        },
+        [&renderer](const std::string& deviceAlias, const std::string& disconnectedText, const bool isFailure) {
+            renderer.status(isFailure ? "❌" : "❎", deviceAlias, disconnectedText);
+        },
+        [](const std::string&, const BleUartClient::State&) {
+        },
+        [&renderer](const std::string& deviceAlias, const std::string& errorText, const std::string& sdbusErrorName,
+                    const BleUartClient::State&) {
+            renderer.status("❌", deviceAlias, sdbusErrorName.empty() ? errorText : str(errorText, " [", sdbusErrorName, "]"));
+        },
+        nullptr
+    );
+    fleet.setReceiveViewCallback([&renderer](const std::string& deviceAlias, const std::string_view receivedMessage) {
+        renderer.line(deviceAlias, receivedMessage);
+    });
+    const bool withoutResponse = has_flag_in_args(argc, argv, "--write-without-response");
+    for (const auto& name : names) {
+        BleUartClient& client = fleet.add(name);
+        if (withoutResponse) client.setWriteMode(BleUartClient::WriteMode::WithoutResponse);
+    }
+
+    std::cout << "\n🛜 Connecting to " << names.size() << (names.size() == 1 ? " robot" : " robots") << "..." << std::endl;
+    if (discover) {
+        try {
+            fleet.startDiscovery();
+            std::cout << "🔍 Looking for robots nearby" << std::endl;
+        } catch (const sdbus::Error& e) {
+            std::cout << "❌ Cannot start discovery: " << e.getMessage() << " [" << e.getName() << "]" << std::endl;
+        }
+    }
+    // Robots that are not there yet keep being retried, and tried at once when the discovery sees them
+    const auto startedAt = std::chrono::steady_clock::now();
+    fleet.connectAll(true);
+    fleet.processCallbacks();
+    size_t connected = 0;
+    for (const auto& alias : fleet.getAliases()) {
+        if (fleet.find(alias)->getState() == BleUartClient::State::Connected) ++connected;
+    }
+    renderer.flush();
+    std::cout << "🚀 " << connected << " of " << names.size() << " connected in "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startedAt).count()
+              << " ms" << std::endl;
+
+    // The latest command of each robot; commands are written in order
+    std::map<std::string, std::future<bool>> lastSends;
+    InteractiveTarget target;
+    target.callbackFd = fleet.getCallbackFd();
+    target.processCallbacks = [&fleet] { fleet.processCallbacks(); };
+    target.send = [&fleet, &lastSends](const std::string& command) {
+        bool queued = false;
+        for (const auto& alias : fleet.getAliases()) {
+            auto& lastSend = lastSends[alias];
+            lastSend = fleet.find(alias)->sendAsync(command);
+            queued |= lastSend.wait_for(std::chrono::seconds(0)) != std::future_status::ready || lastSend.get();
+        }
+        return queued;
+    };
+    target.writeStats = [&fleet](std::ostream& out) {
+        for (const auto& alias : fleet.getAliases()) {
+            out << "[" << alias << "]\n";
+            fleet.find(alias)->getMetrics().writeText(out);
+        }
+    };
+    target.writeStatsJson = [&fleet](std::ostream& out) {
+        for (const auto& alias : fleet.getAliases()) {
+            output_stats_json(out, alias, *fleet.find(alias));
+        }
+    };
+    run_interactive(argc, argv, renderer, target);
+
+    for (auto& [alias, lastSend] : lastSends) {
+        if (lastSend.valid()) lastSend.wait();
+    }
+    fleet.stopDiscovery();
+    fleet.disconnectAll();
+    fleet.processCallbacks();
+    renderer.setPrompt("");
+    renderer.flush();
+    std::cout << "\n";
+    return EXIT_SUCCESS;
+}
+
+int main(const int argc, char* argv[]) {
+    std::cout.setf(std::ios::unitbuf);  // автоматический flush
+
+    // Commands come from a script or a pipe instead of the keyboard; output is machine-readable then
+    const std::string scriptFile = get_arg_value(argc, argv, "--script=");
+    const bool batchMode = !scriptFile.empty() || !isatty(STDIN_FILENO);
+    // Shares the robot with local processes over a Unix socket instead of reading commands
+    const std::string bridgeSocket = get_arg_value(argc, argv, "--bridge=");
+
+    // Plays back a session recorded with --record, no robot needed
+    const std::string replayFile = get_arg_value(argc, argv, "--replay=");
+    if (!replayFile.empty()) {
+        SessionReader reader;
+        if (!reader.open(replayFile)) {
+            std::cerr << "Cannot read session log '" << replayFile << "'" << std::endl;
+            return EXIT_FAILURE;
+        }
+        const std::string speed = get_arg_value(argc, argv, "--replay-speed=");
+        const std::string at = get_arg_value(argc, argv, "--replay-from=");
+        std::string alias = get_robot_name_from_args(argc, argv);
+        if (alias.empty()) alias = "replay";
+        if (!at.empty()) reader.seek(std::chrono::milliseconds(std::atol(at.c_str())));
+        std::cout << "📼 " << reader.getRecordCount() << " records, "
+                  << std::chrono::duration_cast<std::chrono::milliseconds>(reader.getDuration()).count() << " ms" << std::endl;
+        reader.replay([](const std::string& deviceAlias, const std::string& receivedMessage) {
+            std::cout << "🤖 [" << deviceAlias << "]: " << receivedMessage << std::endl;
+        }, alias, speed == "max" ? 0.0 : speed.empty() ? 1.0 : std::atof(speed.c_str()));
+        return EXIT_SUCCESS;
+    }
+
+    // Several robots, or robots only a discovery finds, are brought up together through a fleet
+    const auto names = get_arg_values(argc, argv, "--robot-name=");
+    const bool discover = has_flag_in_args(argc, argv, "--discover");
+    if (names.size() > 1 || discover) {
+        if (batchMode || !bridgeSocket.empty()) {
+            std::cerr << "Several robots and --discover only work in the interactive terminal" << std::endl;
+            return EXIT_FAILURE;
+        }
+        return run_fleet(argc, argv, names, discover);
+    }
+
+    // Listing the devices through the transport also fills its cache, so the connect below needs no more scans
+    auto transport = std::make_unique<BluezTransport>();
+    const std::string cacheFile = get_arg_value(argc, argv, "--gatt-cache=");
+    if (!cacheFile.empty()) {
+        transport->setCacheFile(cacheFile);
+    }
+    if (!batchMode && bridgeSocket.empty()) {
+        output_paired_devices(transport->listPairedDevices());
+    }
 
     const std::string name = get_robot_name_from_args(argc, argv);
     // if (name.empty()) name = "BBC micro:bit";
-    if (name.empty()) {
-        const std::string execName = std::filesystem::path(argv[0]).filename().string();
-        std::cout << "\nUsage: " << execName << " --robot-name=\"<alias>\"" << std::endl;
-        return EXIT_FAILURE;
+    if (name.empty()) return output_usage(argv);
+
+    if (has_flag_in_args(argc, argv, "--socket-io")) {
+        transport->setIoMode(BluezTransport::IoMode::Socket);
+    }
+    BleUartClient client(std::move(transport));
+    const std::string recordFile = get_arg_value(argc, argv, "--record=");
+    if (!recordFile.empty()) {
+        auto recorder = std::make_shared<SessionRecorder>();
+        if (!recorder->open(recordFile)) {
+            std::cerr << "Cannot create session log '" << recordFile << "'" << std::endl;
+            return EXIT_FAILURE;
+        }
+        client.setRecorder(std::move(recorder));
+    }
+    if (has_flag_in_args(argc, argv, "--write-without-response")) {
+        client.setWriteMode(BleUartClient::WriteMode::WithoutResponse);
     }
 
-    BleUartClient client;
-    client.setCallbacks(
-        [](const std::string& deviceAlias, const std::string& connectedText, const bool afterFailure) {
-            const std::string prefix = str("[", deviceAlias, "]: ");
-            std::cout << "\r✅ " << prefix << connectedText << std::endl;
-            if (afterFailure || prompt_has_been_shown) {
-                output_command_prompt();
+    const bool binaryFraming = has_flag_in_args(argc, argv, "--binary-framing");
+    if (!bridgeSocket.empty()) {
+        LinkBridge::Options options;
+        options.socketPath = bridgeSocket;
+        options.tcpPort = static_cast<uint16_t>(std::atoi(get_arg_value(argc, argv, "--bridge-tcp=").c_str()));
+        const std::string maxBacklog = get_arg_value(argc, argv, "--bridge-max-backlog=");
+        if (!maxBacklog.empty()) options.maxBacklog = std::strtoul(maxBacklog.c_str(), nullptr, 10);
+        const std::string slowConsumers = get_arg_value(argc, argv, "--slow-consumers=");
+        if (slowConsumers == "drop") {
+            options.slowConsumerPolicy = LinkBridge::SlowConsumerPolicy::DropLines;
+        } else if (!slowConsumers.empty() && slowConsumers != "disconnect") {
+            std::cerr << "Invalid slow consumer policy '" << slowConsumers << "', expected drop or disconnect" << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        LinkBridge bridge(client, options);
+        if (!bridge.listen()) {
+            std::cerr << "Cannot listen on '" << bridgeSocket << "'"
+                      << (options.tcpPort != 0 ? str(" or port ", options.tcpPort) : "") << ": "
+                      << std::strerror(errno) << std::endl;
+            return EXIT_FAILURE;
+        }
+        running_bridge = &bridge;
+        std::signal(SIGINT, stop_bridge);
+        std::signal(SIGTERM, stop_bridge);
+        std::cout << "🔌 Bridging '" << name << "' on " << bridgeSocket
+                  << (options.tcpPort != 0 ? str(" and 127.0.0.1:", options.tcpPort) : "") << std::endl;
+        if (!client.connect(name, true)) {
+            return EXIT_FAILURE;
+        }
+        if (binaryFraming && client.getState() == BleUartClient::State::Connected) {
+            client.negotiateBinaryFraming();
+        }
+        bridge.run();
+        running_bridge = nullptr;
+        const auto stats = bridge.getStats();
+        std::cout << "🔌 Bridge stopped: " << stats.accepted << " subscribers served, " << stats.linesFannedOut
+                  << " lines fanned out, " << stats.commandsForwarded << " commands forwarded, "
+                  << stats.droppedLines << " lines dropped, " << stats.slowConsumersDisconnected
+                  << " slow subscribers disconnected" << std::endl;
+        client.disconnect();
+        return EXIT_SUCCESS;
+    }
+    if (batchMode) {
+        ScriptRunner::Options options;
+        options.binaryFraming = binaryFraming;
+        const std::string rate = get_arg_value(argc, argv, "--rate=");
+        if (!rate.empty()) {
+            options.rate = ScriptRunner::parseRate(rate);
+            if (options.rate <= 0.0) {
+                std::cerr << "Invalid rate '" << rate << "', expected e.g. --rate=200/s" << std::endl;
+                return EXIT_FAILURE;
             }
-        },
-        [](const std::string& deviceAlias, const std::string& disconnectedText, const bool isFailure) {
-            const std::string prefix = str("[", deviceAlias, "]: ");
-            if (isFailure) {
-                std::cout << "\r❌ " << prefix << disconnectedText << std::endl;
-                output_command_prompt();
-            } else {
-                std::cout << "\r❎ " << prefix << disconnectedText << std::endl;
+        }
+        const std::string replyTimeout = get_arg_value(argc, argv, "--reply-timeout=");
+        if (!replyTimeout.empty()) {
+            options.replyTimeout = std::chrono::milliseconds(std::atol(replyTimeout.c_str()));
+        }
+
+        std::ifstream script;
+        if (!scriptFile.empty()) {
+            script.open(scriptFile);
+            if (!script) {
+                std::cerr << "Cannot open script '" << scriptFile << "'" << std::endl;
+                return EXIT_FAILURE;
             }
+        }
+        ScriptRunner runner(client, name, options);
+        return runner.run(scriptFile.empty() ? std::cin : script) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    // Received lines are written in batches, and summarized when they come faster than anyone can read.
+    // The callbacks only run on this thread, in connect(), disconnect() and the loop's processCallbacks(),
+    // reconnects included, so they feed the renderer without locking.
+    TerminalRenderer renderer(STDOUT_FILENO, get_render_options(argc, argv));
+
+    client.setCallbacks(
+        [&renderer](const std::string& deviceAlias, const std::string& connectedText, bool) {
+            renderer.status("✅", deviceAlias, connectedText);
+        },
+        [&renderer](const std::string& deviceAlias, const std::string& disconnectedText, const bool isFailure) {
+            renderer.status(isFailure ? "❌" : "❎", deviceAlias, disconnectedText);
         },
         // [](const std::string& deviceAlias, const BleUartClient::State& state) {
         //     const std::string prefix = str("[", deviceAlias, "]: ");
@@ -71,72 +491,44 @@ int main(const int argc, char* argv[]) {
         // },
         [](const std::string&, const BleUartClient::State&) {
         },
-        [](const std::string& deviceAlias, const std::string& errorText, const std::string& sdbusErrorName, const BleUartClient::State& state) {
-            const std::string aliasNamePrefix = str("[", deviceAlias, "]: ");
-            const std::string errorNamePostfix = sdbusErrorName.empty() ? "" : str(" [", sdbusErrorName, "]");
-            std::cout << "\r❌ " << aliasNamePrefix << errorText << errorNamePostfix << std::endl;
-            if (state != BleUartClient::State::Disconnected) {
-                output_command_prompt();
-            }
+        [&renderer](const std::string& deviceAlias, const std::string& errorText, const std::string& sdbusErrorName,
+                    const BleUartClient::State&) {
+            renderer.status("❌", deviceAlias, sdbusErrorName.empty() ? errorText : str(errorText, " [", sdbusErrorName, "]"));
         },
-        [](const std::string& deviceAlias, const std::string& receivedMessage) {
-            const std::string prefix = str("[", deviceAlias, "]: ");
-            std::cout << "\r🤖 " << prefix << receivedMessage << std::endl;
-            output_command_prompt();
-        }
+        nullptr
     );
+    client.setReceiveViewCallback([&renderer](const std::string& deviceAlias, const std::string_view receivedMessage) {
+        renderer.line(deviceAlias, receivedMessage);
+    });
 
     std::cout << "\n🛜 Connecting to \'" << name << "\'..." << std::endl;
     const bool isConnected = client.connect(name, true);
     if (!isConnected) {
         return EXIT_FAILURE;
     }
-
-    prompt_has_been_shown = true;
-    std::cout << "\n💬 Type commands to send to robot. Type 'q' to quit." << std::endl;
-    output_command_prompt();
-
-    std::string inputBuffer;
-    // Настроим stdin в неблокирующий режим
-    const int flags = fcntl(STDIN_FILENO, F_GETFL, 0);
-    fcntl(STDIN_FILENO, F_SETFL, flags | O_NONBLOCK);
-    while (true) {
-        // Обработка входящих BLE-сообщений
-        client.processCallbacks();
-
-        // Проверка наличия ввода
-        fd_set readfds;
-        FD_ZERO(&readfds);
-        FD_SET(STDIN_FILENO, &readfds);
-
-        timeval timeout = { 0, 10000 };
-
-        const int ret = select(STDIN_FILENO + 1, &readfds, nullptr, nullptr, &timeout);
-        if (ret > 0 && FD_ISSET(STDIN_FILENO, &readfds)) {
-            char ch;
-            const ssize_t n = read(STDIN_FILENO, &ch, 1);
-            if (n > 0) {
-                if (ch == '\n') {
-                    if (inputBuffer == "q") {
-                        break;
-                    }
-                    if (!inputBuffer.empty()) {
-                        if (client.send(inputBuffer + "\n")) {
-                            output_command_prompt();
-                        }
-                    }
-                    inputBuffer.clear();
-                } else {
-                    inputBuffer += ch;
-                }
-            }
-        }
-
-        // небольшая задержка для снижения нагрузки на CPU
-        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    if (binaryFraming && client.getState() == BleUartClient::State::Connected) {
+        // Commands typed afterwards are still text, they are just wrapped into frames
+        std::cout << (client.negotiateBinaryFraming() ? "🔢 Binary framing is on" : "🔤 The robot only speaks text") << std::endl;
     }
 
+    std::future<bool> lastSend;
+    InteractiveTarget target;
+    target.callbackFd = client.getCallbackFd();
+    target.processCallbacks = [&client] { client.processCallbacks(); };
+    target.send = [&client, &lastSend](const std::string& command) {
+        // Queued without waiting, so that typing ahead and piped input never stall on the link
+        lastSend = client.sendAsync(command);
+        return lastSend.wait_for(std::chrono::seconds(0)) != std::future_status::ready || lastSend.get();
+    };
+    target.writeStats = [&client](std::ostream& out) { client.getMetrics().writeText(out); };
+    target.writeStatsJson = [&client, &name](std::ostream& out) { output_stats_json(out, name, client); };
+    run_interactive(argc, argv, renderer, target);
+
+    // Commands are written in order, so the last one being done means all of them are
+    if (lastSend.valid()) lastSend.wait();
     client.disconnect();
+    renderer.setPrompt("");
+    renderer.flush();
     std::cout << "\n";
     return EXIT_SUCCESS;
 }
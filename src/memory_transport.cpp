@@ -0,0 +1,131 @@
+#include "memory_transport.h"
+#include <algorithm>
+#include <thread>
+#include <sdbus-c++/Error.h>
+
+using namespace mimi;
+
+MemoryTransport::MemoryTransport(const LinkOptions& options, std::vector<PairedDevice> devices) :
+    devices_(std::move(devices)),
+    peer_([](MemoryTransport& transport, const std::string_view written) { transport.notify(written); }),
+    link_(options) {
+}
+
+MemoryTransport::~MemoryTransport() {
+    connected_ = false;
+}
+
+void MemoryTransport::setPeer(Peer peer) {
+    std::lock_guard lock(peerMutex_);
+    peer_ = std::move(peer);
+}
+
+bool MemoryTransport::notify(const std::string_view data) {
+    const size_t chunkSize = link_.getMaxPayloadSize();
+    bool delivered = true;
+    for (size_t offset = 0; offset < data.size(); offset += chunkSize) {
+        if (!connected_ || !notifying_) return false;
+        std::string chunk(data.substr(offset, chunkSize));
+        const bool sent = link_.deliver([this, chunk = std::move(chunk)]() mutable {
+            ++notifications_;
+            if (notifying_ && handlers_.received) handlers_.received(chunk.data(), chunk.size());
+        });
+        if (!sent) {
+            ++lostPackets_;
+            delivered = false;
+        }
+    }
+    return delivered;
+}
+
+void MemoryTransport::dropLink() {
+    inRange_ = false;
+    connected_ = false;
+    notifying_ = false;
+    link_.schedule(std::chrono::microseconds(0), [this] {
+        if (watching_ && handlers_.linkLost) handlers_.linkLost();
+    });
+}
+
+void MemoryTransport::restoreLink() {
+    inRange_ = true;
+    link_.schedule(std::chrono::microseconds(0), [this] {
+        if (watching_ && handlers_.linkAvailable) handlers_.linkAvailable();
+    });
+}
+
+void MemoryTransport::flush() {
+    link_.flush();
+}
+
+MemoryTransport::Counters MemoryTransport::getCounters() const {
+    return { writes_, writtenBytes_, notifications_, lostPackets_ };
+}
+
+std::vector<PairedDevice> MemoryTransport::listPairedDevices() {
+    return devices_;
+}
+
+void MemoryTransport::connectDevice(const PairedDevice& device) {
+    const bool known = std::any_of(devices_.begin(), devices_.end(), [&](const PairedDevice& d) {
+        return d.path == device.path;
+    });
+    if (!known) throw sdbus::Error("org.freedesktop.DBus.Error.UnknownObject", "Unknown device " + device.path);
+    std::this_thread::sleep_for(link_.getOptions().connectLatency);
+    if (!inRange_) throw sdbus::Error("org.bluez.Error.Failed", "le-connection-abort-by-local");
+    connected_ = true;
+}
+
+bool MemoryTransport::discoverCharacteristics() {
+    return connected_;
+}
+
+void MemoryTransport::startNotifications() {
+    if (!connected_) throw sdbus::Error("org.bluez.Error.NotConnected", "Not connected");
+    notifying_ = true;
+}
+
+void MemoryTransport::watchConnection() {
+    watching_ = true;
+}
+
+void MemoryTransport::write(const char* data, const size_t size, const bool withResponse) {
+    if (!connected_) throw sdbus::Error("org.bluez.Error.NotConnected", "Not connected");
+    if (size > link_.getMaxPayloadSize()) throw sdbus::Error("org.bluez.Error.InvalidValueLength", "Value exceeds the MTU");
+
+    const auto transmission = link_.transmit(size, [this, chunk = std::string(data, size)] {
+        std::lock_guard lock(peerMutex_);
+        if (peer_) peer_(*this, chunk);
+    });
+    // What BlueZ answers while the controller has no room for another packet
+    if (transmission == LinkSimulator::Transmission::Busy) throw sdbus::Error("org.bluez.Error.InProgress", "In Progress");
+    ++writes_;
+    writtenBytes_ += size;
+    const bool sent = transmission == LinkSimulator::Transmission::Sent;
+    if (!sent) ++lostPackets_;
+
+    if (withResponse) {
+        if (!sent) throw sdbus::Error("org.bluez.Error.Failed", "Write was not acknowledged");
+        // Wait for the write to arrive and for the acknowledgement to travel back
+        link_.flush();
+        std::this_thread::sleep_for(link_.getOptions().latency);
+    }
+}
+
+void MemoryTransport::disconnectDevice() {
+    connected_ = false;
+    notifying_ = false;
+    watching_ = false;
+}
+
+bool MemoryTransport::isReady() const {
+    return connected_;
+}
+
+size_t MemoryTransport::getMaxWriteSize() const {
+    return link_.getMaxPayloadSize();
+}
+
+bool MemoryTransport::supportsWriteWithResponse() const {
+    return true;
+}
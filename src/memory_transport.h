@@ -0,0 +1,70 @@
+#ifndef MEMORY_TRANSPORT_H
+#define MEMORY_TRANSPORT_H
+
+#include "gatt_transport.h"
+#include "link_simulator.h"
+#include <atomic>
+#include <mutex>
+#include <string_view>
+
+namespace mimi {
+
+// In-process stand-in for a robot behind BlueZ. Writes go to a peer function on the link thread;
+// by default the peer echoes everything back as notifications, like a loopback UART.
+class MemoryTransport : public GattTransport {
+public:
+    using Peer = std::function<void(MemoryTransport& transport, std::string_view written)>;
+
+    struct Counters {
+        uint64_t writes;
+        uint64_t writtenBytes;
+        uint64_t notifications;
+        uint64_t lostPackets;
+    };
+
+    explicit MemoryTransport(const LinkOptions& options = {},
+                             std::vector<PairedDevice> devices = { { "Mimi", "00:00:00:00:00:01", "/memory/dev_00_00_00_00_00_01" } });
+    ~MemoryTransport() override;
+
+    void setPeer(Peer peer);
+    // Sends data from the simulated robot, split into MTU-sized notifications
+    bool notify(std::string_view data);
+    // Simulates the robot going out of range; connects fail until restoreLink()
+    void dropLink();
+    // Simulates the robot coming back into range and advertising again
+    void restoreLink();
+    // Waits until all packets sent so far have been delivered
+    void flush();
+    [[nodiscard]] Counters getCounters() const;
+
+    std::vector<PairedDevice> listPairedDevices() override;
+    void connectDevice(const PairedDevice& device) override;
+    bool discoverCharacteristics() override;
+    void startNotifications() override;
+    void watchConnection() override;
+    void write(const char* data, size_t size, bool withResponse) override;
+    void disconnectDevice() override;
+
+    [[nodiscard]] bool isReady() const override;
+    [[nodiscard]] size_t getMaxWriteSize() const override;
+    [[nodiscard]] bool supportsWriteWithResponse() const override;
+
+private:
+    const std::vector<PairedDevice> devices_;
+    std::mutex peerMutex_;
+    Peer peer_;
+    std::atomic<bool> inRange_ = true;
+    std::atomic<bool> connected_ = false;
+    std::atomic<bool> notifying_ = false;
+    std::atomic<bool> watching_ = false;
+    std::atomic<uint64_t> writes_ = 0;
+    std::atomic<uint64_t> writtenBytes_ = 0;
+    std::atomic<uint64_t> notifications_ = 0;
+    std::atomic<uint64_t> lostPackets_ = 0;
+    // Destroyed first, so that no packet is delivered into a half-destroyed transport
+    LinkSimulator link_;
+};
+
+} // namespace mimi
+
+#endif //MEMORY_TRANSPORT_H
@@ -0,0 +1,237 @@
+// ReSharper disable CppTooWideScopeInitStatement
+#include "script_runner.h"
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+using namespace mimi;
+
+namespace {
+    using Clock = std::chrono::steady_clock;
+
+    double toMicroseconds(const std::chrono::nanoseconds duration) {
+        return static_cast<double>(duration.count()) / 1000.0;
+    }
+
+    std::string latencyLine(const char* stage, const LatencyHistogram& histogram) {
+        return str(std::fixed, std::setprecision(1), "latency\tstage=", stage, "\tcount=", histogram.count(),
+                   "\tp50_us=", toMicroseconds(histogram.percentile(50)),
+                   "\tp99_us=", toMicroseconds(histogram.percentile(99)),
+                   "\tmax_us=", toMicroseconds(histogram.max()));
+    }
+}
+
+double ScriptRunner::parseRate(const std::string& text) {
+    char* end = nullptr;
+    const double count = std::strtod(text.c_str(), &end);
+    if (end == text.c_str() || count <= 0.0) return 0.0;
+    const std::string unit = end;
+    if (unit.empty() || unit == "/s") return count;
+    if (unit == "/min") return count / 60.0;
+    return 0.0;
+}
+
+ScriptRunner::ScriptRunner(BleUartClient& client, std::string alias, const Options& options) :
+    client_(client),
+    alias_(std::move(alias)),
+    options_(options) {
+    setCallbacks();
+}
+
+ScriptRunner::~ScriptRunner() {
+    stopPump();
+}
+
+void ScriptRunner::setCallbacks() {
+    client_.setCallbacks(
+        [this](const std::string& deviceAlias, const std::string&, const bool afterFailure) {
+            output(str("connected\trobot=", deviceAlias, "\treconnect=", afterFailure ? 1 : 0));
+        },
+        [this](const std::string& deviceAlias, const std::string&, const bool isFailure) {
+            output(str("disconnected\trobot=", deviceAlias, "\tfailure=", isFailure ? 1 : 0));
+        },
+        [](const std::string&, const BleUartClient::State&) {
+        },
+        [this](const std::string& deviceAlias, const std::string& errorText, const std::string& sdbusErrorName,
+               const BleUartClient::State&) {
+            output(str("error\trobot=", deviceAlias, "\tname=", sdbusErrorName, "\ttext=", errorText));
+        },
+        [this](const std::string& deviceAlias, const std::string& receivedMessage) {
+            output(str("rx\trobot=", deviceAlias, "\ttext=", receivedMessage));
+        }
+    );
+}
+
+bool ScriptRunner::run(std::istream& script) {
+    // connect() and disconnect() dispatch the callbacks themselves, so the pump only runs in between,
+    // and every line comes out in the order of the events
+    client_.connect(alias_, true);
+    if (client_.getState() != BleUartClient::State::Connected) {
+        output(str("summary\tconnected=0"));
+        return false;
+    }
+    startPump();
+    if (options_.binaryFraming) {
+        const bool binary = client_.negotiateBinaryFraming(options_.replyTimeout);
+        output(str("framing\tmode=", binary ? "binary" : "text"));
+    }
+
+    const auto start = Clock::now();
+    // Pacing restarts after every pause, so that a delay is not made up for with a burst
+    auto paceStart = start;
+    size_t paced = 0;
+    std::string expectedPrefix;
+    bool expecting = false;
+    std::string line;
+    size_t lineNumber = 0;
+    while (std::getline(script, line)) {
+        ++lineNumber;
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty() || line[0] == '#') continue;
+        if (line == "q") break;
+
+        if (line[0] == ':') {
+            std::istringstream directive(line.substr(1));
+            std::string name;
+            directive >> name;
+            if (name == "delay") {
+                long milliseconds = -1;
+                directive >> milliseconds;
+                if (milliseconds < 0) {
+                    ++scriptErrors_;
+                    output(str("script_error\tline=", lineNumber, "\ttext=", line));
+                    continue;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(milliseconds));
+            } else if (name == "expect") {
+                std::getline(directive >> std::ws, expectedPrefix);
+                expecting = true;
+                continue;
+            } else if (name == "sync") {
+                collectSends(true);
+            } else if (name == "stats") {
+                std::ostringstream json;
+                client_.getMetrics().writeJson(json);
+                output(str("stats\tjson=", json.str()));
+            } else {
+                ++scriptErrors_;
+                output(str("script_error\tline=", lineNumber, "\ttext=", line));
+                continue;
+            }
+            paceStart = Clock::now();
+            paced = 0;
+            continue;
+        }
+
+        if (options_.rate > 0.0) {
+            std::this_thread::sleep_until(paceStart + std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<double>(static_cast<double>(paced) / options_.rate)));
+            ++paced;
+        }
+        if (expecting) {
+            request(lineNumber, line, expectedPrefix);
+            expecting = false;
+            paceStart = Clock::now();
+            paced = 0;
+        } else {
+            send(lineNumber, line);
+        }
+    }
+
+    collectSends(true);
+    const auto elapsed = Clock::now() - start;
+    stopPump();
+    client_.disconnect();
+    outputSummary(elapsed);
+    return failedCommands_ == 0 && missedReplies_ == 0 && scriptErrors_ == 0;
+}
+
+void ScriptRunner::send(const size_t lineNumber, const std::string& command) {
+    ++commands_;
+    // Blocks while the send queue is full, which is the as-fast-as-possible pace
+    pendingSends_.emplace_back(lineNumber, client_.sendAsync(command + "\n"));
+    collectSends(false);
+}
+
+void ScriptRunner::request(const size_t lineNumber, const std::string& command, const std::string& expectedPrefix) {
+    ++commands_;
+    auto pending = client_.request(command + "\n", [expectedPrefix](const std::string_view line) {
+        return line.substr(0, expectedPrefix.size()) == expectedPrefix;
+    }, options_.replyTimeout);
+    const auto reply = pending.reply.get();
+    if (reply.status == BleUartClient::RequestStatus::Replied) {
+        ++replies_;
+    } else {
+        ++missedReplies_;
+        if (reply.status == BleUartClient::RequestStatus::SendFailed) ++failedCommands_;
+    }
+    output(str("reply\tline=", lineNumber, "\tstatus=", BleUartClient::requestStatusToString(reply.status),
+               "\trtt_us=", reply.roundTripTime.count(), "\ttext=", reply.line));
+}
+
+void ScriptRunner::collectSends(const bool wait) {
+    while (!pendingSends_.empty()) {
+        auto& [lineNumber, written] = pendingSends_.front();
+        if (!wait && written.wait_for(std::chrono::seconds(0)) != std::future_status::ready) return;
+        if (!written.get()) {
+            ++failedCommands_;
+            output(str("send_failed\tline=", lineNumber));
+        }
+        pendingSends_.pop_front();
+    }
+}
+
+void ScriptRunner::outputSummary(const std::chrono::duration<double> elapsed) {
+    const auto& metrics = client_.getMetrics();
+    output(str(std::fixed, std::setprecision(3), "summary\tconnected=1\tcommands=", commands_,
+               "\tfailed=", failedCommands_, "\treplies=", replies_, "\tmissed_replies=", missedReplies_,
+               "\tscript_errors=", scriptErrors_, "\telapsed_s=", elapsed.count(),
+               "\tcommands_per_s=", elapsed.count() > 0.0 ? static_cast<double>(commands_) / elapsed.count() : 0.0,
+               "\tbytes_sent=", metrics.bytesSent.load(), "\twrites=", metrics.writes.load()));
+    output(latencyLine("send_to_write", metrics.sendToWrite));
+    output(latencyLine("write", metrics.write));
+    output(latencyLine("round_trip", metrics.roundTrip));
+}
+
+void ScriptRunner::output(const std::string& line) {
+    std::lock_guard lock(outputMutex_);
+    std::cout << line << '\n' << std::flush;
+}
+
+void ScriptRunner::startPump() {
+    if (pumpThread_.joinable()) return;
+    stopFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pumpThread_ = std::thread([this] {
+        const int epollFd = epoll_create1(EPOLL_CLOEXEC);
+        epoll_event event {};
+        event.events = EPOLLIN;
+        event.data.fd = client_.getCallbackFd();
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, client_.getCallbackFd(), &event);
+        event.data.fd = stopFd_;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, stopFd_, &event);
+
+        bool stopping = false;
+        while (!stopping) {
+            epoll_event events[2];
+            const int count = epoll_wait(epollFd, events, 2, -1);
+            for (int i = 0; i < count; ++i) {
+                if (events[i].data.fd == stopFd_) stopping = true;
+            }
+            client_.processCallbacks();
+        }
+        close(epollFd);
+    });
+}
+
+void ScriptRunner::stopPump() {
+    if (!pumpThread_.joinable()) return;
+    constexpr uint64_t signal = 1;
+    [[maybe_unused]] const auto n = write(stopFd_, &signal, sizeof(signal));
+    pumpThread_.join();
+    close(stopFd_);
+    stopFd_ = -1;
+}
@@ -0,0 +1,79 @@
+#ifndef SCRIPT_RUNNER_H
+#define SCRIPT_RUNNER_H
+
+#include "ble_uart_client.h"
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <future>
+#include <istream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+namespace mimi {
+
+// Sends the commands of a script file or a pipe without the interactive prompt, for robot routines and load tests.
+// Every line of the script is a command, except for blank lines, '#' comments and these directives:
+//   :delay <ms>        pause before the next line
+//   :expect <prefix>   send the next command as a request and wait for a reply starting with <prefix>
+//   :sync              wait until everything sent so far has been written
+//   :stats             print the client's metrics
+//   q                  stop reading the script
+// Output is one line per event on stdout: a kind followed by tab-separated key=value fields, free text last.
+class ScriptRunner {
+public:
+    struct Options {
+        // Commands per second; zero sends as fast as the send queue takes them
+        double rate = 0.0;
+        std::chrono::milliseconds replyTimeout = BleUartClient::DefaultRequestTimeout;
+        // Tries to switch the connection to binary frames before the first command
+        bool binaryFraming = false;
+    };
+
+    // Accepts "200/s", "600/min" or a plain number of commands per second; returns 0 for anything else
+    static double parseRate(const std::string& text);
+
+    // Replaces the client's callbacks with ones printing machine-readable lines
+    ScriptRunner(BleUartClient& client, std::string alias, const Options& options);
+    ~ScriptRunner();
+    ScriptRunner(const ScriptRunner&) = delete;
+    ScriptRunner& operator=(const ScriptRunner&) = delete;
+
+    // Connects, runs the script, disconnects and prints a summary.
+    // Returns true if every command was written and every expected reply arrived.
+    bool run(std::istream& script);
+
+private:
+    BleUartClient& client_;
+    std::string alias_;
+    Options options_;
+
+    // While the script runs, callbacks are processed on a thread of their own, so that a script blocked
+    // on reading or pacing never holds received lines back
+    std::thread pumpThread_;
+    int stopFd_ = -1;
+    std::mutex outputMutex_;
+
+    // Writes complete in order, so only the front of the queue is ever checked
+    std::deque<std::pair<size_t, std::future<bool>>> pendingSends_;
+    size_t commands_ = 0;
+    size_t failedCommands_ = 0;
+    size_t replies_ = 0;
+    size_t missedReplies_ = 0;
+    size_t scriptErrors_ = 0;
+
+    void setCallbacks();
+    void startPump();
+    void stopPump();
+    void output(const std::string& line);
+    void send(size_t lineNumber, const std::string& command);
+    void request(size_t lineNumber, const std::string& command, const std::string& expectedPrefix);
+    void collectSends(bool wait);
+    void outputSummary(std::chrono::duration<double> elapsed);
+};
+
+} // namespace mimi
+
+#endif //SCRIPT_RUNNER_H
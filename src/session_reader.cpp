@@ -0,0 +1,203 @@
+// ReSharper disable CppTooWideScopeInitStatement
+#include "session_reader.h"
+#include "binary_framer.h"
+#include "line_framer.h"
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace mimi;
+
+namespace {
+    template<typename T>
+    T get(const char* in) {
+        T value;
+        std::memcpy(&value, in, sizeof(value));
+        return value;
+    }
+}
+
+SessionReader::~SessionReader() {
+    close();
+}
+
+bool SessionReader::open(const std::string& filePath) {
+    close();
+    const int fd = ::open(filePath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    struct stat status {};
+    if (fstat(fd, &status) != 0 || static_cast<size_t>(status.st_size) < SessionRecorder::FileHeaderSize) {
+        ::close(fd);
+        return false;
+    }
+    mappedSize_ = static_cast<size_t>(status.st_size);
+    void* mapping = mmap(nullptr, mappedSize_, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping keeps the file open on its own
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+        mappedSize_ = 0;
+        return false;
+    }
+    data_ = static_cast<const char*>(mapping);
+
+    headerSize_ = get<uint32_t>(data_ + 12);
+    if (std::memcmp(data_, SessionRecorder::Magic, sizeof(SessionRecorder::Magic)) != 0 ||
+        get<uint32_t>(data_ + 8) == 0 || get<uint32_t>(data_ + 8) > SessionRecorder::Version ||
+        headerSize_ < SessionRecorder::FileHeaderSize || headerSize_ > mappedSize_) {
+        close();
+        return false;
+    }
+    startTime_ = std::chrono::system_clock::time_point(std::chrono::duration_cast<std::chrono::system_clock::duration>(
+        std::chrono::nanoseconds(get<int64_t>(data_ + 16))));
+
+    // Only the record headers are touched, and the kernel is told so, for captures larger than the page cache
+    madvise(mapping, mappedSize_, MADV_SEQUENTIAL);
+    size_ = mappedSize_;
+    Record record {};
+    size_t offset = headerSize_;
+    size_t nextOffset;
+    while (readRecord(offset, record, nextOffset)) {
+        if (recordCount_ % IndexInterval == 0) index_.push_back({ record.time.count(), offset });
+        if (record.type == SessionRecorder::RecordType::Source) sourceAliases_[record.source] = record.data;
+        if (record.type == SessionRecorder::RecordType::Framing || record.type == SessionRecorder::RecordType::State) {
+            framingChanges_.push_back({ offset, record.source, record.type == SessionRecorder::RecordType::Framing });
+        }
+        ++recordCount_;
+        lastTime_ = record.time;
+        offset = nextOffset;
+    }
+    size_ = offset;
+    madvise(mapping, mappedSize_, MADV_NORMAL);
+    position_ = headerSize_;
+    return true;
+}
+
+void SessionReader::close() {
+    if (data_ != nullptr) munmap(const_cast<char*>(data_), mappedSize_);
+    data_ = nullptr;
+    size_ = 0;
+    mappedSize_ = 0;
+    headerSize_ = 0;
+    position_ = 0;
+    recordCount_ = 0;
+    lastTime_ = std::chrono::nanoseconds(0);
+    index_.clear();
+    sourceAliases_.clear();
+    framingChanges_.clear();
+}
+
+void SessionReader::seek(const std::chrono::nanoseconds time) {
+    // The last indexed record before the time, then record by record from there
+    auto it = std::upper_bound(index_.begin(), index_.end(), time.count(),
+                               [](const int64_t value, const IndexEntry& entry) { return value <= entry.time; });
+    position_ = it == index_.begin() ? headerSize_ : std::prev(it)->offset;
+    Record record {};
+    size_t nextOffset;
+    while (readRecord(position_, record, nextOffset) && record.time < time) {
+        position_ = nextOffset;
+    }
+}
+
+bool SessionReader::next(Record& record) {
+    size_t nextOffset;
+    if (!readRecord(position_, record, nextOffset)) return false;
+    position_ = nextOffset;
+    return true;
+}
+
+std::string SessionReader::getSourceAlias(const uint16_t source) const {
+    const auto it = sourceAliases_.find(source);
+    return it != sourceAliases_.end() ? it->second : std::string();
+}
+
+size_t SessionReader::replay(const BleUartClient::ReceiveCallback& receiveCallback, const std::string& deviceAlias,
+                             const double speed) {
+    // What the client of one source was receiving
+    struct Stream {
+        std::string alias;
+        LineFramer lineFramer;
+        BinaryFramer binaryFramer;
+        bool binary = false;
+    };
+
+    size_t lines = 0;
+    // Fragments of different robots sharing the log never make up one line
+    std::map<uint16_t, Stream> streams;
+    const auto streamOf = [&](const uint16_t source) -> Stream& {
+        auto [it, added] = streams.try_emplace(source);
+        Stream& stream = it->second;
+        if (added) {
+            stream.alias = getSourceAlias(source);
+            if (stream.alias.empty()) stream.alias = deviceAlias;
+            const auto handleLine = [&lines, &receiveCallback, &stream](const std::string_view line) {
+                ++lines;
+                if (receiveCallback) receiveCallback(stream.alias, std::string(line));
+            };
+            stream.lineFramer.setHandlers(handleLine, [](size_t) {});
+            stream.binaryFramer.setHandlers(handleLine, [](BinaryFramer::FrameError) {});
+        }
+        return stream;
+    };
+    // The framing each source was in where the replay starts
+    for (const auto& change : framingChanges_) {
+        if (change.offset >= position_) break;
+        streamOf(change.source).binary = change.binary;
+    }
+
+    std::string fragment;
+    Record record {};
+    bool started = false;
+    std::chrono::steady_clock::time_point replayStart;
+    std::chrono::nanoseconds sessionStart { 0 };
+    while (next(record)) {
+        if (record.type == SessionRecorder::RecordType::State) {
+            // Lines never continue across a reconnect, and the robot starts every connection in text mode
+            Stream& stream = streamOf(record.source);
+            stream.lineFramer.reset();
+            stream.binaryFramer.reset();
+            stream.binary = false;
+            continue;
+        }
+        if (record.type == SessionRecorder::RecordType::Framing) {
+            streamOf(record.source).binary = true;
+            continue;
+        }
+        if (record.type != SessionRecorder::RecordType::Rx) continue;
+        if (speed > 0.0) {
+            if (!started) {
+                started = true;
+                replayStart = std::chrono::steady_clock::now();
+                sessionStart = record.time;
+            }
+            const auto due = std::chrono::duration_cast<std::chrono::nanoseconds>((record.time - sessionStart) / speed);
+            std::this_thread::sleep_until(replayStart + due);
+        }
+        Stream& stream = streamOf(record.source);
+        if (stream.binary) {
+            stream.binaryFramer.feed(record.data.data(), record.data.size());
+            continue;
+        }
+        // The line framer works in place and the mapping is read-only
+        fragment.assign(record.data);
+        stream.lineFramer.feed(fragment.data(), fragment.size());
+    }
+    return lines;
+}
+
+bool SessionReader::readRecord(const size_t offset, Record& record, size_t& nextOffset) const {
+    if (data_ == nullptr || offset + SessionRecorder::RecordHeaderSize > size_) return false;
+    const char* header = data_ + offset;
+    const auto payloadSize = get<uint32_t>(header + 8);
+    if (payloadSize > size_ - offset - SessionRecorder::RecordHeaderSize) return false;
+    record.time = std::chrono::nanoseconds(get<int64_t>(header));
+    record.type = static_cast<SessionRecorder::RecordType>(get<uint8_t>(header + 12));
+    record.source = get<uint16_t>(header + 14);
+    record.data = std::string_view(header + SessionRecorder::RecordHeaderSize, payloadSize);
+    nextOffset = offset + SessionRecorder::RecordHeaderSize + payloadSize;
+    return true;
+}
@@ -0,0 +1,91 @@
+#ifndef SESSION_READER_H
+#define SESSION_READER_H
+
+#include "ble_uart_client.h"
+#include "session_recorder.h"
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace mimi {
+
+// Reads a log written by SessionRecorder through a read-only memory mapping, so that captures of hundreds
+// of megabytes are neither copied nor loaded up front. Opening walks the record headers once and keeps the
+// position of every IndexInterval-th record for seeking by time. A record cut short by a crash ends the session.
+class SessionReader {
+public:
+    struct Record {
+        SessionRecorder::RecordType type;
+        // Since the recorder was opened
+        std::chrono::nanoseconds time;
+        uint16_t source;
+        // Points into the mapping; valid until the reader is closed
+        std::string_view data;
+    };
+
+    static constexpr size_t IndexInterval = 1024;
+
+    SessionReader() = default;
+    ~SessionReader();
+    SessionReader(const SessionReader&) = delete;
+    SessionReader& operator=(const SessionReader&) = delete;
+
+    // Returns false if the file cannot be mapped or is not a session log
+    bool open(const std::string& filePath);
+    void close();
+
+    [[nodiscard]] size_t getRecordCount() const { return recordCount_; }
+    [[nodiscard]] std::chrono::nanoseconds getDuration() const { return lastTime_; }
+    [[nodiscard]] std::chrono::system_clock::time_point getStartTime() const { return startTime_; }
+
+    // Moves to the first record at or after the time
+    void seek(std::chrono::nanoseconds time);
+    void rewind() { position_ = headerSize_; }
+    // Returns false at the end of the session
+    bool next(Record& record);
+
+    // The alias named by the Source records of the session, empty for a source never named
+    [[nodiscard]] std::string getSourceAlias(uint16_t source) const;
+
+    // Passes the received lines from the current position on to the callback, paced like the original
+    // session divided by speed; a speed of 0 replays as fast as possible. Returns the number of lines.
+    // Every source is framed on its own and reported under its alias, or deviceAlias if it has none.
+    // After a Framing record the payloads of the source's binary frames are passed on as lines.
+    size_t replay(const BleUartClient::ReceiveCallback& receiveCallback, const std::string& deviceAlias, double speed = 1.0);
+
+private:
+    struct IndexEntry {
+        int64_t time;
+        size_t offset;
+    };
+
+    // A Framing or State record, for a replay that starts after it
+    struct FramingChange {
+        size_t offset;
+        uint16_t source;
+        bool binary;
+    };
+
+    const char* data_ = nullptr;
+    // Up to the end of the last complete record
+    size_t size_ = 0;
+    size_t mappedSize_ = 0;
+    size_t headerSize_ = 0;
+    size_t position_ = 0;
+    size_t recordCount_ = 0;
+    std::chrono::nanoseconds lastTime_ { 0 };
+    std::chrono::system_clock::time_point startTime_;
+    std::vector<IndexEntry> index_;
+    // Source records are read up front, so that a replay started past them still knows every alias
+    std::map<uint16_t, std::string> sourceAliases_;
+    std::vector<FramingChange> framingChanges_;
+
+    bool readRecord(size_t offset, Record& record, size_t& nextOffset) const;
+};
+
+} // namespace mimi
+
+#endif //SESSION_READER_H
@@ -0,0 +1,159 @@
+#include "session_recorder.h"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace mimi;
+
+namespace {
+    // The format is little-endian, like every platform BlueZ runs on
+    template<typename T>
+    char* put(char* out, const T value) {
+        std::memcpy(out, &value, sizeof(value));
+        return out + sizeof(value);
+    }
+}
+
+SessionRecorder::SessionRecorder(const size_t bufferSize) :
+    bufferSize_(bufferSize) {
+    active_.reserve(bufferSize_);
+    flushing_.reserve(bufferSize_);
+}
+
+SessionRecorder::~SessionRecorder() {
+    close();
+}
+
+bool SessionRecorder::open(const std::string& filePath) {
+    close();
+    const int fd = ::open(filePath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+
+    char header[FileHeaderSize] {};
+    char* out = header;
+    std::memcpy(out, Magic, sizeof(Magic));
+    out += sizeof(Magic);
+    out = put(out, Version);
+    out = put(out, static_cast<uint32_t>(FileHeaderSize));
+    put(out, static_cast<int64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count()));
+
+    std::lock_guard lock(mutex_);
+    fd_ = fd;
+    if (!writeAll(header, sizeof(header))) {
+        ::close(fd_);
+        fd_ = -1;
+        return false;
+    }
+    openedAt_ = std::chrono::steady_clock::now();
+    stats_ = {};
+    active_.clear();
+    activeRecords_ = 0;
+    stopping_ = false;
+    writerThread_ = std::thread([this] { writerLoop(); });
+    return true;
+}
+
+void SessionRecorder::close() {
+    {
+        std::lock_guard lock(mutex_);
+        if (fd_ < 0) return;
+        stopping_ = true;
+    }
+    writerWakeup_.notify_one();
+    if (writerThread_.joinable()) writerThread_.join();
+    std::lock_guard lock(mutex_);
+    ::close(fd_);
+    fd_ = -1;
+}
+
+bool SessionRecorder::isOpen() const {
+    std::lock_guard lock(mutex_);
+    return fd_ >= 0;
+}
+
+uint16_t SessionRecorder::addSource() {
+    std::lock_guard lock(mutex_);
+    return ++lastSource_;
+}
+
+void SessionRecorder::record(const RecordType type, const char* data, const size_t size, const uint16_t source) {
+    const size_t recordSize = RecordHeaderSize + size;
+    bool wakeWriter;
+    {
+        std::lock_guard lock(mutex_);
+        if (fd_ < 0 || stopping_) return;
+        if (stats_.writeError != 0) {
+            ++stats_.records;
+            ++stats_.lostRecords;
+            return;
+        }
+        if (active_.size() + recordSize > bufferSize_) {
+            ++stats_.droppedRecords;
+            return;
+        }
+        // Taken under the lock, so that times never go backwards in the file
+        const auto time = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - openedAt_);
+        const size_t offset = active_.size();
+        active_.resize(offset + recordSize);
+        char* out = active_.data() + offset;
+        out = put(out, static_cast<int64_t>(time.count()));
+        out = put(out, static_cast<uint32_t>(size));
+        out = put(out, static_cast<uint8_t>(type));
+        out = put(out, static_cast<uint8_t>(0));
+        out = put(out, source);
+        if (size > 0) std::memcpy(out, data, size);
+        ++stats_.records;
+        ++activeRecords_;
+        stats_.bytes += recordSize;
+        // The writer flushes on its own every FlushInterval; it is only hurried along when the buffer fills up
+        wakeWriter = offset < bufferSize_ / 2 && active_.size() >= bufferSize_ / 2;
+    }
+    if (wakeWriter) writerWakeup_.notify_one();
+}
+
+SessionRecorder::Stats SessionRecorder::getStats() const {
+    std::lock_guard lock(mutex_);
+    return stats_;
+}
+
+void SessionRecorder::writerLoop() {
+    std::unique_lock lock(mutex_);
+    while (true) {
+        writerWakeup_.wait_for(lock, FlushInterval, [this] { return stopping_ || active_.size() >= bufferSize_ / 2; });
+        const bool stopping = stopping_;
+        if (!active_.empty()) {
+            std::swap(active_, flushing_);
+            const uint64_t flushingRecords = activeRecords_;
+            activeRecords_ = 0;
+            ++stats_.flushes;
+            lock.unlock();
+            // Nothing is appended after a failed write, which may have left a record cut short
+            const bool written = writeAll(flushing_.data(), flushing_.size());
+            const int error = errno;
+            flushing_.clear();
+            lock.lock();
+            if (!written) {
+                stats_.writeError = error;
+                stats_.lostRecords += flushingRecords + activeRecords_;
+                active_.clear();
+                activeRecords_ = 0;
+            }
+        }
+        if (stopping) return;
+    }
+}
+
+bool SessionRecorder::writeAll(const char* data, size_t size) const {
+    while (size > 0) {
+        const ssize_t written = ::write(fd_, data, size);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += written;
+        size -= static_cast<size_t>(written);
+    }
+    return true;
+}
@@ -0,0 +1,104 @@
+#ifndef SESSION_RECORDER_H
+#define SESSION_RECORDER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace mimi {
+
+// Appends everything that goes over the wire to a compact binary log.
+// The file starts with a header and is followed by records of a 16-byte header and the payload:
+//   header:  "MIMIREC\0", uint32 version, uint32 header size, int64 wall clock at open (ns since the epoch)
+//   record:  int64 monotonic time since open (ns), uint32 payload size, uint8 type, 1 reserved byte,
+//            uint16 source, payload
+// Several clients may share a recorder: each gets a source id from addSource() and names it with a Source record.
+// All numbers are little-endian. Records are buffered in memory and written by a thread of the recorder,
+// so record() never waits for the disk; when the disk cannot keep up, records are dropped and counted.
+// A failed write ends the recording: the file stops at the failure and later records are counted as lost.
+class SessionRecorder {
+public:
+    enum class RecordType : uint8_t {
+        // A chunk as written to the TX characteristic
+        Tx = 1,
+        // A notification as received from the RX characteristic, before line framing
+        Rx = 2,
+        // The name of the new connection state
+        State = 3,
+        Error = 4,
+        // The alias of the robot behind the record's source
+        Source = 5,
+        // "binary" once the receive direction switched to binary frames, until the next State record.
+        // A notification carrying the accepted handshake reply is recorded as two Rx records around it.
+        Framing = 6,
+    };
+
+    struct Stats {
+        uint64_t records;
+        uint64_t bytes;
+        uint64_t droppedRecords;
+        uint64_t flushes;
+        // In the write that failed and after it; included in records
+        uint64_t lostRecords;
+        // errno of the write that failed, zero while writing succeeds
+        int writeError;
+    };
+
+    static constexpr char Magic[8] = { 'M', 'I', 'M', 'I', 'R', 'E', 'C', '\0' };
+    // Version 1 had no source; its records, whose reserved bytes are zero, read as source 0
+    static constexpr uint32_t Version = 2;
+    static constexpr size_t FileHeaderSize = 24;
+    static constexpr size_t RecordHeaderSize = 16;
+    static constexpr size_t DefaultBufferSize = 4 * 1024 * 1024;
+    static constexpr std::chrono::milliseconds FlushInterval { 200 };
+
+    explicit SessionRecorder(size_t bufferSize = DefaultBufferSize);
+    ~SessionRecorder();
+    SessionRecorder(const SessionRecorder&) = delete;
+    SessionRecorder& operator=(const SessionRecorder&) = delete;
+
+    // Truncates the file and starts a new session; returns false if it cannot be created
+    bool open(const std::string& filePath);
+    // Writes out everything recorded so far and closes the file
+    void close();
+    [[nodiscard]] bool isOpen() const;
+
+    // A source id for one more client, never 0; safe to call from any thread
+    uint16_t addSource();
+
+    // Safe to call from any thread; does nothing while no file is open
+    void record(RecordType type, const char* data, size_t size, uint16_t source = 0);
+    void record(const RecordType type, const std::string_view data, const uint16_t source = 0) {
+        record(type, data.data(), data.size(), source);
+    }
+
+    [[nodiscard]] Stats getStats() const;
+
+private:
+    const size_t bufferSize_;
+    mutable std::mutex mutex_;
+    std::condition_variable writerWakeup_;
+    // Filled by record(); swapped with flushing_ by the writer thread
+    std::vector<char> active_;
+    std::vector<char> flushing_;
+    // Records in active_
+    uint64_t activeRecords_ = 0;
+    std::thread writerThread_;
+    bool stopping_ = false;
+    int fd_ = -1;
+    std::chrono::steady_clock::time_point openedAt_;
+    Stats stats_ {};
+    uint16_t lastSource_ = 0;
+
+    void writerLoop();
+    bool writeAll(const char* data, size_t size) const;
+};
+
+} // namespace mimi
+
+#endif //SESSION_RECORDER_H
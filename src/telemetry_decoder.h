@@ -0,0 +1,152 @@
+#ifndef TELEMETRY_DECODER_H
+#define TELEMETRY_DECODER_H
+
+#include "ble_uart_client.h"
+#include <charconv>
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+namespace mimi {
+
+// How one kind of robot message is laid out: a prefix followed by fields, each preceded by the separator.
+// The fields are the members of a plain struct, listed in the order they appear in the line. Supported are
+// integers, floating point numbers, bool (0 or 1), char and std::string_view, which points into the line.
+template<typename Message, typename... Fields>
+struct MessageFormat {
+    using MessageType = Message;
+
+    std::string_view prefix;
+    char separator;
+    std::tuple<Fields Message::*...> fields;
+
+    // Parses the whole line or nothing; no allocations
+    bool parse(const std::string_view line, Message& message) const {
+        if (line.substr(0, prefix.size()) != prefix) return false;
+        const char* position = line.data() + prefix.size();
+        const char* const end = line.data() + line.size();
+        const bool parsed = std::apply([&](const auto... field) {
+            return (parseField(position, end, message.*field) && ...);
+        }, fields);
+        return parsed && position == end;
+    }
+
+private:
+    bool parseField(const char*& position, const char* const end, std::string_view& value) const {
+        if (position == end || *position != separator) return false;
+        const char* const begin = ++position;
+        while (position != end && *position != separator) ++position;
+        value = std::string_view(begin, static_cast<size_t>(position - begin));
+        return true;
+    }
+
+    bool parseField(const char*& position, const char* const end, char& value) const {
+        if (end - position < 2 || *position != separator) return false;
+        value = position[1];
+        position += 2;
+        return true;
+    }
+
+    bool parseField(const char*& position, const char* const end, bool& value) const {
+        if (end - position < 2 || *position != separator || (position[1] != '0' && position[1] != '1')) return false;
+        value = position[1] == '1';
+        position += 2;
+        return true;
+    }
+
+    template<typename Number, typename = std::enable_if_t<std::is_arithmetic_v<Number>>>
+    bool parseField(const char*& position, const char* const end, Number& value) const {
+        if (position == end || *position != separator) return false;
+        const auto [next, error] = std::from_chars(position + 1, end, value);
+        if (error != std::errc() || next == position + 1) return false;
+        position = next;
+        return true;
+    }
+};
+
+template<typename Message, typename... Fields>
+constexpr MessageFormat<Message, Fields...> messageFormat(const std::string_view prefix, const char separator,
+                                                          Fields Message::*... fields) {
+    return { prefix, separator, std::make_tuple(fields...) };
+}
+
+// Turns received lines into the structs of a fixed set of message formats and hands them to typed callbacks.
+// Formats are tried in the order given, so a format whose prefix starts another one's has to come later.
+// Lines matching no format, or a format without a callback, go to the fallback callback unchanged.
+// Install it with BleUartClient::setReceiveViewCallback(decoder.receiveViewCallback()); the decoder has to outlive that.
+template<typename... Formats>
+class TelemetryDecoder {
+public:
+    template<typename Message>
+    using MessageCallback = std::function<void(const std::string& deviceAlias, const Message& message)>;
+
+    constexpr explicit TelemetryDecoder(Formats... formats) : formats_(std::move(formats)...) {}
+
+    // Sets the callback of every format that decodes into Message
+    template<typename Message>
+    void onMessage(MessageCallback<Message> callback) {
+        setCallbacks<Message>(callback, std::index_sequence_for<Formats...>());
+    }
+
+    void onUnknown(BleUartClient::ReceiveViewCallback fallback) {
+        fallback_ = std::move(fallback);
+    }
+
+    // Returns true if a typed callback took the line
+    bool decode(const std::string& deviceAlias, const std::string_view line) const {
+        if (decodeWith(deviceAlias, line, std::index_sequence_for<Formats...>())) return true;
+        if (fallback_) fallback_(deviceAlias, line);
+        return false;
+    }
+
+    [[nodiscard]] BleUartClient::ReceiveViewCallback receiveViewCallback() const {
+        return [this](const std::string& deviceAlias, const std::string_view line) { decode(deviceAlias, line); };
+    }
+
+private:
+    std::tuple<Formats...> formats_;
+    std::tuple<MessageCallback<typename Formats::MessageType>...> callbacks_;
+    BleUartClient::ReceiveViewCallback fallback_ = nullptr;
+
+    template<typename Message, size_t Index>
+    void setCallback(const MessageCallback<Message>& callback) {
+        if constexpr (std::is_same_v<typename std::tuple_element_t<Index, std::tuple<Formats...>>::MessageType, Message>) {
+            std::get<Index>(callbacks_) = callback;
+        }
+    }
+
+    template<typename Message, size_t... Indices>
+    void setCallbacks(const MessageCallback<Message>& callback, std::index_sequence<Indices...>) {
+        (setCallback<Message, Indices>(callback), ...);
+    }
+
+    template<size_t Index>
+    bool decodeAs(const std::string& deviceAlias, const std::string_view line) const {
+        const auto& callback = std::get<Index>(callbacks_);
+        if (!callback) return false;
+        typename std::tuple_element_t<Index, std::tuple<Formats...>>::MessageType message {};
+        if (!std::get<Index>(formats_).parse(line, message)) return false;
+        callback(deviceAlias, message);
+        return true;
+    }
+
+    template<size_t... Indices>
+    bool decodeWith(const std::string& deviceAlias, const std::string_view line, std::index_sequence<Indices...>) const {
+        return (decodeAs<Indices>(deviceAlias, line) || ...);
+    }
+};
+
+// Builds a decoder from a constexpr table such as
+//   constexpr auto RobotFormats = std::make_tuple(messageFormat("M", ' ', &Motors::left, &Motors::right), ...);
+template<typename... Formats>
+TelemetryDecoder<Formats...> makeTelemetryDecoder(const std::tuple<Formats...>& formats) {
+    return std::make_from_tuple<TelemetryDecoder<Formats...>>(formats);
+}
+
+} // namespace mimi
+
+#endif //TELEMETRY_DECODER_H
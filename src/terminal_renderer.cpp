@@ -0,0 +1,168 @@
+// ReSharper disable CppTooWideScopeInitStatement
+#include "terminal_renderer.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+using namespace mimi;
+
+namespace {
+    // Rates are measured over windows of this length
+    constexpr std::chrono::seconds RateWindow { 1 };
+    constexpr std::string_view OtherKinds = "...";
+
+    void appendRate(std::string& out, const double rate) {
+        char text[32];
+        const int length = std::snprintf(text, sizeof(text), "%.1f/s", rate);
+        if (length > 0) out.append(text, static_cast<size_t>(length));
+    }
+}
+
+TerminalRenderer::TerminalRenderer(const int fd, const Options& options) :
+    fd_(fd),
+    options_(options),
+    inPlace_(isatty(fd) == 1) {
+    timerFd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    rateWindowStart_ = Clock::now();
+}
+
+TerminalRenderer::~TerminalRenderer() {
+    flush();
+    close(timerFd_);
+}
+
+void TerminalRenderer::setPrompt(std::string prompt) {
+    prompt_ = std::move(prompt);
+}
+
+void TerminalRenderer::line(const std::string_view alias, const std::string_view text) {
+    ++rateWindowLines_;
+    countKind(text);
+    if (summarizing_) {
+        summaryAlias_.assign(alias);
+        arm(options_.summaryInterval);
+    } else {
+        pending_.append("\r🤖 [").append(alias).append("]: ").append(text).push_back('\n');
+        arm(options_.frameInterval);
+    }
+    if (Clock::now() - rateWindowStart_ >= RateWindow) updateRate(Clock::now());
+}
+
+void TerminalRenderer::status(const std::string_view icon, const std::string_view alias, const std::string_view text) {
+    pending_.append("\r").append(icon).append(" [").append(alias).append("]: ").append(text).push_back('\n');
+    arm(options_.frameInterval);
+}
+
+int TerminalRenderer::getTimerFd() const {
+    return timerFd_;
+}
+
+bool TerminalRenderer::isSummarizing() const {
+    return summarizing_;
+}
+
+void TerminalRenderer::render() {
+    uint64_t expirations;
+    [[maybe_unused]] const auto n = read(timerFd_, &expirations, sizeof(expirations));
+    timerArmed_ = false;
+
+    const auto now = Clock::now();
+    updateRate(now);
+    frame_.clear();
+    bool drawSummary = summarizing_ && now - lastSummary_ >= options_.summaryInterval;
+    if (summaryHeight_ > 0 && (drawSummary || !pending_.empty())) {
+        // Back to the first line of the summary, which is cleared to the end of the screen and drawn anew
+        frame_.append("\r\x1b[").append(std::to_string(summaryHeight_)).append("A\x1b[J");
+        summaryHeight_ = 0;
+        drawSummary = summarizing_;
+    }
+    frame_.append(pending_);
+    pending_.clear();
+    if (drawSummary) appendSummary(now);
+    if (summarizing_) arm(lastSummary_ + options_.summaryInterval - now);
+    if (frame_.empty()) return;
+    frame_.append(prompt_);
+    writeFrame();
+}
+
+void TerminalRenderer::flush() {
+    if (!pending_.empty()) render();
+    summaryHeight_ = 0;
+}
+
+void TerminalRenderer::arm(const Clock::duration delay) {
+    if (timerArmed_) return;
+    timerArmed_ = true;
+    const auto nanoseconds = std::max<int64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(delay).count(), 1);
+    itimerspec timer {};
+    timer.it_value.tv_sec = static_cast<time_t>(nanoseconds / 1000000000);
+    timer.it_value.tv_nsec = static_cast<long>(nanoseconds % 1000000000);
+    timerfd_settime(timerFd_, 0, &timer, nullptr);
+}
+
+void TerminalRenderer::updateRate(const Clock::time_point now) {
+    const auto elapsed = now - rateWindowStart_;
+    if (elapsed < RateWindow) return;
+    rate_ = static_cast<double>(rateWindowLines_) / std::chrono::duration<double>(elapsed).count();
+    rateWindowStart_ = now;
+    rateWindowLines_ = 0;
+    if (options_.summaryThreshold <= 0.0) return;
+
+    if (!summarizing_ && rate_ > options_.summaryThreshold) {
+        // The first summary comes after one interval, with rates measured over it
+        summarizing_ = true;
+        lastSummary_ = now;
+        for (auto& [name, kind] : kinds_) {
+            kind.countAtLastSummary = kind.count;
+            kind.latest.clear();
+        }
+        arm(options_.summaryInterval);
+    } else if (summarizing_ && rate_ < options_.summaryThreshold / 2) {
+        // The last summary stays on screen and lines scroll below it again
+        summarizing_ = false;
+        summaryHeight_ = 0;
+    }
+}
+
+void TerminalRenderer::countKind(const std::string_view text) {
+    std::string_view name = text.substr(0, std::min(text.find(' '), MaxKindLength));
+    auto found = kinds_.find(name);
+    if (found == kinds_.end()) {
+        if (kinds_.size() >= MaxMessageKinds) name = OtherKinds;
+        found = kinds_.try_emplace(std::string(name)).first;
+    }
+    ++found->second.count;
+    if (summarizing_) found->second.latest.assign(text.substr(0, MaxSummaryTextLength));
+}
+
+void TerminalRenderer::appendSummary(const Clock::time_point now) {
+    const double elapsed = std::chrono::duration<double>(now - lastSummary_).count();
+    lastSummary_ = now;
+    frame_.append("\r📈 [").append(summaryAlias_).append("]: ");
+    appendRate(frame_, rate_);
+    frame_.append(", latest of each kind\n");
+    size_t height = 1;
+    for (auto& [name, kind] : kinds_) {
+        if (kind.latest.empty()) continue;
+        frame_.append("   ").append(name).append(name.size() < MaxKindLength ? MaxKindLength - name.size() : 0, ' ');
+        appendRate(frame_, static_cast<double>(kind.count - kind.countAtLastSummary) / elapsed);
+        frame_.append("  ").append(kind.latest).push_back('\n');
+        kind.countAtLastSummary = kind.count;
+        ++height;
+    }
+    if (inPlace_) summaryHeight_ = height;
+}
+
+void TerminalRenderer::writeFrame() {
+    size_t written = 0;
+    while (written < frame_.size()) {
+        const ssize_t n = write(fd_, frame_.data() + written, frame_.size() - written);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        written += static_cast<size_t>(n);
+    }
+}
@@ -0,0 +1,90 @@
+#ifndef TERMINAL_RENDERER_H
+#define TERMINAL_RENDERER_H
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+#include <string_view>
+
+namespace mimi {
+
+// Puts the robot's lines on the terminal without letting a chatty robot slow the terminal down.
+// Lines are formatted into one buffer and written once per frame, with the prompt redrawn once after them.
+// Above a rate threshold the lines no longer scroll by: a summary of the rate and latest line of each kind of message
+// (the line's first word) takes their place, redrawn in place when the output is a terminal.
+// Not thread-safe: feed it from the client callbacks of the thread that calls processCallbacks() and render().
+class TerminalRenderer {
+public:
+    struct Options {
+        std::chrono::milliseconds frameInterval { 30 };
+        // Received lines per second above which they are summarized; zero always shows every line
+        double summaryThreshold = 200.0;
+        std::chrono::milliseconds summaryInterval { 500 };
+    };
+
+    // Kinds of messages beyond this count are summarized together
+    static constexpr size_t MaxMessageKinds = 32;
+    static constexpr size_t MaxKindLength = 16;
+    static constexpr size_t MaxSummaryTextLength = 60;
+
+    TerminalRenderer(int fd, const Options& options);
+    ~TerminalRenderer();
+    TerminalRenderer(const TerminalRenderer&) = delete;
+    TerminalRenderer& operator=(const TerminalRenderer&) = delete;
+
+    // Drawn after every batch of output; empty for none
+    void setPrompt(std::string prompt);
+    // A line from the robot
+    void line(std::string_view alias, std::string_view text);
+    // Connection events and errors are never summarized
+    void status(std::string_view icon, std::string_view alias, std::string_view text);
+    // Becomes readable when queued output is due; call render() then
+    [[nodiscard]] int getTimerFd() const;
+    void render();
+    // Writes everything queued right away and leaves the summary on screen, so that other output can follow
+    void flush();
+    [[nodiscard]] bool isSummarizing() const;
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct MessageKind {
+        uint64_t count = 0;
+        uint64_t countAtLastSummary = 0;
+        std::string latest;
+    };
+
+    const int fd_;
+    const Options options_;
+    // The summary is redrawn in place on a terminal and appended otherwise
+    const bool inPlace_;
+    int timerFd_ = -1;
+    bool timerArmed_ = false;
+    std::string prompt_;
+    // Formatted lines waiting for the frame
+    std::string pending_;
+    // Reused for every write
+    std::string frame_;
+
+    bool summarizing_ = false;
+    std::string summaryAlias_;
+    std::map<std::string, MessageKind, std::less<>> kinds_;
+    Clock::time_point lastSummary_;
+    // Lines of the summary on screen, counted from the prompt line up
+    size_t summaryHeight_ = 0;
+    Clock::time_point rateWindowStart_;
+    uint64_t rateWindowLines_ = 0;
+    double rate_ = 0.0;
+
+    void arm(Clock::duration delay);
+    void updateRate(Clock::time_point now);
+    void countKind(std::string_view text);
+    void appendSummary(Clock::time_point now);
+    void writeFrame();
+};
+
+} // namespace mimi
+
+#endif //TERMINAL_RENDERER_H
@@ -0,0 +1,103 @@
+#include "write_pacer.h"
+#include <algorithm>
+
+using namespace mimi;
+
+namespace {
+    // Shorter writes are never taken for a sign of congestion, however much longer than usual they take
+    constexpr std::chrono::milliseconds MinSlowWriteTime { 1 };
+}
+
+WritePacer::WritePacer(const size_t chunkSize) {
+    reset(chunkSize);
+}
+
+bool WritePacer::isBusyError(const std::string& errorName) {
+    return errorName == "org.bluez.Error.InProgress" ||
+           errorName == "org.bluez.Error.Busy" ||
+           errorName == "org.freedesktop.DBus.Error.LimitsExceeded";
+}
+
+void WritePacer::reset(const size_t chunkSize) {
+    std::lock_guard lock(mutex_);
+    chunkSize_ = std::max<size_t>(chunkSize, 1);
+    paced_ = false;
+    window_ = MaxWindowChunks * chunkSize_;
+    paceTime_ = Clock::time_point();
+    intervalStart_ = Clock::now();
+    intervalBytes_ = 0;
+    lastIntervalBytes_ = 0;
+    intervalSlowWrite_ = false;
+    lastDecrease_ = Clock::time_point();
+    smoothedWriteTime_ = Clock::duration::zero();
+}
+
+WritePacer::Clock::time_point WritePacer::schedule(const size_t size, const Clock::time_point now) {
+    std::lock_guard lock(mutex_);
+    if (now - intervalStart_ >= Interval) nextInterval(now);
+    if (!paced_) return now;
+    // After a pause at most one window of writes goes out at once
+    paceTime_ = std::max(paceTime_, now - Interval);
+    const auto start = std::max(paceTime_, now);
+    paceTime_ += Clock::duration(Interval) * static_cast<Clock::rep>(size) / static_cast<Clock::rep>(window_.load());
+    return start;
+}
+
+void WritePacer::onWritten(const size_t size, const Clock::duration writeTime, const Clock::time_point now) {
+    std::lock_guard lock(mutex_);
+    if (smoothedWriteTime_ == Clock::duration::zero()) {
+        smoothedWriteTime_ = writeTime;
+    } else {
+        if (writeTime > 2 * smoothedWriteTime_ && writeTime > MinSlowWriteTime) intervalSlowWrite_ = true;
+        smoothedWriteTime_ += (writeTime - smoothedWriteTime_) / 8;
+    }
+    if (now - intervalStart_ >= Interval) nextInterval(now);
+    intervalBytes_ += size;
+}
+
+WritePacer::Clock::duration WritePacer::onBusy(const unsigned attempt, const Clock::time_point now) {
+    std::lock_guard lock(mutex_);
+    ++busyErrors_;
+    // Writes refused close together were all sent at the same window, which is only halved once for them
+    if (now - lastDecrease_ >= Interval) {
+        // Unpaced writes had no window yet: what got through recently stands for it
+        const size_t window = paced_ ? window_.load() : std::max(intervalBytes_, lastIntervalBytes_);
+        window_ = std::max(window / 2, chunkSize_);
+        paced_ = true;
+        lastDecrease_ = now;
+        ++decreases_;
+    }
+    const Clock::duration backoff = std::min<Clock::duration>(MinBackoff * (1u << std::min(attempt, 16u)), MaxBackoff);
+    paceTime_ = std::max(paceTime_, now + backoff);
+    return backoff;
+}
+
+size_t WritePacer::getWindow() const {
+    return paced_ ? window_.load() : 0;
+}
+
+WritePacer::Stats WritePacer::getStats() const {
+    std::lock_guard lock(mutex_);
+    return {
+        chunkSize_,
+        paced_,
+        window_,
+        std::chrono::duration_cast<std::chrono::microseconds>(smoothedWriteTime_),
+        busyErrors_,
+        decreases_,
+    };
+}
+
+void WritePacer::nextInterval(const Clock::time_point now) {
+    // Only a window that was used shows that the link keeps up with it
+    if (paced_ && intervalBytes_ * 2 >= window_ && !intervalSlowWrite_ && lastDecrease_ < intervalStart_) {
+        window_ += chunkSize_;
+        // The link keeps up with anything the writer is likely to produce
+        if (window_ >= MaxWindowChunks * chunkSize_) paced_ = false;
+    }
+    // A pause longer than an interval leaves nothing to compare the next busy error with
+    lastIntervalBytes_ = now - intervalStart_ < 2 * Interval ? intervalBytes_ : 0;
+    intervalStart_ = now;
+    intervalBytes_ = 0;
+    intervalSlowWrite_ = false;
+}
@@ -0,0 +1,77 @@
+#ifndef WRITE_PACER_H
+#define WRITE_PACER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+namespace mimi {
+
+// Decides when the writer may put the next chunk on the link, so that it neither leaves bandwidth unused nor floods
+// a link that cannot keep up. Writes are not paced until the link first refuses one as busy. The window, the number
+// of bytes that may be written per Interval, then starts at half the rate written before and grows by one chunk
+// every interval that used it, up to MaxWindowChunks, where pacing stops again. Every busy error halves it (AIMD).
+// A write that takes more than twice the usual time keeps the window from growing in its interval. Thread-safe.
+class WritePacer {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Stats {
+        size_t chunkSize;
+        bool paced;
+        // Bytes per Interval
+        size_t window;
+        std::chrono::microseconds smoothedWriteTime;
+        uint64_t busyErrors;
+        uint64_t decreases;
+    };
+
+    static constexpr std::chrono::milliseconds Interval { 10 };
+    static constexpr size_t MaxWindowChunks = 256;
+    static constexpr std::chrono::milliseconds MinBackoff { 2 };
+    static constexpr std::chrono::milliseconds MaxBackoff { 200 };
+    // A write still refused as busy after this long fails
+    static constexpr std::chrono::seconds MaxBusyTime { 2 };
+
+    explicit WritePacer(size_t chunkSize = 20);
+
+    // Errors BlueZ answers with while the controller has no room for another write
+    static bool isBusyError(const std::string& errorName);
+
+    // Starts over for a new connection, whose writes carry up to chunkSize bytes
+    void reset(size_t chunkSize);
+    // When a write of the size may start; the write is counted against the window from then on
+    Clock::time_point schedule(size_t size, Clock::time_point now);
+    void onWritten(size_t size, Clock::duration writeTime, Clock::time_point now);
+    // A write was refused as busy; returns how long to wait before its retry number attempt (counted from 0)
+    Clock::duration onBusy(unsigned attempt, Clock::time_point now);
+
+    // Zero while writes are not paced
+    [[nodiscard]] size_t getWindow() const;
+    [[nodiscard]] Stats getStats() const;
+
+private:
+    mutable std::mutex mutex_;
+    size_t chunkSize_ = 0;
+    std::atomic<bool> paced_ = false;
+    std::atomic<size_t> window_ = 0;
+    // Writes are spread over time as if each started here and took its share of the Interval
+    Clock::time_point paceTime_;
+    Clock::time_point intervalStart_;
+    size_t intervalBytes_ = 0;
+    size_t lastIntervalBytes_ = 0;
+    bool intervalSlowWrite_ = false;
+    Clock::time_point lastDecrease_;
+    Clock::duration smoothedWriteTime_ { 0 };
+    uint64_t busyErrors_ = 0;
+    uint64_t decreases_ = 0;
+
+    void nextInterval(Clock::time_point now);
+};
+
+} // namespace mimi
+
+#endif //WRITE_PACER_H